@@ -18,6 +18,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "trace.h"
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
@@ -27,6 +28,7 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     void *opaque;
     bool is_external;
@@ -202,6 +204,13 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+/* Does @node keep the AioContext out of polling mode? */
+static bool aio_node_disables_poll(AioHandler *node)
+{
+    return node && !node->deleted && (node->io_read || node->io_write) &&
+           !node->io_poll;
+}
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         bool is_external,
@@ -212,8 +221,10 @@ void aio_set_fd_handler(AioContext *ctx,
     AioHandler *node;
     bool is_new = false;
     bool deleted = false;
+    bool disabled_poll;
 
     node = find_aio_handler(ctx, fd);
+    disabled_poll = aio_node_disables_poll(node);
 
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
@@ -253,6 +264,11 @@ void aio_set_fd_handler(AioContext *ctx,
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
     }
 
+    ctx->poll_disable_cnt -= disabled_poll;
+    if (!deleted) {
+        ctx->poll_disable_cnt += aio_node_disables_poll(node);
+    }
+
     aio_epoll_update(ctx, node, is_new);
     aio_notify(ctx);
     if (deleted) {
@@ -269,6 +285,28 @@ void aio_set_event_notifier(AioContext *ctx,
                        is_external, (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node;
+    bool disabled_poll;
+
+    node = find_aio_handler(ctx, fd);
+    if (!node) {
+        return;
+    }
+
+    disabled_poll = aio_node_disables_poll(node);
+    node->io_poll = io_poll;
+    ctx->poll_disable_cnt += aio_node_disables_poll(node) - disabled_poll;
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -405,12 +443,97 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+static bool run_poll_handlers_once(AioContext *ctx, bool *progress)
+{
+    bool ready = false;
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external) &&
+            node->io_poll(node->opaque)) {
+            ready = true;
+
+            /* aio_notify() does not count as progress */
+            if (node->opaque != &ctx->notifier) {
+                *progress = true;
+            }
+        }
+    }
+
+    return ready;
+}
+
+/* Busy-wait on the io_poll() callbacks for up to @max_ns nanoseconds.
+ *
+ * Polling is only attempted if every handler has an io_poll() callback,
+ * otherwise events on the remaining file descriptors would be delayed.
+ * The caller must hold ctx->walking_handlers and must have incremented
+ * ctx->notify_me, so that aio_notify() is observed by the notifier's
+ * io_poll() callback.
+ *
+ * Returns true if an event is ready, setting *@progress if a callback
+ * made progress.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns, bool *progress)
+{
+    bool ready;
+    int64_t end_time;
+
+    assert(ctx->notify_me);
+    assert(ctx->walking_handlers > 0);
+
+    trace_run_poll_handlers_begin(ctx, max_ns);
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    do {
+        ready = run_poll_handlers_once(ctx, progress);
+    } while (!ready && !ctx->poll_disable_cnt &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    trace_run_poll_handlers_end(ctx, ready);
+    return ready;
+}
+
+/* Adjust the polling time after an aio_poll() call that waited @block_ns
+ * nanoseconds for an event, counting polling time.
+ */
+static void aio_poll_adjust(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+        trace_poll_shrink(ctx, old, ctx->poll_ns);
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = 4000; /* start polling at 4 microseconds */
+        } else {
+            ctx->poll_ns *= grow;
+        }
+        ctx->poll_ns = MIN(ctx->poll_ns, ctx->poll_max_ns);
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int i, ret;
     bool progress;
+    bool adaptive_poll;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
@@ -430,6 +553,28 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+    /* Busy-wait for a little while before blocking in poll().  Do not
+     * poll past the next timer deadline or when a BH is already pending.
+     */
+    adaptive_poll = timeout && ctx->poll_max_ns && !ctx->poll_disable_cnt;
+    if (adaptive_poll) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (ctx->poll_ns) {
+            int64_t max_ns = timeout < 0 ? ctx->poll_ns
+                                         : MIN(ctx->poll_ns, timeout);
+
+            if (run_poll_handlers(ctx, max_ns, &progress)) {
+                ctx->poll_hits++;
+                timeout = 0;
+            } else {
+                ctx->poll_misses++;
+                timeout = aio_compute_timeout(ctx);
+            }
+        }
+    }
+
     /* fill pollfds */
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         if (!node->deleted && node->pfd.events
@@ -439,8 +584,6 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
-
     /* wait until next event */
     if (timeout) {
         aio_context_release(ctx);
@@ -463,6 +606,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
         aio_context_acquire(ctx);
     }
 
+    if (adaptive_poll) {
+        aio_poll_adjust(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
     aio_notify_accept(ctx);
 
     /* if we have any readable fds, dispatch event */
@@ -498,3 +645,17 @@ void aio_context_setup(AioContext *ctx)
     }
 #endif
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect value
+     * is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
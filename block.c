@@ -2267,9 +2267,6 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
 
-    bdrv_release_named_dirty_bitmaps(bs);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
-
     if (bs->drv) {
         BdrvChild *child, *next;
 
@@ -2308,6 +2305,11 @@ static void bdrv_close(BlockDriverState *bs)
         bs->full_open_options = NULL;
     }
 
+    /* Released only now so that drivers can store persistent bitmaps when
+     * the image is closed. */
+    bdrv_release_named_dirty_bitmaps(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -2997,6 +2999,28 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+/*
+ * Return a host file descriptor from which the data of @bs can be read
+ * directly, at the same offsets, or a negative errno if there is none.
+ *
+ * Reads from the file descriptor bypass the block layer, so the caller
+ * must bracket them with bdrv_inc_in_flight() and bdrv_dec_in_flight()
+ * for bdrv_drain() to wait for them, and must not keep the file descriptor
+ * across a reopen of @bs; dup() it if in doubt.
+ */
+int bdrv_get_raw_fd(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_get_raw_fd) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_raw_fd(bs);
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
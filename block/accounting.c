@@ -46,9 +46,14 @@ void block_acct_init(BlockAcctStats *stats, bool account_invalid,
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    int i;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_remove(stats, i);
+    }
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -76,6 +81,32 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
     }
 }
 
+/* Like the other statistics, histograms are only updated from the AioContext
+ * of the BlockBackend and read with the AioContext acquired, so the bins are
+ * plain counters and accounting a request takes no lock.  */
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    int lo = 0, hi = hist->nbins - 1;
+
+    if (!hist->bins) {
+        return;
+    }
+
+    /* Find the first boundary above latency_ns */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if ((uint64_t) latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    hist->bins[lo]++;
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -106,6 +137,8 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
     }
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -129,6 +162,8 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+        block_latency_histogram_account(
+            &stats->latency_histogram[cookie->type], latency_ns);
     }
 }
 
@@ -171,3 +206,110 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 
     return (double) sum / elapsed;
 }
+
+/* Log-linear default: 1, 2, ..., 9 times each power of ten from 1 us to
+ * 1 s, and 10 s.  */
+#define LATENCY_HISTOGRAM_DEFAULT_DECADES 7
+
+static uint64_t *block_latency_histogram_default(int *nbins)
+{
+    uint64_t *boundaries;
+    uint64_t decade = 1000;
+    int i, j, n = 0;
+
+    *nbins = LATENCY_HISTOGRAM_DEFAULT_DECADES * 9 + 2;
+    boundaries = g_new(uint64_t, *nbins - 1);
+    for (i = 0; i < LATENCY_HISTOGRAM_DEFAULT_DECADES; i++) {
+        for (j = 1; j <= 9; j++) {
+            boundaries[n++] = j * decade;
+        }
+        decade *= 10;
+    }
+    boundaries[n++] = decade;
+    assert(n == *nbins - 1);
+
+    return boundaries;
+}
+
+/* Return whether @boundaries, if given, are non-zero and strictly
+ * ascending, as required by block_latency_histogram_set().  */
+bool block_latency_histogram_check(uint64List *boundaries)
+{
+    uint64List *entry;
+    uint64_t prev = 0;
+
+    for (entry = boundaries; entry; entry = entry->next) {
+        if (entry->value <= prev) {
+            return false;
+        }
+        prev = entry->value;
+    }
+    return true;
+}
+
+/* Enable the latency histogram of @type requests with the given interval
+ * @boundaries in nanoseconds, or the default ones if @boundaries is NULL.
+ * The boundaries must be non-zero and strictly ascending.  Any previous
+ * histogram is discarded.  */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist;
+    uint64_t *new_boundaries;
+    uint64List *entry;
+    int i, nbins = 1;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    hist = &stats->latency_histogram[type];
+
+    if (boundaries) {
+        if (!block_latency_histogram_check(boundaries)) {
+            return -EINVAL;
+        }
+        for (entry = boundaries; entry; entry = entry->next) {
+            nbins++;
+        }
+
+        new_boundaries = g_new(uint64_t, nbins - 1);
+        for (entry = boundaries, i = 0; entry; entry = entry->next, i++) {
+            new_boundaries[i] = entry->value;
+        }
+    } else {
+        new_boundaries = block_latency_histogram_default(&nbins);
+    }
+
+    block_latency_histogram_remove(stats, type);
+    hist->nbins = nbins;
+    hist->boundaries = new_boundaries;
+    hist->bins = g_new0(uint64_t, nbins);
+
+    return 0;
+}
+
+void block_latency_histogram_reset(BlockAcctStats *stats,
+                                   enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hist;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    hist = &stats->latency_histogram[type];
+
+    if (hist->bins) {
+        memset(hist->bins, 0, hist->nbins * sizeof(hist->bins[0]));
+    }
+}
+
+void block_latency_histogram_remove(BlockAcctStats *stats,
+                                    enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hist;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    hist = &stats->latency_histogram[type];
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    hist->nbins = 0;
+    hist->boundaries = NULL;
+    hist->bins = NULL;
+}
@@ -26,6 +26,8 @@
 #include "qemu/bitmap.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_CHUNK (1 << 20)
+#define BACKUP_MAX_WORKERS_DEFAULT 8
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct BackupBlockJob {
@@ -41,11 +43,32 @@ typedef struct BackupBlockJob {
     uint64_t sectors_read;
     unsigned long *done_bitmap;
     int64_t cluster_size;
+    /* Maximum number of clusters copied with a single request */
+    int64_t chunk_clusters;
     bool compress;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    /* Clusters that remain to be copied in the background, and where to
+     * look for the next ones */
+    unsigned long *copy_bitmap;
+    int64_t next_cluster;
+    int max_workers;
+    int in_flight;
+    /* Copy-before-write requests from the guest in progress */
+    int cbw_in_flight;
+    bool waiting_for_io;
+    /* First error of a background copy, not handled yet */
+    int copy_ret;
+    bool copy_error_is_read;
 } BackupBlockJob;
 
+typedef struct BackupCopyOp {
+    BackupBlockJob *job;
+    int64_t start;
+    int64_t end;
+} BackupCopyOp;
+
 /* Size of a cluster in sectors, instead of bytes. */
 static inline int64_t cluster_size_sectors(BackupBlockJob *job)
 {
@@ -101,7 +124,7 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    int64_t start, end;
+    int64_t start, end, chunk_end;
     int n;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
@@ -114,20 +137,30 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start = chunk_end) {
         if (test_bit(start, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
+            chunk_end = start + 1;
             continue; /* already copied */
         }
 
-        trace_backup_do_cow_process(job, start);
+        /* Copy adjacent clusters that are not copied yet with one request */
+        chunk_end = start + 1;
+        while (chunk_end < end && chunk_end - start < job->chunk_clusters &&
+               !test_bit(chunk_end, job->done_bitmap)) {
+            chunk_end++;
+        }
+
+        trace_backup_do_cow_process(job, start, chunk_end - start);
 
-        n = MIN(sectors_per_cluster,
+        n = MIN((chunk_end - start) * sectors_per_cluster,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * sectors_per_cluster);
 
         if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
+            int64_t bounce_clusters = MIN(end - start, job->chunk_clusters);
+            bounce_buffer = blk_blockalign(blk, bounce_clusters *
+                                                job->cluster_size);
         }
         iov.iov_base = bounce_buffer;
         iov.iov_len = n * BDRV_SECTOR_SIZE;
@@ -160,7 +193,7 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
             goto out;
         }
 
-        set_bit(start, job->done_bitmap);
+        bitmap_set(job->done_bitmap, start, chunk_end - start);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
@@ -183,6 +216,22 @@ out:
     return ret;
 }
 
+/* Wake up the job coroutine if it waits for a copy to complete */
+static void backup_kick(BackupBlockJob *job)
+{
+    if (job->waiting_for_io) {
+        qemu_coroutine_enter(job->common.co);
+    }
+}
+
+static void coroutine_fn backup_wait_for_io(BackupBlockJob *job)
+{
+    assert(!job->waiting_for_io);
+    job->waiting_for_io = true;
+    qemu_coroutine_yield();
+    job->waiting_for_io = false;
+}
+
 static int coroutine_fn backup_before_write_notify(
         NotifierWithReturn *notifier,
         void *opaque)
@@ -191,12 +240,20 @@ static int coroutine_fn backup_before_write_notify(
     BdrvTrackedRequest *req = opaque;
     int64_t sector_num = req->offset >> BDRV_SECTOR_BITS;
     int nb_sectors = req->bytes >> BDRV_SECTOR_BITS;
+    int ret;
 
     assert(req->bs == blk_bs(job->common.blk));
     assert((req->offset & (BDRV_SECTOR_SIZE - 1)) == 0);
     assert((req->bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
 
-    return backup_do_cow(job, sector_num, nb_sectors, NULL, true);
+    /* Background copies are held back while the guest waits for us */
+    job->cbw_in_flight++;
+    ret = backup_do_cow(job, sector_num, nb_sectors, NULL, true);
+    if (--job->cbw_in_flight == 0) {
+        backup_kick(job);
+    }
+
+    return ret;
 }
 
 static void backup_set_speed(BlockJob *job, int64_t speed, Error **errp)
@@ -361,17 +418,18 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
-static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+/* Queue the dirty clusters of the sync bitmap for copying, and account for
+ * the clean ones as progress right away. */
+static void backup_incremental_init_copy_bitmap(BackupBlockJob *job)
 {
-    bool error_is_read;
-    int ret = 0;
     int clusters_per_iter;
     uint32_t granularity;
     int64_t sector;
     int64_t cluster;
     int64_t end;
-    int64_t last_cluster = -1;
+    int64_t last_end = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t nb_clusters = DIV_ROUND_UP(job->common.len, job->cluster_size);
     HBitmapIter hbi;
 
     granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
@@ -381,42 +439,173 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     /* Find the next dirty sector(s) */
     while ((sector = hbitmap_iter_next(&hbi)) != -1) {
         cluster = sector / sectors_per_cluster;
+        end = MIN(cluster + clusters_per_iter, nb_clusters);
 
         /* Fake progress updates for any clusters we skipped */
-        if (cluster != last_cluster + 1) {
-            job->common.offset += ((cluster - last_cluster - 1) *
-                                   job->cluster_size);
+        if (cluster > last_end) {
+            job->common.offset += (cluster - last_end) * job->cluster_size;
         }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
-            do {
-                if (yield_and_check(job)) {
-                    return ret;
-                }
-                ret = backup_do_cow(job, cluster * sectors_per_cluster,
-                                    sectors_per_cluster, &error_is_read,
-                                    false);
-                if ((ret < 0) &&
-                    backup_error_action(job, error_is_read, -ret) ==
-                    BLOCK_ERROR_ACTION_REPORT) {
-                    return ret;
-                }
-            } while (ret < 0);
-        }
+        bitmap_set(job->copy_bitmap, cluster, end - cluster);
 
         /* If the bitmap granularity is smaller than the backup granularity,
          * we need to advance the iterator pointer to the next cluster. */
         if (granularity < job->cluster_size) {
-            bdrv_set_dirty_iter(&hbi, cluster * sectors_per_cluster);
+            bdrv_set_dirty_iter(&hbi, end * sectors_per_cluster);
         }
 
-        last_cluster = cluster - 1;
+        last_end = end;
     }
 
     /* Play some final catchup with the progress meter */
-    end = DIV_ROUND_UP(job->common.len, job->cluster_size);
-    if (last_cluster + 1 < end) {
-        job->common.offset += ((end - last_cluster - 1) * job->cluster_size);
+    if (last_end < nb_clusters) {
+        job->common.offset += (nb_clusters - last_end) * job->cluster_size;
+    }
+}
+
+/* Check to see if a cluster has data in the topmost image */
+static bool backup_cluster_is_allocated(BackupBlockJob *job, int64_t cluster)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int i, n;
+    int alloced = 0;
+
+    for (i = 0; i < sectors_per_cluster;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced =
+            bdrv_is_allocated(bs,
+                    cluster * sectors_per_cluster + i,
+                    sectors_per_cluster - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    return alloced != 0;
+}
+
+/* Take the next run of at most chunk_clusters clusters to copy off the copy
+ * bitmap.  Returns false if there is nothing left to copy.  */
+static bool backup_next_range(BackupBlockJob *job, int64_t *start,
+                              int64_t *end)
+{
+    int64_t nb_clusters = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    int64_t cluster, i;
+
+    for (;;) {
+        cluster = find_next_bit(job->copy_bitmap, nb_clusters,
+                                job->next_cluster);
+        if (cluster >= nb_clusters) {
+            job->next_cluster = nb_clusters;
+            return false;
+        }
+
+        for (i = cluster; i < nb_clusters && i - cluster < job->chunk_clusters
+                          && test_bit(i, job->copy_bitmap); i++) {
+            /* sync=top skips the clusters that are in the backing file */
+            if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
+                !backup_cluster_is_allocated(job, i)) {
+                clear_bit(i, job->copy_bitmap);
+                break;
+            }
+        }
+
+        job->next_cluster = i;
+        if (i > cluster) {
+            bitmap_clear(job->copy_bitmap, cluster, i - cluster);
+            *start = cluster;
+            *end = i;
+            return true;
+        }
+    }
+}
+
+static void coroutine_fn backup_copy_entry(void *opaque)
+{
+    BackupCopyOp *op = opaque;
+    BackupBlockJob *job = op->job;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job, op->start * sectors_per_cluster,
+                        (op->end - op->start) * sectors_per_cluster,
+                        &error_is_read, false);
+    if (ret < 0) {
+        /* Queue the range again; backup_run_copy() decides whether it is
+         * retried, depending on the error action. */
+        bitmap_set(job->copy_bitmap, op->start, op->end - op->start);
+        job->next_cluster = MIN(job->next_cluster, op->start);
+        if (!job->copy_ret) {
+            job->copy_ret = ret;
+            job->copy_error_is_read = error_is_read;
+        }
+    }
+
+    job->in_flight--;
+    g_free(op);
+    backup_kick(job);
+}
+
+/* Copy the clusters of the copy bitmap with up to max_workers concurrent
+ * requests.  Copy-before-write requests of the guest take precedence: while
+ * there are some, a single background copy is kept in flight.  */
+static int coroutine_fn backup_run_copy(BackupBlockJob *job)
+{
+    BackupCopyOp *op;
+    int64_t start, end;
+    int ret = 0;
+
+    for (;;) {
+        while (job->in_flight >=
+               (job->cbw_in_flight ? 1 : job->max_workers)) {
+            backup_wait_for_io(job);
+        }
+
+        if (job->copy_ret < 0) {
+            ret = job->copy_ret;
+            job->copy_ret = 0;
+            /* Depending on error action, fail now or retry the range */
+            if (backup_error_action(job, job->copy_error_is_read, -ret) ==
+                BLOCK_ERROR_ACTION_REPORT) {
+                break;
+            }
+            ret = 0;
+        }
+
+        if (yield_and_check(job)) {
+            break;
+        }
+
+        if (!backup_next_range(job, &start, &end)) {
+            if (job->in_flight == 0) {
+                break;
+            }
+            /* A failed copy may requeue its clusters */
+            backup_wait_for_io(job);
+            continue;
+        }
+
+        op = g_new(BackupCopyOp, 1);
+        *op = (BackupCopyOp) {
+            .job    = job,
+            .start  = start,
+            .end    = end,
+        };
+        job->in_flight++;
+        qemu_coroutine_enter(qemu_coroutine_create(backup_copy_entry, op));
+    }
+
+    while (job->in_flight > 0) {
+        backup_wait_for_io(job);
     }
 
     return ret;
@@ -428,17 +617,16 @@ static void coroutine_fn backup_run(void *opaque)
     BackupCompleteData *data;
     BlockDriverState *bs = blk_bs(job->common.blk);
     BlockBackend *target = job->target;
-    int64_t start, end;
-    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->done_bitmap = bitmap_new(end);
+    job->copy_bitmap = bitmap_new(end);
 
     job->before_write.notify = backup_before_write_notify;
     bdrv_add_before_write_notifier(bs, &job->before_write);
@@ -449,62 +637,14 @@ static void coroutine_fn backup_run(void *opaque)
              * notify callback service CoW requests. */
             block_job_yield(&job->common);
         }
-    } else if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
-        ret = backup_run_incremental(job);
     } else {
-        /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(job, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
+        if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+            backup_incremental_init_copy_bitmap(job);
+        } else {
+            /* Both FULL and TOP SYNC_MODE's require copying.. */
+            bitmap_fill(job->copy_bitmap, end);
         }
+        ret = backup_run_copy(job);
     }
 
     notifier_with_return_remove(&job->before_write);
@@ -513,6 +653,7 @@ static void coroutine_fn backup_run(void *opaque)
     qemu_co_rwlock_wrlock(&job->flush_rwlock);
     qemu_co_rwlock_unlock(&job->flush_rwlock);
     g_free(job->done_bitmap);
+    g_free(job->copy_bitmap);
 
     bdrv_op_unblock_all(blk_bs(target), job->common.blocker);
 
@@ -524,7 +665,7 @@ static void coroutine_fn backup_run(void *opaque)
 void backup_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
-                  bool compress,
+                  bool compress, int max_workers,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb, void *opaque,
@@ -543,6 +684,15 @@ void backup_start(const char *job_id, BlockDriverState *bs,
         return;
     }
 
+    if (max_workers == 0) {
+        max_workers = BACKUP_MAX_WORKERS_DEFAULT;
+    }
+    if (max_workers < 1 || max_workers > BACKUP_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value in range [1, " stringify(BACKUP_MAX_WORKERS) "]");
+        return;
+    }
+
     if (!bdrv_is_inserted(bs)) {
         error_setg(errp, "Device is not inserted: %s",
                    bdrv_get_device_name(bs));
@@ -629,6 +779,11 @@ void backup_start(const char *job_id, BlockDriverState *bs,
         job->cluster_size = MAX(BACKUP_CLUSTER_SIZE_DEFAULT, bdi.cluster_size);
     }
 
+    /* Compressed writes must be exactly one cluster */
+    job->chunk_clusters = compress ? 1 :
+                          MAX(BACKUP_MAX_CHUNK / job->cluster_size, 1);
+    job->max_workers = max_workers;
+
     bdrv_op_block_all(target, job->common.blocker);
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run, job);
@@ -130,6 +130,7 @@ BlockBackend *blk_new(void)
 
     qemu_co_queue_init(&blk->public.throttled_reqs[0]);
     qemu_co_queue_init(&blk->public.throttled_reqs[1]);
+    blk->public.throttle_weight = THROTTLE_GROUP_WEIGHT_DEFAULT;
 
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -35,10 +36,22 @@
 #define BLOCK_CRYPTO_OPT_LUKS_HASH_ALG "hash-alg"
 #define BLOCK_CRYPTO_OPT_LUKS_ITER_TIME "iter-time"
 
+/* Maximum number of threads that encrypt or decrypt a single request */
+#define BLOCK_CRYPTO_MAX_THREADS 8
+
+/* Smallest number of sectors that is handed to the thread pool at once */
+#define BLOCK_CRYPTO_MIN_TASK_SECTORS 64
+
 typedef struct BlockCrypto BlockCrypto;
 
 struct BlockCrypto {
     QCryptoBlock *block;
+    unsigned int n_threads;
+
+    /* Slices in the thread pool, at most n_threads.  The block has one
+     * cipher more than that, which is left for the inline path. */
+    unsigned int n_pool_tasks;
+    CoQueue pool_queue;
 };
 
 
@@ -286,6 +299,25 @@ block_crypto_create_opts_init(QCryptoBlockFormat format,
 }
 
 
+/* Number of ciphers to create, which is also the number of thread pool
+ * workers that a single request may use: one per host CPU, capped to
+ * BLOCK_CRYPTO_MAX_THREADS.
+ */
+static unsigned int block_crypto_default_threads(void)
+{
+    long n;
+#ifdef _WIN32
+    SYSTEM_INFO system_info;
+
+    GetSystemInfo(&system_info);
+    n = system_info.dwNumberOfProcessors;
+#else
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(1, MIN(n, BLOCK_CRYPTO_MAX_THREADS));
+}
+
+
 static int block_crypto_open_generic(QCryptoBlockFormat format,
                                      QemuOptsList *opts_spec,
                                      BlockDriverState *bs,
@@ -315,10 +347,13 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     if (flags & BDRV_O_NO_IO) {
         cflags |= QCRYPTO_BLOCK_OPEN_NO_IO;
     }
+    crypto->n_threads = block_crypto_default_threads();
+    qemu_co_queue_init(&crypto->pool_queue);
     crypto->block = qcrypto_block_open(open_opts,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
+                                       crypto->n_threads + 1,
                                        errp);
 
     if (!crypto->block) {
@@ -393,7 +428,119 @@ static void block_crypto_close(BlockDriverState *bs)
 }
 
 
-#define BLOCK_CRYPTO_MAX_SECTORS 32
+#define BLOCK_CRYPTO_MAX_SECTORS 2048
+
+typedef struct BlockCryptoTask {
+    QCryptoBlock *block;
+    uint64_t sector_num;
+    uint8_t *buf;
+    size_t len;
+    bool encrypt;
+} BlockCryptoTask;
+
+typedef struct BlockCryptoTaskGroup {
+    Coroutine *co;
+    unsigned int in_flight;
+    int ret;
+} BlockCryptoTaskGroup;
+
+static int block_crypto_task_func(void *opaque)
+{
+    BlockCryptoTask *task = opaque;
+    int ret;
+
+    if (task->encrypt) {
+        ret = qcrypto_block_encrypt(task->block, task->sector_num,
+                                    task->buf, task->len, NULL);
+    } else {
+        ret = qcrypto_block_decrypt(task->block, task->sector_num,
+                                    task->buf, task->len, NULL);
+    }
+    return ret < 0 ? -EIO : 0;
+}
+
+static void block_crypto_task_cb(void *opaque, int ret)
+{
+    BlockCryptoTaskGroup *group = opaque;
+
+    if (ret < 0) {
+        group->ret = ret;
+    }
+    if (--group->in_flight == 0) {
+        qemu_coroutine_enter(group->co);
+    }
+}
+
+/*
+ * Encrypts or decrypts @nb_sectors sectors in @buf.  Chunks of at least
+ * BLOCK_CRYPTO_MIN_TASK_SECTORS are processed in the thread pool, so that
+ * the event loop is not blocked; larger chunks are split into up to
+ * n_threads slices that run in parallel.
+ */
+static coroutine_fn int
+block_crypto_co_cipher(BlockDriverState *bs, int64_t sector_num,
+                       uint8_t *buf, int nb_sectors, bool encrypt)
+{
+    BlockCrypto *crypto = bs->opaque;
+    BlockCryptoTask tasks[BLOCK_CRYPTO_MAX_THREADS];
+    BlockCryptoTaskGroup group = {
+        .co = qemu_coroutine_self(),
+    };
+    ThreadPool *pool;
+    unsigned int n_tasks, i;
+    int task_sectors;
+
+    n_tasks = MIN(crypto->n_threads,
+                  nb_sectors / BLOCK_CRYPTO_MIN_TASK_SECTORS);
+    if (n_tasks == 0) {
+        BlockCryptoTask task = {
+            .block = crypto->block,
+            .sector_num = sector_num,
+            .buf = buf,
+            .len = nb_sectors * 512,
+            .encrypt = encrypt,
+        };
+        return block_crypto_task_func(&task);
+    }
+
+    task_sectors = DIV_ROUND_UP(nb_sectors, n_tasks);
+    n_tasks = DIV_ROUND_UP(nb_sectors, task_sectors);
+
+    /* Cap the slices in the thread pool, so that the inline path above never
+     * waits for a cipher and blocks the event loop. */
+    while (crypto->n_pool_tasks + n_tasks > crypto->n_threads) {
+        qemu_co_queue_wait(&crypto->pool_queue);
+    }
+    crypto->n_pool_tasks += n_tasks;
+
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    for (i = 0; i < n_tasks; i++) {
+        int n = MIN(task_sectors, nb_sectors);
+
+        tasks[i] = (BlockCryptoTask) {
+            .block = crypto->block,
+            .sector_num = sector_num,
+            .buf = buf,
+            .len = n * 512,
+            .encrypt = encrypt,
+        };
+        group.in_flight++;
+        thread_pool_submit_aio(pool, block_crypto_task_func, &tasks[i],
+                               block_crypto_task_cb, &group);
+
+        sector_num += n;
+        buf += n * 512;
+        nb_sectors -= n;
+    }
+
+    while (group.in_flight > 0) {
+        qemu_coroutine_yield();
+    }
+
+    crypto->n_pool_tasks -= n_tasks;
+    qemu_co_queue_restart_all(&crypto->pool_queue);
+    return group.ret;
+}
 
 static coroutine_fn int
 block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -439,11 +586,9 @@ block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_cipher(bs, sector_num, cipher_data,
+                                     cur_nr_sectors, false);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -500,11 +645,9 @@ block_crypto_co_writev(BlockDriverState *bs, int64_t sector_num,
         qemu_iovec_to_buf(qiov, bytes_done,
                           cipher_data, cur_nr_sectors * 512);
 
-        if (qcrypto_block_encrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_cipher(bs, sector_num, cipher_data,
+                                     cur_nr_sectors, true);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -143,7 +143,7 @@ bool bdrv_requests_pending(BlockDriverState *bs)
 {
     BdrvChild *child;
 
-    if (!QLIST_EMPTY(&bs->tracked_requests)) {
+    if (bs->in_flight || !QLIST_EMPTY(&bs->tracked_requests)) {
         return true;
     }
 
@@ -355,6 +355,22 @@ void bdrv_drain_all(void)
     }
 }
 
+/**
+ * Account a request that accesses the data of @bs without going through
+ * the block layer, e.g. with the file descriptor from bdrv_get_raw_fd().
+ * bdrv_drain() waits until the matching bdrv_dec_in_flight().
+ */
+void bdrv_inc_in_flight(BlockDriverState *bs)
+{
+    bs->in_flight++;
+}
+
+void bdrv_dec_in_flight(BlockDriverState *bs)
+{
+    assert(bs->in_flight > 0);
+    bs->in_flight--;
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
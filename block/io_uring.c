@@ -0,0 +1,440 @@
+/*
+ * Linux io_uring support.
+ *
+ * The request queueing and completion logic follows block/linux-aio.c.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+#include "trace.h"
+
+#include <liburing.h>
+
+/*
+ * Number of entries of the submission and completion rings (per AioContext).
+ * Requests beyond this are kept on a software queue until the ring drains.
+ */
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    /* Slot in the submission ring, valid while the request is counted in
+     * LuringQueue.in_ring */
+    struct io_uring_sqe *ring_sqe;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /*
+     * Buffered reads may complete short; the remainder is resubmitted using
+     * resubmit_qiov, and total_read counts the bytes read so far.
+     */
+    int total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+/*
+ * Requests stay on submit_queue until the kernel has consumed their SQE.  The
+ * first in_ring of them have been copied into the submission ring already;
+ * they follow @dropped entries of failed requests that were turned into NOPs.
+ */
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_ring;
+    unsigned int dropped;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing for nested event loops */
+    QEMUBH *completion_bh;
+};
+
+static int ioq_submit(LuringState *s);
+
+static void luring_complete(LuringAIOCB *luringcb, int ret)
+{
+    luringcb->ret = ret;
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+    /* Jump and continue completion for foreign requests, don't do
+     * anything for current request, it will be completed shortly. */
+    if (luringcb->co != qemu_coroutine_self()) {
+        qemu_coroutine_enter(luringcb->co);
+    }
+}
+
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/*
+ * Resubmits the unread part of a short read.  The request is only completed
+ * once the whole buffer is read or the read returns 0 (EOF).
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov;
+    size_t remaining;
+
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    resubmit_qiov = &luringcb->resubmit_qiov;
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    luringcb->sqeq.off += nread;
+    luringcb->sqeq.addr = (__u64)(uintptr_t)resubmit_qiov->iov;
+    luringcb->sqeq.len = resubmit_qiov->niov;
+
+    luring_resubmit(s, luringcb);
+}
+
+/**
+ * luring_process_completions:
+ * @s: AIO state
+ *
+ * Fetches completed I/O requests from the completion ring and resumes their
+ * coroutines.  Completions are read from memory shared with the kernel, so
+ * this costs no system call and can be called whenever the ring may have
+ * completed entries.
+ *
+ * Like qemu_laio_process_completions(), this supports nested event loops by
+ * keeping the completion BH scheduled while callbacks run.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+        int total_bytes;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        trace_luring_process_completion(s, luringcb, ret);
+
+        if (!luringcb) {
+            /* NOP left behind by luring_fail_queue() */
+            continue;
+        }
+
+        /* total_read is non-zero only for resubmitted read requests */
+        total_bytes = ret + luringcb->total_read;
+
+        if (ret < 0) {
+            if (ret == -EINTR || ret == -EAGAIN) {
+                luring_resubmit(s, luringcb);
+                continue;
+            }
+        } else if (total_bytes == luringcb->qiov->size) {
+            ret = 0;
+        } else if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                continue;
+            }
+            /* Short reads mean EOF, pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                              luringcb->qiov->size - total_bytes);
+            ret = 0;
+        } else {
+            ret = -ENOSPC;
+        }
+
+        luring_complete(luringcb, ret);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    luring_process_completions(s);
+
+    if (!s->io_q.plugged && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+    struct io_uring_cqe *cqe;
+
+    if (io_uring_peek_cqe(&s->ring, &cqe) != 0 || !cqe) {
+        return false;
+    }
+
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_ring = 0;
+    io_q->dropped = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/*
+ * Completes every queued request with @ret.  SQEs that are in the ring but
+ * not consumed yet cannot be taken back; the kernel reads them on the next
+ * io_uring_enter(), so they are turned into NOPs that complete nothing.
+ */
+static void luring_fail_queue(LuringState *s, int ret)
+{
+    QSIMPLEQ_HEAD(, LuringAIOCB) failed = QSIMPLEQ_HEAD_INITIALIZER(failed);
+    LuringAIOCB *luringcb;
+
+    QSIMPLEQ_FOREACH(luringcb, &s->io_q.submit_queue, next) {
+        if (s->io_q.in_ring == 0) {
+            break;
+        }
+        io_uring_prep_nop(luringcb->ring_sqe);
+        io_uring_sqe_set_data(luringcb->ring_sqe, NULL);
+        s->io_q.in_ring--;
+        s->io_q.dropped++;
+    }
+
+    /* Completing a request may queue new ones, keep them apart */
+    QSIMPLEQ_CONCAT(&failed, &s->io_q.submit_queue);
+    s->io_q.in_queue = 0;
+
+    while (!QSIMPLEQ_EMPTY(&failed)) {
+        luringcb = QSIMPLEQ_FIRST(&failed);
+        QSIMPLEQ_REMOVE_HEAD(&failed, next);
+        luring_complete(luringcb, ret);
+    }
+}
+
+/*
+ * Moves as many queued requests as fit into the submission ring and hands
+ * them to the kernel with a single io_uring_enter() call.
+ */
+static int ioq_submit(LuringState *s)
+{
+    int ret = 0;
+    unsigned int i;
+    LuringAIOCB *luringcb;
+
+    while (s->io_q.in_queue > 0) {
+        /* Leave room in the completion ring for everything in flight */
+        if (s->io_q.in_flight >= MAX_ENTRIES) {
+            break;
+        }
+
+        i = 0;
+        QSIMPLEQ_FOREACH(luringcb, &s->io_q.submit_queue, next) {
+            struct io_uring_sqe *sqe;
+
+            if (i++ < s->io_q.in_ring) {
+                continue;
+            }
+            sqe = io_uring_get_sqe(&s->ring);
+            if (!sqe) {
+                break;
+            }
+            *sqe = luringcb->sqeq;
+            luringcb->ring_sqe = sqe;
+            s->io_q.in_ring++;
+        }
+
+        ret = io_uring_submit(&s->ring);
+        trace_luring_io_uring_submit(s, ret);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            ret = ret ?: -EAGAIN;
+            if ((ret == -EAGAIN || ret == -EBUSY) && s->io_q.in_flight > 0) {
+                /* The kernel is out of resources; the entries stay in the
+                 * ring and are submitted again once requests complete. */
+                break;
+            }
+            /* No completion is going to retry the submission */
+            luring_fail_queue(s, ret);
+            break;
+        }
+
+        /* The kernel consumes the ring in order, NOPs first */
+        s->io_q.in_flight += ret;
+        i = MIN(ret, s->io_q.dropped);
+        s->io_q.dropped -= i;
+        for (; i < ret; i++) {
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+            s->io_q.in_queue--;
+            s->io_q.in_ring--;
+        }
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /* We can try to complete something just right away if there are
+         * still requests in-flight. */
+        luring_process_completions(s);
+    }
+    return ret;
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
+                            uint64_t offset, int type)
+{
+    struct io_uring_sqe *sqe = &luringcb->sqeq;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, fd, luringcb->qiov->iov,
+                             luringcb->qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqe, fd, luringcb->qiov->iov,
+                            luringcb->qiov->niov, offset);
+        break;
+    default:
+        return -EIO;
+    }
+    io_uring_sqe_set_data(sqe, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+
+    return 0;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov, int type)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+
+    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(new_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_cb, NULL, s);
+    aio_set_fd_poll(new_context, s->ring.ring_fd, qemu_luring_poll_cb);
+}
+
+LuringState *luring_init(Error **errp)
+{
+    int rc;
+    LuringState *s = g_new0(LuringState, 1);
+
+    rc = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+
+    ioq_init(&s->io_q);
+    trace_luring_init_state(s, sizeof(*s));
+
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    trace_luring_cleanup_state(s);
+    g_free(s);
+}
@@ -24,6 +24,7 @@
 #define SLICE_TIME    100000000ULL /* ns */
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_SECTORS ((1 << 20) >> BDRV_SECTOR_BITS) /* 1 Mb */
+#define MIN_IO_SECTORS ((1 << 16) >> BDRV_SECTOR_BITS) /* 64 Kb */
 #define DEFAULT_MIRROR_BUF_SIZE \
     (MAX_IN_FLIGHT * MAX_IO_SECTORS * BDRV_SECTOR_SIZE)
 
@@ -69,6 +70,9 @@ typedef struct MirrorBlockJob {
     bool waiting_for_io;
     int target_cluster_sectors;
     int max_iov;
+    /* Current size limit of copy requests, see mirror_adapt_io_size() */
+    int max_io_sectors;
+    int64_t last_dirty_count;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -160,6 +164,18 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+
+    /* Keep a thin target thin even where the block status of the source
+     * could not tell that the data reads as zeroes */
+    if (qemu_iovec_is_zero(&op->qiov)) {
+        trace_mirror_zero_read(s, op->sector_num, op->nb_sectors);
+        blk_aio_pwrite_zeroes(s->target, op->sector_num * BDRV_SECTOR_SIZE,
+                              op->qiov.size,
+                              s->unmap ? BDRV_REQ_MAY_UNMAP : 0,
+                              mirror_write_complete, op);
+        return;
+    }
+
     blk_aio_pwritev(s->target, op->sector_num * BDRV_SECTOR_SIZE, &op->qiov,
                     0, mirror_write_complete, op);
 }
@@ -317,6 +333,31 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
     }
 }
 
+/* Adapt the size limit of copy requests to the workload.  Copying a long
+ * run of dirty chunks in few large requests is the most efficient, so the
+ * limit doubles whenever a run exceeds it.  But guest requests would queue
+ * behind large mirror requests, so when the guest dirtied new data since
+ * the previous iteration, the limit is halved instead.  */
+static void mirror_adapt_io_size(MirrorBlockJob *s, int64_t run_sectors)
+{
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int min_io_sectors = MAX(MIN_IO_SECTORS, sectors_per_chunk);
+    int max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / 4,
+                             MAX_IO_SECTORS);
+    int64_t dirty_count = bdrv_get_dirty_count(s->dirty_bitmap);
+    int old = s->max_io_sectors;
+
+    if (dirty_count > s->last_dirty_count) {
+        s->max_io_sectors = MAX(s->max_io_sectors / 2, min_io_sectors);
+    } else if (run_sectors > s->max_io_sectors) {
+        s->max_io_sectors = MIN(s->max_io_sectors * 2, max_io_sectors);
+    }
+
+    if (s->max_io_sectors != old) {
+        trace_mirror_adapt_io_size(s, old, s->max_io_sectors);
+    }
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = blk_bs(s->common.blk);
@@ -327,8 +368,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
     int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / MAX_IN_FLIGHT,
-                             MAX_IO_SECTORS);
+    int max_io_sectors;
 
     sector_num = hbitmap_iter_next(&s->hbi);
     if (sector_num < 0) {
@@ -370,12 +410,16 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         nb_chunks++;
     }
 
+    mirror_adapt_io_size(s, (int64_t)nb_chunks * sectors_per_chunk);
+    max_io_sectors = s->max_io_sectors;
+
     /* Clear dirty bits before querying the block status, because
      * calling bdrv_get_block_status_above could yield - if some blocks are
      * marked dirty in this window, we need to know.
      */
     bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num,
                             nb_chunks * sectors_per_chunk);
+    s->last_dirty_count = bdrv_get_dirty_count(s->dirty_bitmap);
     bitmap_set(s->in_flight_bitmap, sector_num / sectors_per_chunk, nb_chunks);
     while (nb_chunks > 0 && sector_num < end) {
         int ret;
@@ -662,6 +706,8 @@ static void coroutine_fn mirror_run(void *opaque)
     }
     s->target_cluster_sectors = target_cluster_size >> BDRV_SECTOR_BITS;
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
+    s->max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / MAX_IN_FLIGHT,
+                            MAX_IO_SECTORS);
 
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
@@ -678,6 +724,7 @@ static void coroutine_fn mirror_run(void *opaque)
             goto immediate_exit;
         }
     }
+    s->last_dirty_count = bdrv_get_dirty_count(s->dirty_bitmap);
 
     bdrv_dirty_iter_init(s->dirty_bitmap, &s->hbi);
     for (;;) {
@@ -32,7 +32,7 @@
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
 
-static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
+static void nbd_recv_coroutines_enter_all(NbdConnection *s)
 {
     int i;
 
@@ -43,31 +43,51 @@ static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NbdConnection *conn)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
-
-    if (!client->ioc) { /* Already closed */
+    if (!conn->ioc) { /* Already closed */
         return;
     }
 
     /* finish any pending coroutines */
-    qio_channel_shutdown(client->ioc,
+    qio_channel_shutdown(conn->ioc,
                          QIO_CHANNEL_SHUTDOWN_BOTH,
                          NULL);
-    nbd_recv_coroutines_enter_all(client);
+    nbd_recv_coroutines_enter_all(conn);
 
-    nbd_client_detach_aio_context(bs);
-    object_unref(OBJECT(client->sioc));
-    client->sioc = NULL;
-    object_unref(OBJECT(client->ioc));
-    client->ioc = NULL;
+    aio_set_fd_handler(bdrv_get_aio_context(conn->bs), conn->sioc->fd,
+                       false, NULL, NULL, NULL);
+    object_unref(OBJECT(conn->sioc));
+    conn->sioc = NULL;
+    object_unref(OBJECT(conn->ioc));
+    conn->ioc = NULL;
+}
+
+/* Pick the connection for a new request: the least busy one that is
+ * still open, starting the search after the previous pick so that
+ * requests are striped across connections.  */
+static NbdConnection *nbd_choose_connection(NbdClientSession *client)
+{
+    NbdConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        NbdConnection *conn =
+            &client->conns[(client->next_conn + i) % client->num_conns];
+
+        if (conn->ioc && (!best || conn->in_flight < best->in_flight)) {
+            best = conn;
+        }
+    }
+    client->next_conn = (client->next_conn + 1) % client->num_conns;
+
+    /* If everything was torn down, requests fail with -EPIPE */
+    return best ? best : &client->conns[0];
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdConnection *s = opaque;
     uint64_t i;
     int ret;
 
@@ -104,21 +124,20 @@ static void nbd_reply_ready(void *opaque)
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdConnection *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine);
+    qemu_coroutine_enter(s->send_coroutine);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NbdConnection *s,
                                struct nbd_request *request,
                                QEMUIOVector *qiov)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
@@ -141,10 +160,10 @@ static int nbd_co_send_request(BlockDriverState *bs,
     }
 
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->bs);
 
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, s);
     if (qiov) {
         qio_channel_set_cork(s->ioc, true);
         rc = nbd_send_request(s->ioc, request);
@@ -160,41 +179,160 @@ static int nbd_co_send_request(BlockDriverState *bs,
         rc = nbd_send_request(s->ioc, request);
     }
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
+                       nbd_reply_ready, NULL, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
+static ssize_t nbd_co_read(NbdConnection *s, void *buffer, size_t size)
+{
+    struct iovec iov = { .iov_base = buffer, .iov_len = size };
+
+    return nbd_wr_syncv(s->ioc, &iov, 1, size, true);
+}
+
+/* Consume the payload of the structured reply chunk whose header is in
+ * @reply.  Returns a negative errno if the chunk is malformed; the
+ * connection cannot be used anymore in that case.  */
+static int nbd_co_receive_chunk(NbdConnection *s,
+                                struct nbd_request *request,
+                                struct nbd_reply *reply,
+                                QEMUIOVector *qiov,
+                                NBDExtent *extent)
+{
+    uint8_t buf[4 + 8];
+    QEMUIOVector sub_qiov;
+    uint64_t offset;
+    uint32_t len, hdrlen;
+    ssize_t ret;
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return reply->length ? -EINVAL : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        /* Payload
+           [ 0 ..  7]    offset
+           [ 8 .. xx]    data (OFFSET_DATA), or
+           [ 8 .. 11]    length of the hole (OFFSET_HOLE)
+         */
+        hdrlen = reply->type == NBD_REPLY_TYPE_OFFSET_HOLE ? 12 : 8;
+        if (!qiov || reply->length < hdrlen ||
+            (reply->type == NBD_REPLY_TYPE_OFFSET_HOLE &&
+             reply->length != hdrlen)) {
+            return -EINVAL;
+        }
+        if (nbd_co_read(s, buf, hdrlen) != hdrlen) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        if (reply->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            len = ldl_be_p(buf + 8);
+        } else {
+            len = reply->length - hdrlen;
+        }
+        if (offset < request->from || len > request->len ||
+            offset - request->from > request->len - len) {
+            return -EINVAL;
+        }
+        offset -= request->from;
+
+        if (reply->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            qemu_iovec_memset(qiov, offset, 0, len);
+            return 0;
+        }
+        qemu_iovec_init(&sub_qiov, qiov->niov);
+        qemu_iovec_concat(&sub_qiov, qiov, offset, len);
+        ret = nbd_wr_syncv(s->ioc, sub_qiov.iov, sub_qiov.niov, len, true);
+        qemu_iovec_destroy(&sub_qiov);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* Payload
+           [ 0 ..  3]    meta context id
+           [ 4 ..  7]    length of the first extent
+           [ 8 .. 11]    flags of the first extent
+           ...           further extents, which we do not ask for
+         */
+        if (!extent || reply->length < sizeof(buf) ||
+            (reply->length - 4) % 8) {
+            return -EINVAL;
+        }
+        if (nbd_co_read(s, buf, sizeof(buf)) != sizeof(buf)) {
+            return -EIO;
+        }
+        if (ldl_be_p(buf) !=
+            nbd_get_client_session(s->bs)->ext.base_allocation_id) {
+            return -EINVAL;
+        }
+        extent->length = MIN(ldl_be_p(buf + 4), request->len);
+        extent->flags = ldl_be_p(buf + 8);
+        ret = nbd_drop(s->ioc, reply->length - sizeof(buf));
+        return ret == reply->length - sizeof(buf) ? 0 : -EIO;
+
+    default:
+        if (NBD_REPLY_TYPE_IS_ERR(reply->type)) {
+            return nbd_receive_error_chunk(s->ioc, reply);
+        }
+        return -EINVAL;
+    }
+}
+
+static void nbd_co_receive_reply(NbdConnection *s,
                                  struct nbd_request *request,
                                  struct nbd_reply *reply,
-                                 QEMUIOVector *qiov)
+                                 QEMUIOVector *qiov,
+                                 NBDExtent *extent)
 {
     int ret;
+    int error = 0;
+
+    /* A structured reply is made of chunks with the same handle, the last
+     * of which has NBD_REPLY_FLAG_DONE set.  The first error wins.  */
+    do {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle ||
+            !s->ioc) {
+            reply->error = EIO;
+            return;
+        }
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
-                               true);
-            if (ret != request->len) {
+        if (!reply->structured) {
+            if (qiov && reply->error == 0) {
+                ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                                   request->len, true);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
+            }
+        } else {
+            ret = nbd_co_receive_chunk(s, request, reply, qiov, extent);
+            if (ret < 0) {
+                /* Further chunks cannot be parsed, so make the read
+                 * handler tear down the connection.  */
+                qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+                s->reply.handle = 0;
                 reply->error = EIO;
+                return;
             }
         }
+        if (!error) {
+            error = reply->error;
+        }
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
-    }
+    } while (reply->structured && !(reply->flags & NBD_REPLY_FLAG_DONE));
+
+    reply->error = error;
 }
 
-static void nbd_coroutine_start(NbdClientSession *s,
+static void nbd_coroutine_start(NbdConnection *s,
    struct nbd_request *request)
 {
     /* Poor man semaphore.  The free_sema is locked when no other request
@@ -208,7 +346,7 @@ static void nbd_coroutine_start(NbdClientSession *s,
     /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
 }
 
-static void nbd_coroutine_end(NbdClientSession *s,
+static void nbd_coroutine_end(NbdConnection *s,
     struct nbd_request *request)
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
@@ -228,19 +366,22 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
         .len = bytes,
     };
     struct nbd_reply reply;
+    NbdConnection *conn;
     ssize_t ret;
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
     assert(!flags);
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    conn = nbd_choose_connection(client);
+
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov);
+        nbd_co_receive_reply(conn, &request, &reply, qiov, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -254,6 +395,7 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
         .len = bytes,
     };
     struct nbd_reply reply;
+    NbdConnection *conn;
     ssize_t ret;
 
     if (flags & BDRV_REQ_FUA) {
@@ -263,14 +405,16 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov);
+    conn = nbd_choose_connection(client);
+
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, qiov);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -279,6 +423,7 @@ int nbd_client_co_flush(BlockDriverState *bs)
     NbdClientSession *client = nbd_get_client_session(bs);
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
     struct nbd_reply reply;
+    NbdConnection *conn;
     ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_FLUSH)) {
@@ -288,14 +433,18 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    /* With several connections, the server promised that a flush on any
+     * of them covers the writes completed on all of them.  */
+    conn = nbd_choose_connection(client);
+
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -308,36 +457,109 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
         .len = count,
     };
     struct nbd_reply reply;
+    NbdConnection *conn;
     ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    conn = nbd_choose_connection(client);
+
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
 
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+        .from = sector_num << BDRV_SECTOR_BITS,
+    };
+    NBDExtent extent = { 0 };
+    struct nbd_reply reply;
+    NbdConnection *conn;
+    int64_t offset_valid = BDRV_BLOCK_OFFSET_VALID |
+                           (sector_num << BDRV_SECTOR_BITS);
+    ssize_t ret;
+
+    *file = bs;
+    if (!client->ext.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | offset_valid;
+    }
+
+    nb_sectors = MIN(nb_sectors, BDRV_REQUEST_MAX_SECTORS);
+    request.len = nb_sectors << BDRV_SECTOR_BITS;
+
+    conn = nbd_choose_connection(client);
+
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, &request, &reply, NULL, &extent);
+    }
+    nbd_coroutine_end(conn, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+    if (extent.length == 0) {
+        /* The server did not send a status chunk */
+        return -EIO;
+    }
+
+    if (extent.length < BDRV_SECTOR_SIZE) {
+        /* Status is tracked at a finer granularity than ours; be safe */
+        *pnum = 1;
+        return BDRV_BLOCK_DATA | offset_valid;
+    }
+    *pnum = extent.length >> BDRV_SECTOR_BITS;
+    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+           (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0) |
+           offset_valid;
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].sioc) {
+            aio_set_fd_handler(bdrv_get_aio_context(bs),
+                               client->conns[i].sioc->fd,
+                               false, NULL, NULL, NULL);
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].sioc) {
+            aio_set_fd_handler(new_context, client->conns[i].sioc->fd,
+                               false, nbd_reply_ready, NULL,
+                               &client->conns[i]);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -348,24 +570,34 @@ void nbd_client_close(BlockDriverState *bs)
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
-    }
+    for (i = 0; i < client->num_conns; i++) {
+        NbdConnection *conn = &client->conns[i];
 
-    nbd_send_request(client->ioc, &request);
+        if (conn->ioc == NULL) {
+            continue;
+        }
+
+        nbd_send_request(conn->ioc, &request);
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(conn);
+    }
 }
 
-int nbd_client_init(BlockDriverState *bs,
-                    QIOChannelSocket *sioc,
-                    const char *export,
-                    QCryptoTLSCreds *tlscreds,
-                    const char *hostname,
-                    Error **errp)
+/* Set up @conn on top of @sioc, which has just been connected.  The
+ * export parameters are stored in the given pointers.  */
+static int nbd_connection_init(BlockDriverState *bs,
+                               NbdConnection *conn,
+                               QIOChannelSocket *sioc,
+                               const char *export,
+                               QCryptoTLSCreds *tlscreds,
+                               const char *hostname,
+                               uint16_t *nbdflags,
+                               NBDExtensions *ext,
+                               off_t *size,
+                               Error **errp)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
     int ret;
 
     /* NBD handshake */
@@ -373,34 +605,100 @@ int nbd_client_init(BlockDriverState *bs,
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
-                                &client->nbdflags,
+                                nbdflags,
                                 tlscreds, hostname,
-                                &client->ioc,
-                                &client->size, errp);
+                                &conn->ioc, ext,
+                                size, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
-    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
-        bs->supported_write_flags = BDRV_REQ_FUA;
-    }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
-    client->sioc = sioc;
-    object_ref(OBJECT(client->sioc));
+    qemu_co_mutex_init(&conn->send_mutex);
+    qemu_co_mutex_init(&conn->free_sema);
+    conn->bs = bs;
+    conn->sioc = sioc;
+    object_ref(OBJECT(conn->sioc));
 
-    if (!client->ioc) {
-        client->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(client->ioc));
+    if (!conn->ioc) {
+        conn->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(conn->ioc));
     }
 
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
 
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    aio_set_fd_handler(bdrv_get_aio_context(bs), sioc->fd, false,
+                       nbd_reply_ready, NULL, conn);
 
     logout("Established connection with NBD server\n");
     return 0;
 }
+
+int nbd_client_init(BlockDriverState *bs,
+                    QIOChannelSocket *sioc,
+                    const char *export,
+                    QCryptoTLSCreds *tlscreds,
+                    const char *hostname,
+                    Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int ret;
+
+    ret = nbd_connection_init(bs, &client->conns[0], sioc, export,
+                              tlscreds, hostname, &client->nbdflags,
+                              &client->ext, &client->size, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    client->num_conns = 1;
+
+    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
+        bs->supported_write_flags = BDRV_REQ_FUA;
+    }
+    return 0;
+}
+
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
+    NBDExtensions ext;
+    uint16_t nbdflags;
+    off_t size;
+    int ret;
+
+    assert(client->num_conns > 0);
+    if (!(client->nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        error_setg(errp, "Server does not support multiple connections");
+        return -ENOTSUP;
+    }
+    if (client->num_conns == MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "Too many connections");
+        return -EINVAL;
+    }
+
+    conn = &client->conns[client->num_conns];
+    ret = nbd_connection_init(bs, conn, sioc, export, tlscreds, hostname,
+                              &nbdflags, &ext, &size, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Requests may go to any connection, so all of them must agree */
+    if (nbdflags != client->nbdflags || size != client->size ||
+        memcmp(&ext, &client->ext, sizeof(ext))) {
+        error_setg(errp, "Export changed while connecting to it");
+        nbd_teardown_connection(conn);
+        return -EINVAL;
+    }
+
+    client->num_conns++;
+    return 0;
+}
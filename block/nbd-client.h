@@ -16,12 +16,13 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
-typedef struct NbdClientSession {
+/* One socket to the server, with its own requests in flight */
+typedef struct NbdConnection {
+    BlockDriverState *bs;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    uint16_t nbdflags;
-    off_t size;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -30,6 +31,18 @@ typedef struct NbdClientSession {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NbdConnection;
+
+typedef struct NbdClientSession {
+    uint16_t nbdflags;
+    NBDExtensions ext;
+    off_t size;
+
+    /* Requests are striped across all connections to the export.  There
+     * is more than one only if the server sets NBD_FLAG_CAN_MULTI_CONN.  */
+    NbdConnection conns[MAX_NBD_CONNECTIONS];
+    int num_conns;
+    int next_conn;
 
     bool is_unix;
 } NbdClientSession;
@@ -42,6 +55,12 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export_name,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count);
@@ -50,6 +69,10 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, QEMUIOVector *qiov, int flags);
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags);
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum,
+                                       BlockDriverState **file);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
@@ -45,6 +45,7 @@ typedef struct BDRVNBDState {
 
     /* For nbd_refresh_filename() */
     char *path, *host, *port, *export, *tlscredsid;
+    int64_t connections;
 } BDRVNBDState;
 
 static int nbd_parse_uri(const char *filename, QDict *options)
@@ -322,6 +323,12 @@ static QemuOptsList nbd_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of the TLS credentials to use",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server allows "
+                    "more than one (default 1)",
+        },
     },
 };
 
@@ -336,6 +343,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
     int ret = -EINVAL;
+    int i;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
     qemu_opts_absorb_qdict(opts, options, &local_err);
@@ -364,6 +372,13 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         hostname = saddr->u.inet.data->host;
     }
 
+    s->connections = qemu_opt_get_number(opts, "connections", 1);
+    if (s->connections < 1 || s->connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     /* establish TCP connection, return error if it fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
@@ -376,6 +391,30 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     /* NBD handshake */
     ret = nbd_client_init(bs, sioc, s->export,
                           tlscreds, hostname, errp);
+    if (ret < 0) {
+        goto error;
+    }
+
+    /* Extra connections are only a performance optimization, so just
+     * use the ones we have if the server refuses more.  */
+    for (i = 1; i < s->connections &&
+                (s->client.nbdflags & NBD_FLAG_CAN_MULTI_CONN); i++) {
+        object_unref(OBJECT(sioc));
+        sioc = nbd_establish_connection(saddr, &local_err);
+        if (!sioc) {
+            break;
+        }
+        if (nbd_client_add_connection(bs, sioc, s->export,
+                                      tlscreds, hostname, &local_err) < 0) {
+            break;
+        }
+    }
+    if (local_err) {
+        logout("Using %d connection(s): %s\n", i,
+               error_get_pretty(local_err));
+        error_free(local_err);
+    }
+
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -479,6 +518,10 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
         qdict_put_obj(opts, "tls-creds",
                       QOBJECT(qstring_from_str(s->tlscredsid)));
     }
+    if (s->connections > 1) {
+        qdict_put_obj(opts, "connections",
+                      QOBJECT(qint_from_int(s->connections)));
+    }
 
     bs->full_open_options = opts;
 }
@@ -494,6 +537,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -512,6 +556,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -530,6 +575,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
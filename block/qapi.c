@@ -119,6 +119,9 @@ BlockDeviceInfo *bdrv_block_device_info(BlockBackend *blk,
 
         info->has_group = true;
         info->group = g_strdup(throttle_group_get_name(blk));
+
+        info->has_group_weight = true;
+        info->group_weight = throttle_group_get_weight(blk);
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -361,10 +364,37 @@ static BlockStats *bdrv_query_stats(BlockBackend *blk,
                                     const BlockDriverState *bs,
                                     bool query_backing);
 
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+    int i;
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    for (i = hist->nbins - 1; i >= 0; i--) {
+        uint64List *bin = g_new0(uint64List, 1);
+
+        bin->value = hist->bins[i];
+        bin->next = info->bins;
+        info->bins = bin;
+
+        if (i > 0) {
+            uint64List *boundary = g_new0(uint64List, 1);
+
+            boundary->value = hist->boundaries[i - 1];
+            boundary->next = info->boundaries;
+            info->boundaries = boundary;
+        }
+    }
+
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
+    BlockLatencyHistogram *hist;
 
     ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
     ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
@@ -395,6 +425,15 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    if (blk_get_public(blk)->throttle_state) {
+        BlockBackendPublic *blkp = blk_get_public(blk);
+
+        ds->has_rd_throttle_time_ns = true;
+        ds->rd_throttle_time_ns = blkp->throttled_ns[0];
+        ds->has_wr_throttle_time_ns = true;
+        ds->wr_throttle_time_ns = blkp->throttled_ns[1];
+    }
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
@@ -426,6 +465,24 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
         dev_stats->avg_wr_queue_depth =
             block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
     }
+
+    hist = &stats->latency_histogram[BLOCK_ACCT_READ];
+    ds->has_rd_latency_histogram = hist->bins != NULL;
+    if (ds->has_rd_latency_histogram) {
+        ds->rd_latency_histogram = bdrv_latency_histogram_info(hist);
+    }
+
+    hist = &stats->latency_histogram[BLOCK_ACCT_WRITE];
+    ds->has_wr_latency_histogram = hist->bins != NULL;
+    if (ds->has_wr_latency_histogram) {
+        ds->wr_latency_histogram = bdrv_latency_histogram_info(hist);
+    }
+
+    hist = &stats->latency_histogram[BLOCK_ACCT_FLUSH];
+    ds->has_flush_latency_histogram = hist->bins != NULL;
+    if (ds->has_flush_latency_histogram) {
+        ds->flush_latency_histogram = bdrv_latency_histogram_info(hist);
+    }
 }
 
 static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
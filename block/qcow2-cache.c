@@ -27,6 +27,7 @@
 #include "block/block_int.h"
 #include "qemu-common.h"
 #include "qcow2.h"
+#include "qemu/host-utils.h"
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
@@ -34,6 +35,12 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+
+    /* Next entry in the same hash bucket, or -1 */
+    int      hash_next;
+
+    /* Entries with ref == 0 are kept on the LRU list, oldest first */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -44,6 +51,12 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* offset -> entry index, chained through Qcow2CachedTable.hash_next */
+    int                    *buckets;
+    int                     hash_bits;
+
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
@@ -63,6 +76,80 @@ static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
     return idx;
 }
 
+static inline unsigned qcow2_cache_hash(BlockDriverState *bs, Qcow2Cache *c,
+                                        uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster = offset >> s->cluster_bits;
+
+    /* Fibonacci hashing, so that tables allocated in runs don't collide */
+    return (cluster * 0x9e3779b97f4a7c15ULL) >> (64 - c->hash_bits);
+}
+
+static int qcow2_cache_hash_lookup(BlockDriverState *bs, Qcow2Cache *c,
+                                   uint64_t offset)
+{
+    int i = c->buckets[qcow2_cache_hash(bs, c, offset)];
+
+    while (i != -1 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+static void qcow2_cache_hash_insert(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    unsigned h = qcow2_cache_hash(bs, c, c->entries[i].offset);
+
+    assert(c->entries[i].offset != 0);
+    c->entries[i].hash_next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void qcow2_cache_hash_remove(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    int *p;
+
+    if (c->entries[i].offset == 0) {
+        return;
+    }
+
+    p = &c->buckets[qcow2_cache_hash(bs, c, c->entries[i].offset)];
+    while (*p != i) {
+        assert(*p != -1);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+/* Forget the table cached in entry i and make it the next eviction victim */
+static void qcow2_cache_entry_invalidate(BlockDriverState *bs, Qcow2Cache *c,
+                                         int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    qcow2_cache_hash_remove(bs, c, i);
+    t->offset = 0;
+    t->lru_counter = 0;
+    if (t->ref == 0) {
+        QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+        QTAILQ_INSERT_HEAD(&c->lru_list, t, lru_entry);
+    }
+}
+
+static void qcow2_cache_reset_index(Qcow2Cache *c)
+{
+    int i;
+
+    memset(c->buckets, -1, sizeof(int) << c->hash_bits);
+    QTAILQ_INIT(&c->lru_list);
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
+    }
+}
+
 static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
                                       int i, int num_tables)
 {
@@ -99,8 +186,7 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_invalidate(bs, c, i);
             i++;
             to_clean++;
         }
@@ -120,17 +206,22 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->hash_bits = ctz64(pow2ceil(MAX(num_tables, 2)));
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, 1 << c->hash_bits);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * s->cluster_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    qcow2_cache_reset_index(c);
+
     return c;
 }
 
@@ -143,6 +234,7 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -297,6 +389,7 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
         c->entries[i].lru_counter = 0;
     }
 
+    qcow2_cache_reset_index(c);
     qcow2_cache_table_release(bs, c, 0, c->size);
 
     c->lru_counter = 0;
@@ -308,39 +401,29 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *victim;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_hash_lookup(bs, c, offset);
+    if (i != -1) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    /* The least recently used unreferenced entry is at the head of the list */
+    victim = QTAILQ_FIRST(&c->lru_list);
+    if (victim == NULL) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = victim - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -351,7 +434,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_entry_invalidate(bs, c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -366,10 +449,13 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(bs, c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru_entry);
+    }
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -399,6 +485,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     assert(c->entries[i].ref >= 0);
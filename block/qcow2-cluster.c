@@ -28,6 +28,7 @@
 #include "qapi/error.h"
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "block/qcow2.h"
 #include "qemu/bswap.h"
 #include "trace.h"
@@ -1405,30 +1406,166 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2DecompressData;
+
+static int qcow2_decompress_pool_func(void *opaque)
 {
-    BDRVQcow2State *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
+    Qcow2DecompressData *data = opaque;
 
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data,
-                        nb_csectors);
-        if (ret < 0) {
-            return ret;
+    return decompress_buffer(data->out_buf, data->out_buf_size,
+                             data->buf, data->buf_size);
+}
+
+static Qcow2DecompressedCluster *qcow2_decompress_cache_find(BDRVQcow2State *s,
+                                                             uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        if (s->decompress_cache[i].coffset == coffset) {
+            return &s->decompress_cache[i];
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+    }
+    return NULL;
+}
+
+/* Replaces the least recently used entry with *data and returns the buffer
+ * that it used to hold (possibly NULL) in *data. */
+static void qcow2_decompress_cache_insert(BDRVQcow2State *s, uint64_t coffset,
+                                          uint8_t **data)
+{
+    Qcow2DecompressedCluster *victim = &s->decompress_cache[0];
+    uint8_t *old_data;
+    int i;
+
+    if (qcow2_decompress_cache_find(s, coffset)) {
+        return;
+    }
+
+    for (i = 1; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        if (s->decompress_cache[i].lru_counter < victim->lru_counter) {
+            victim = &s->decompress_cache[i];
         }
-        s->cluster_cache_offset = coffset;
     }
-    return 0;
+
+    old_data = victim->data;
+    victim->data = *data;
+    victim->coffset = coffset;
+    victim->lru_counter = ++s->decompress_cache_lru_counter;
+    *data = old_data;
+}
+
+void qcow2_decompress_cache_invalidate(BDRVQcow2State *s)
+{
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        s->decompress_cache[i].coffset = -1;
+        s->decompress_cache[i].lru_counter = 0;
+    }
+    s->decompress_cache_gen++;
+}
+
+void qcow2_decompress_cache_free(BDRVQcow2State *s)
+{
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_SIZE; i++) {
+        g_free(s->decompress_cache[i].data);
+        s->decompress_cache[i].data = NULL;
+    }
+    qcow2_decompress_cache_invalidate(s);
+}
+
+/*
+ * Reads qiov->size bytes starting at offset_in_cluster from the compressed
+ * cluster described by the L2 entry cluster_offset.
+ *
+ * Recently used clusters are served from s->decompress_cache.  Otherwise the
+ * compressed data is read and inflated in the thread pool, so that several
+ * clusters can be decompressed in parallel without blocking the AioContext.
+ *
+ * Must be called without s->lock held.
+ */
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int offset_in_cluster,
+                                          QEMUIOVector *qiov)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressedCluster *entry;
+    Qcow2DecompressData data;
+    ThreadPool *pool;
+    QEMUIOVector local_qiov;
+    struct iovec iov;
+    uint8_t *buf = NULL, *out_buf = NULL;
+    int ret, nb_csectors, sector_offset;
+    uint64_t coffset, gen;
+
+    assert(offset_in_cluster + qiov->size <= s->cluster_size);
+
+    coffset = cluster_offset & s->cluster_offset_mask;
+    entry = qcow2_decompress_cache_find(s, coffset);
+    if (entry) {
+        entry->lru_counter = ++s->decompress_cache_lru_counter;
+        qemu_iovec_from_buf(qiov, 0, entry->data + offset_in_cluster,
+                            qiov->size);
+        return 0;
+    }
+
+    gen = s->decompress_cache_gen;
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+
+    buf = qemu_try_blockalign(bs->file->bs, nb_csectors * 512);
+    out_buf = g_try_malloc(s->cluster_size);
+    if (buf == NULL || out_buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    iov = (struct iovec) {
+        .iov_base   = buf,
+        .iov_len    = nb_csectors * 512,
+    };
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_preadv(bs->file, coffset - sector_offset,
+                         nb_csectors * 512, &local_qiov, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    data = (Qcow2DecompressData) {
+        .out_buf        = out_buf,
+        .out_buf_size   = s->cluster_size,
+        .buf            = buf + sector_offset,
+        .buf_size       = nb_csectors * 512 - sector_offset,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    if (thread_pool_submit_co(pool, qcow2_decompress_pool_func, &data) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster, qiov->size);
+
+    /* Writes may have reused the compressed cluster while we were away */
+    if (gen == s->decompress_cache_gen) {
+        qcow2_decompress_cache_insert(s, coffset, &out_buf);
+    }
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    g_free(out_buf);
+    return ret;
 }
 
 /*
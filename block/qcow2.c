@@ -37,6 +37,7 @@
 #include "qemu/option_int.h"
 #include "qemu/cutils.h"
 #include "qemu/bswap.h"
+#include "block/thread-pool.h"
 
 /*
   Differences with QCOW:
@@ -63,6 +64,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -92,6 +94,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     QCowExtension ext;
     uint64_t offset;
     int ret;
+    Qcow2BitmapHeaderExt bitmaps_ext;
 
 #ifdef DEBUG_EXT
     printf("qcow2_read_extensions: start=%ld end=%ld\n", start_offset, end_offset);
@@ -162,6 +165,82 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Invalid extension length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                error_report("WARNING: a program lacking bitmap support "
+                             "modified this file, so all bitmaps are now "
+                             "considered inconsistent. Some clusters may be "
+                             "leaked, run 'qemu-img check -r' on the image "
+                             "file to fix.");
+                break;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: bitmaps_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            if (bitmaps_ext.reserved32 != 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Image has %" PRIu32 " bitmaps, exceeding the "
+                           "QEMU supported maximum of %d",
+                           bitmaps_ext.nb_bitmaps, QCOW2_MAX_BITMAPS);
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.nb_bitmaps == 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "found bitmaps extension with zero bitmaps");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_offset & (s->cluster_size - 1)) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "invalid bitmap directory offset");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_size >
+                QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "bitmap directory size (%" PRIu64 ") exceeds "
+                           "the maximum supported size (%d)",
+                           bitmaps_ext.bitmap_directory_size,
+                           QCOW2_MAX_BITMAP_DIRECTORY_SIZE);
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_offset =
+                    bitmaps_ext.bitmap_directory_offset;
+            s->bitmap_directory_size =
+                    bitmaps_ext.bitmap_directory_size;
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got bitmaps extension: "
+                   "offset=%" PRIu64 " nb_bitmaps=%" PRIu32 "\n",
+                   s->bitmap_directory_offset, s->nb_bitmaps);
+#endif
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -1083,17 +1162,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file->bs, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
-    s->cluster_cache_offset = -1;
+    qcow2_decompress_cache_invalidate(s);
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -1143,8 +1212,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -1155,6 +1225,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
 
+    /* Persistent dirty bitmaps */
+    if (!(flags & BDRV_O_INACTIVE)) {
+        ret = qcow2_load_persistent_dirty_bitmaps(bs, &local_err);
+        if (ret < 0) {
+            error_propagate(errp, local_err);
+            goto fail;
+        }
+    }
+
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only &&
         (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
@@ -1190,8 +1269,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_decompress_cache_free(s);
     return ret;
 }
 
@@ -1392,6 +1470,175 @@ int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
     return n1;
 }
 
+/*
+ * Requests that map to several host ranges issue the data I/O for each range
+ * from a separate worker coroutine, so that a fragmented image doesn't turn
+ * one guest request into a chain of serial host requests.
+ */
+#define QCOW2_MAX_WORKERS 8
+
+typedef struct Qcow2RequestBatch {
+    int in_flight;
+    int ret;
+    CoQueue waiters;
+} Qcow2RequestBatch;
+
+typedef enum Qcow2DataTaskType {
+    QCOW2_TASK_READ,
+    QCOW2_TASK_READ_COMPRESSED,
+    QCOW2_TASK_WRITE,
+} Qcow2DataTaskType;
+
+typedef struct Qcow2DataTask {
+    BlockDriverState *bs;
+    Qcow2RequestBatch *batch;
+    Qcow2DataTaskType type;
+    /* For QCOW2_TASK_READ_COMPRESSED, this is the L2 entry and
+     * offset_in_cluster is the offset into the decompressed cluster */
+    uint64_t host_offset;
+    int offset_in_cluster;
+    uint64_t bytes;
+    QEMUIOVector qiov;
+    QCowL2Meta *l2meta;
+} Qcow2DataTask;
+
+static void qcow2_batch_init(Qcow2RequestBatch *b)
+{
+    b->in_flight = 0;
+    b->ret = 0;
+    qemu_co_queue_init(&b->waiters);
+}
+
+/* Wait until no more than @max_in_flight workers of @b are still running.
+ * Must be called without s->lock held, workers may need it to complete. */
+static void coroutine_fn qcow2_batch_wait(Qcow2RequestBatch *b,
+                                         int max_in_flight)
+{
+    while (b->in_flight > max_in_flight) {
+        qemu_co_queue_wait(&b->waiters);
+    }
+}
+
+static int coroutine_fn qcow2_handle_l2meta(BlockDriverState *bs,
+                                            QCowL2Meta **pl2meta,
+                                            bool link_l2)
+{
+    QCowL2Meta *l2meta = *pl2meta;
+    int ret = 0;
+
+    while (l2meta != NULL) {
+        QCowL2Meta *next;
+
+        if (link_l2) {
+            ret = qcow2_alloc_cluster_link_l2(bs, l2meta);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+
+        /* Take the request off the list of running requests */
+        if (l2meta->nb_clusters != 0) {
+            QLIST_REMOVE(l2meta, next_in_flight);
+        }
+
+        qemu_co_queue_restart_all(&l2meta->dependent_requests);
+
+        next = l2meta->next;
+        g_free(l2meta);
+        l2meta = next;
+    }
+out:
+    *pl2meta = l2meta;
+    return ret;
+}
+
+static void coroutine_fn qcow2_data_task_entry(void *opaque)
+{
+    Qcow2DataTask *t = opaque;
+    BlockDriverState *bs = t->bs;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2RequestBatch *b = t->batch;
+    int ret;
+
+    switch (t->type) {
+    case QCOW2_TASK_WRITE:
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        trace_qcow2_writev_data(qemu_coroutine_self(), t->host_offset);
+        ret = bdrv_co_pwritev(bs->file, t->host_offset, t->bytes,
+                              &t->qiov, 0);
+
+        qemu_co_mutex_lock(&s->lock);
+        if (ret >= 0) {
+            ret = qcow2_handle_l2meta(bs, &t->l2meta, true);
+        }
+        qcow2_handle_l2meta(bs, &t->l2meta, false);
+        qemu_co_mutex_unlock(&s->lock);
+        break;
+    case QCOW2_TASK_READ_COMPRESSED:
+        ret = qcow2_co_read_compressed(bs, t->host_offset,
+                                       t->offset_in_cluster, &t->qiov);
+        break;
+    case QCOW2_TASK_READ:
+        BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+        ret = bdrv_co_preadv(bs->file, t->host_offset, t->bytes,
+                             &t->qiov, 0);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    if (ret < 0 && b->ret == 0) {
+        b->ret = ret;
+    }
+
+    qemu_iovec_destroy(&t->qiov);
+    g_free(t);
+
+    b->in_flight--;
+    qemu_co_queue_next(&b->waiters);
+}
+
+/* Start the data I/O for one host range in a worker coroutine.  Called with
+ * s->lock held; the lock is dropped while waiting for a free worker slot.
+ * Ownership of @l2meta passes to the worker. */
+static void coroutine_fn qcow2_add_data_task(BlockDriverState *bs,
+                                             Qcow2RequestBatch *b,
+                                             Qcow2DataTaskType type,
+                                             uint64_t host_offset,
+                                             int offset_in_cluster,
+                                             uint64_t bytes,
+                                             QEMUIOVector *qiov,
+                                             size_t qiov_offset,
+                                             QCowL2Meta *l2meta)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DataTask *t;
+    Coroutine *co;
+
+    if (b->in_flight >= QCOW2_MAX_WORKERS) {
+        qemu_co_mutex_unlock(&s->lock);
+        qcow2_batch_wait(b, QCOW2_MAX_WORKERS - 1);
+        qemu_co_mutex_lock(&s->lock);
+    }
+
+    t = g_new(Qcow2DataTask, 1);
+    *t = (Qcow2DataTask) {
+        .bs             = bs,
+        .batch          = b,
+        .type           = type,
+        .host_offset    = host_offset,
+        .offset_in_cluster = offset_in_cluster,
+        .bytes          = bytes,
+        .l2meta         = l2meta,
+    };
+    qemu_iovec_init(&t->qiov, qiov->niov);
+    qemu_iovec_concat(&t->qiov, qiov, qiov_offset, bytes);
+
+    b->in_flight++;
+    co = qemu_coroutine_create(qcow2_data_task_entry, t);
+    qemu_coroutine_enter(co);
+}
+
 static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                                         uint64_t bytes, QEMUIOVector *qiov,
                                         int flags)
@@ -1404,13 +1651,20 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
     uint64_t bytes_done = 0;
     QEMUIOVector hd_qiov;
     uint8_t *cluster_data = NULL;
+    Qcow2RequestBatch batch;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
+    qcow2_batch_init(&batch);
 
     qemu_co_mutex_lock(&s->lock);
 
     while (bytes != 0) {
 
+        if (batch.ret < 0) {
+            ret = batch.ret;
+            goto fail;
+        }
+
         /* prepare next request */
         cur_bytes = MIN(bytes, INT_MAX);
         if (s->cipher) {
@@ -1464,15 +1718,20 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            if (cur_bytes != bytes || batch.in_flight) {
+                qcow2_add_data_task(bs, &batch, QCOW2_TASK_READ_COMPRESSED,
+                                    cluster_offset, offset_in_cluster,
+                                    cur_bytes, qiov, bytes_done, NULL);
+                break;
+            }
+
+            qemu_co_mutex_unlock(&s->lock);
+            ret = qcow2_co_read_compressed(bs, cluster_offset,
+                                           offset_in_cluster, &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                                s->cluster_cache + offset_in_cluster,
-                                cur_bytes);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1481,6 +1740,14 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                 goto fail;
             }
 
+            /* Unless this range is the whole request, let a worker do it */
+            if (!bs->encrypted && (cur_bytes != bytes || batch.in_flight)) {
+                qcow2_add_data_task(bs, &batch, QCOW2_TASK_READ,
+                                    cluster_offset + offset_in_cluster, 0,
+                                    cur_bytes, qiov, bytes_done, NULL);
+                break;
+            }
+
             if (bs->encrypted) {
                 assert(s->cipher);
 
@@ -1545,6 +1812,11 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
 fail:
     qemu_co_mutex_unlock(&s->lock);
 
+    qcow2_batch_wait(&batch, 0);
+    if (ret == 0) {
+        ret = batch.ret;
+    }
+
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
 
@@ -1564,12 +1836,14 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
     QCowL2Meta *l2meta = NULL;
+    Qcow2RequestBatch batch;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
+    qcow2_batch_init(&batch);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
+    qcow2_decompress_cache_invalidate(s);
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -1577,6 +1851,11 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
         l2meta = NULL;
 
+        if (batch.ret < 0) {
+            ret = batch.ret;
+            goto fail;
+        }
+
         trace_qcow2_writev_start_part(qemu_coroutine_self());
         offset_in_cluster = offset_into_cluster(s, offset);
         cur_bytes = MIN(bytes, INT_MAX);
@@ -1633,6 +1912,15 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
             goto fail;
         }
 
+        /* Unless this range is the whole request, let a worker do it */
+        if (!bs->encrypted && (cur_bytes != bytes || batch.in_flight)) {
+            qcow2_add_data_task(bs, &batch, QCOW2_TASK_WRITE,
+                                cluster_offset + offset_in_cluster, 0,
+                                cur_bytes, qiov, bytes_done, l2meta);
+            l2meta = NULL;
+            goto next;
+        }
+
         qemu_co_mutex_unlock(&s->lock);
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
         trace_qcow2_writev_data(qemu_coroutine_self(),
@@ -1645,26 +1933,12 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
             goto fail;
         }
 
-        while (l2meta != NULL) {
-            QCowL2Meta *next;
-
-            ret = qcow2_alloc_cluster_link_l2(bs, l2meta);
-            if (ret < 0) {
-                goto fail;
-            }
-
-            /* Take the request off the list of running requests */
-            if (l2meta->nb_clusters != 0) {
-                QLIST_REMOVE(l2meta, next_in_flight);
-            }
-
-            qemu_co_queue_restart_all(&l2meta->dependent_requests);
-
-            next = l2meta->next;
-            g_free(l2meta);
-            l2meta = next;
+        ret = qcow2_handle_l2meta(bs, &l2meta, true);
+        if (ret < 0) {
+            goto fail;
         }
 
+next:
         bytes -= cur_bytes;
         offset += cur_bytes;
         bytes_done += cur_bytes;
@@ -1673,19 +1947,13 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
-
-    while (l2meta != NULL) {
-        QCowL2Meta *next;
+    qcow2_handle_l2meta(bs, &l2meta, false);
 
-        if (l2meta->nb_clusters != 0) {
-            QLIST_REMOVE(l2meta, next_in_flight);
-        }
-        qemu_co_queue_restart_all(&l2meta->dependent_requests);
+    qemu_co_mutex_unlock(&s->lock);
 
-        next = l2meta->next;
-        g_free(l2meta);
-        l2meta = next;
+    qcow2_batch_wait(&batch, 0);
+    if (ret == 0) {
+        ret = batch.ret;
     }
 
     qemu_iovec_destroy(&hd_qiov);
@@ -1699,6 +1967,15 @@ static int qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
+    Error *local_err = NULL;
+
+    if (!bs->read_only) {
+        ret = qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
+        if (ret < 0) {
+            result = ret;
+            error_report_err(local_err);
+        }
+    }
 
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
@@ -1745,8 +2022,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_decompress_cache_free(s);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1913,6 +2189,25 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmap extension */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                    cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                    cpu_to_be64(s->bitmap_directory_offset)
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     if (s->qcow_version >= 3) {
         Qcow2Feature features[] = {
@@ -1931,6 +2226,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
                 .name = "lazy refcounts",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+                .name = "bitmaps",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -2536,6 +2836,50 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2CompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2CompressData;
+
+/*
+ * Runs in the thread pool.  Returns the compressed size, -ENOSPC if the data
+ * doesn't fit in the output buffer, or -EINVAL on other errors.
+ */
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = data->buf_size;
+    strm.next_in = (uint8_t *)data->buf;
+    strm.avail_out = data->out_buf_size;
+    strm.next_out = data->out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = strm.next_out - data->out_buf;
+    } else if (ret == Z_OK) {
+        ret = -ENOSPC;
+    } else {
+        ret = -EINVAL;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static coroutine_fn int
@@ -2545,7 +2889,8 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     QEMUIOVector hd_qiov;
     struct iovec iov;
-    z_stream strm;
+    Qcow2CompressData data;
+    ThreadPool *pool;
     int ret, out_len;
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
@@ -2572,32 +2917,22 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
 
     out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    /* Compress in the thread pool so that the AioContext isn't blocked and
+     * several clusters can be compressed at the same time */
+    data = (Qcow2CompressData) {
+        .out_buf        = out_buf,
+        .out_buf_size   = s->cluster_size,
+        .buf            = buf,
+        .buf_size       = s->cluster_size,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    out_len = thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+    if (out_len < 0 && out_len != -ENOSPC) {
+        ret = out_len;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len == -ENOSPC || out_len >= s->cluster_size) {
         /* could not compress: write normal cluster */
         ret = qcow2_co_pwritev(bs, offset, bytes, qiov, 0);
         if (ret < 0) {
@@ -2607,6 +2942,7 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     }
 
     qemu_co_mutex_lock(&s->lock);
+    qcow2_decompress_cache_invalidate(s);
     cluster_offset =
         qcow2_alloc_compressed_cluster_offset(bs, offset, out_len);
     if (!cluster_offset) {
@@ -2962,6 +3298,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->nb_bitmaps || bdrv_has_persistent_dirty_bitmaps(bs)) {
+        error_report("compat=0.10 does not support persistent bitmaps");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -3402,6 +3743,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
     .bdrv_inactivate            = qcow2_inactivate,
 
+    .bdrv_can_store_new_dirty_bitmap = qcow2_can_store_new_dirty_bitmap,
+
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
@@ -33,6 +33,7 @@
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
 #include "block/raw-aio.h"
+#include "block/shared-cache.h"
 #include "qapi/util.h"
 #include "qapi/qmp/qstring.h"
 
@@ -131,6 +132,11 @@ do { \
 
 #define MAX_BLOCKSIZE	4096
 
+/* Sequential reads through the mapping ask the kernel to start reading
+ * this far ahead of the current position.
+ */
+#define RAW_MMAP_READAHEAD (2 * 1024 * 1024)
+
 typedef struct BDRVRawState {
     int fd;
     int type;
@@ -145,6 +151,17 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool has_fallocate;
     bool needs_alignment;
+    bool use_linux_io_uring;
+
+    /* Read-only mapping of the whole image, see raw_mmap_init() */
+    uint8_t *mmap_base;
+    uint64_t mmap_size;
+    uint64_t mmap_next_offset;
+
+    /* Host-wide cache of the image, see raw_shared_cache_preadv() */
+    SharedCache *shared_cache;
+    uint64_t shared_cache_id;
+    uint64_t shared_cache_limit;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -399,10 +416,117 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "File name of the image",
         },
+        {
+            .name = "mmap",
+            .type = QEMU_OPT_BOOL,
+            .help = "Serve reads from a shared mapping of the image "
+                    "(read-only nodes only)",
+        },
+        {
+            .name = "shared-cache",
+            .type = QEMU_OPT_STRING,
+            .help = "File used to share cached reads with other processes "
+                    "(read-only nodes only)",
+        },
+        {
+            .name = "shared-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the shared cache if it has to be created",
+        },
         { /* end of list */ }
     },
 };
 
+/* Reading a page of the mapping raises SIGBUS if the host reports an I/O
+ * error or if another process truncated the image.  The copy out of the
+ * mapping runs with raw_mmap_sigbus_env set, so that the handler can make
+ * the read fail with -EIO; any other SIGBUS goes to the previous handler.
+ */
+static __thread sigjmp_buf *raw_mmap_sigbus_env;
+static __thread bool raw_mmap_sigbus_unblocked;
+static struct sigaction raw_mmap_old_sigbus;
+
+static void raw_mmap_sigbus_handler(int signal, siginfo_t *siginfo, void *ctx)
+{
+    if (raw_mmap_sigbus_env) {
+        siglongjmp(*raw_mmap_sigbus_env, 1);
+    }
+
+    if (raw_mmap_old_sigbus.sa_flags & SA_SIGINFO) {
+        raw_mmap_old_sigbus.sa_sigaction(signal, siginfo, ctx);
+    } else if (raw_mmap_old_sigbus.sa_handler != SIG_DFL &&
+               raw_mmap_old_sigbus.sa_handler != SIG_IGN) {
+        raw_mmap_old_sigbus.sa_handler(signal);
+    } else {
+        /* The faulting access is restarted and kills the process */
+        sigaction(SIGBUS, &raw_mmap_old_sigbus, NULL);
+    }
+}
+
+static void raw_mmap_sigbus_init(void)
+{
+    static bool initialized;
+    struct sigaction act;
+
+    if (initialized) {
+        return;
+    }
+    initialized = true;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = raw_mmap_sigbus_handler;
+    act.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &act, &raw_mmap_old_sigbus);
+}
+
+/* Map the whole image so that reads become a copy out of the page cache.
+ * Only used for read-only nodes, so the mapping never needs to be written
+ * back or resized.
+ */
+static int raw_mmap_init(BlockDriverState *bs, Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+    off_t size;
+    void *addr;
+
+    size = lseek(s->fd, 0, SEEK_END);
+    if (size < 0) {
+        error_setg_errno(errp, errno, "Could not get the image size");
+        return -errno;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    if ((uint64_t)size > SIZE_MAX) {
+        error_setg(errp, "Image is too large to be mapped");
+        return -EFBIG;
+    }
+
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (addr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Could not map the image");
+        return -errno;
+    }
+
+    raw_mmap_sigbus_init();
+    s->mmap_base = addr;
+    s->mmap_size = size;
+    s->mmap_next_offset = 0;
+    trace_raw_mmap_init(bs, addr, size);
+    return 0;
+}
+
+static void raw_mmap_cleanup(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->mmap_base) {
+        munmap(s->mmap_base, s->mmap_size);
+        s->mmap_base = NULL;
+        s->mmap_size = 0;
+    }
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags, Error **errp)
 {
@@ -410,6 +534,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     QemuOpts *opts;
     Error *local_err = NULL;
     const char *filename = NULL;
+    const char *shared_cache;
     int fd, ret;
     struct stat st;
 
@@ -459,6 +584,28 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+    if (bdrv_flags & BDRV_O_IO_URING) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (bdrv_flags & BDRV_O_NATIVE_AIO) {
+            error_setg(errp, "aio=native and aio=io_uring are mutually "
+                             "exclusive");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+            error_prepend(errp, "Unable to use io_uring: ");
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->use_linux_io_uring = true;
+#else
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+#endif
+    }
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
@@ -511,6 +658,57 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+    if (qemu_opt_get_bool(opts, "mmap", false)) {
+        if (bdrv_flags & BDRV_O_RDWR) {
+            error_setg(errp, "mmap=on requires a read-only node");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (s->type == FTYPE_CD) {
+            error_setg(errp, "mmap=on is not supported for removable media");
+            ret = -EINVAL;
+            goto fail;
+        }
+        ret = raw_mmap_init(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    shared_cache = qemu_opt_get(opts, "shared-cache");
+    if (shared_cache) {
+        off_t limit;
+
+        if (bdrv_flags & BDRV_O_RDWR) {
+            error_setg(errp, "shared-cache requires a read-only node");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (s->type == FTYPE_CD || s->mmap_base) {
+            error_setg(errp, "shared-cache cannot be used with removable "
+                             "media or with mmap=on");
+            ret = -EINVAL;
+            goto fail;
+        }
+        limit = lseek(s->fd, 0, SEEK_END);
+        if (limit < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno,
+                             "Could not get the size of the image");
+            goto fail;
+        }
+        s->shared_cache = shared_cache_open(shared_cache,
+                              qemu_opt_get_size(opts, "shared-cache-size",
+                                                SHARED_CACHE_DEFAULT_SIZE),
+                              errp);
+        if (!s->shared_cache) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->shared_cache_id = shared_cache_image_id(&st);
+        s->shared_cache_limit = limit;
+    }
+
     ret = 0;
 fail:
     if (filename && (bdrv_flags & BDRV_O_TEMPORARY)) {
@@ -617,6 +815,15 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     s->open_flags = raw_s->open_flags;
 
+    /* The mapping and the shared cache are only valid for read-only access */
+    if (state->flags & BDRV_O_RDWR) {
+        raw_mmap_cleanup(state->bs);
+        if (s->shared_cache) {
+            shared_cache_close(s->shared_cache);
+            s->shared_cache = NULL;
+        }
+    }
+
     qemu_close(s->fd);
     s->fd = raw_s->fd;
 
@@ -1252,25 +1459,154 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
      * If this is the case tell the low-level driver that it needs
      * to copy the buffer.
      */
-    if (s->needs_alignment) {
-        if (!bdrv_qiov_is_aligned(bs, qiov)) {
-            type |= QEMU_AIO_MISALIGNED;
+    if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
+        type |= QEMU_AIO_MISALIGNED;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        assert(qiov->size == bytes);
+        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+#endif
 #ifdef CONFIG_LINUX_AIO
-        } else if (bs->open_flags & BDRV_O_NATIVE_AIO) {
-            LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-            assert(qiov->size == bytes);
-            return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
+    } else if (s->needs_alignment && (bs->open_flags & BDRV_O_NATIVE_AIO)) {
+        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        assert(qiov->size == bytes);
+        return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
-        }
     }
 
     return paio_submit_co(bs, s->fd, offset, qiov, bytes, type);
 }
 
+/* Copy a request out of the mapping; the page cache does the I/O.  The
+ * coroutine blocks on page faults, so start readahead for sequential
+ * streams to keep those rare.
+ */
+static int raw_mmap_read(BlockDriverState *bs, uint64_t offset,
+                         uint64_t bytes, QEMUIOVector *qiov)
+{
+    BDRVRawState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    sigset_t set;
+    sigjmp_buf env;
+
+    if (offset == s->mmap_next_offset && end < s->mmap_size) {
+        uintptr_t page_mask = getpagesize() - 1;
+        uintptr_t ra_start = (uintptr_t)(s->mmap_base + end) & ~page_mask;
+        uint64_t ra_len = MIN(RAW_MMAP_READAHEAD, s->mmap_size - end);
+
+        qemu_madvise((void *)ra_start,
+                     ra_len + ((uintptr_t)(s->mmap_base + end) & page_mask),
+                     QEMU_MADV_WILLNEED);
+    }
+    s->mmap_next_offset = end;
+
+    trace_raw_mmap_read(bs, offset, bytes);
+
+    /* Threads created by QEMU start with all signals blocked, and a blocked
+     * SIGBUS caused by a fault kills the process.
+     */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    if (!raw_mmap_sigbus_unblocked) {
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        raw_mmap_sigbus_unblocked = true;
+    }
+
+    /* Don't save the signal mask, that would cost a syscall per read */
+    if (sigsetjmp(env, 0)) {
+        raw_mmap_sigbus_env = NULL;
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        trace_raw_mmap_read_error(bs, offset, bytes);
+        return -EIO;
+    }
+    raw_mmap_sigbus_env = &env;
+    barrier();
+    qemu_iovec_from_buf(qiov, 0, s->mmap_base + offset, bytes);
+    barrier();
+    raw_mmap_sigbus_env = NULL;
+    return 0;
+}
+
+/* Serve a read slot by slot from the shared cache, reading missing slots
+ * in full from the image and adding them to the cache.  The last, partial
+ * slot of the image is never cached.
+ */
+static int coroutine_fn raw_shared_cache_preadv(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                uint64_t bytes,
+                                                QEMUIOVector *qiov)
+{
+    BDRVRawState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    size_t qiov_offset = 0;
+    uint8_t *buf;
+    int ret = 0;
+
+    buf = qemu_try_blockalign(bs, SHARED_CACHE_SLOT_SIZE);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    while (offset < end) {
+        uint64_t slot_offset = QEMU_ALIGN_DOWN(offset, SHARED_CACHE_SLOT_SIZE);
+        uint64_t len = MIN(end, slot_offset + SHARED_CACHE_SLOT_SIZE) - offset;
+
+        if (slot_offset + SHARED_CACHE_SLOT_SIZE > s->shared_cache_limit) {
+            QEMUIOVector tail_qiov;
+
+            qemu_iovec_init(&tail_qiov, qiov->niov);
+            qemu_iovec_concat(&tail_qiov, qiov, qiov_offset, end - offset);
+            ret = raw_co_prw(bs, offset, end - offset, &tail_qiov,
+                             QEMU_AIO_READ);
+            qemu_iovec_destroy(&tail_qiov);
+            break;
+        }
+
+        if (!shared_cache_lookup(s->shared_cache, s->shared_cache_id,
+                                 slot_offset, buf)) {
+            QEMUIOVector slot_qiov;
+            struct iovec iov = {
+                .iov_base = buf,
+                .iov_len = SHARED_CACHE_SLOT_SIZE,
+            };
+
+            qemu_iovec_init_external(&slot_qiov, &iov, 1);
+            ret = raw_co_prw(bs, slot_offset, SHARED_CACHE_SLOT_SIZE,
+                             &slot_qiov, QEMU_AIO_READ);
+            if (ret < 0) {
+                break;
+            }
+            shared_cache_insert(s->shared_cache, s->shared_cache_id,
+                                slot_offset, buf);
+        }
+
+        qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - slot_offset),
+                            len);
+        offset += len;
+        qiov_offset += len;
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
 static int coroutine_fn raw_co_preadv(BlockDriverState *bs, uint64_t offset,
                                       uint64_t bytes, QEMUIOVector *qiov,
                                       int flags)
 {
+    BDRVRawState *s = bs->opaque;
+
+    if (s->shared_cache) {
+        return raw_shared_cache_preadv(bs, offset, bytes, qiov);
+    }
+
+    /* Anything past the mapped size goes the usual way, which also takes
+     * care of reads past the end of file.
+     */
+    if (s->mmap_base && offset + bytes <= s->mmap_size) {
+        return raw_mmap_read(bs, offset, bytes, qiov);
+    }
     return raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_READ);
 }
 
@@ -1284,6 +1620,13 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_io_plug(bs, aio);
+    }
+#endif
 #ifdef CONFIG_LINUX_AIO
     if (bs->open_flags & BDRV_O_NATIVE_AIO) {
         LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
@@ -1294,6 +1637,13 @@ static void raw_aio_plug(BlockDriverState *bs)
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_io_unplug(bs, aio);
+    }
+#endif
 #ifdef CONFIG_LINUX_AIO
     if (bs->open_flags & BDRV_O_NATIVE_AIO) {
         LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
@@ -1302,6 +1652,22 @@ static void raw_aio_unplug(BlockDriverState *bs)
 #endif
 }
 
+static void raw_aio_attach_aio_context(BlockDriverState *bs,
+                                       AioContext *new_context)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        Error *local_err = NULL;
+        if (!aio_setup_linux_io_uring(new_context, &local_err)) {
+            error_reportf_err(local_err, "Unable to use io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        }
+    }
+#endif
+}
+
 static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockCompletionFunc *cb, void *opaque)
 {
@@ -1317,6 +1683,11 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+    raw_mmap_cleanup(bs);
+    if (s->shared_cache) {
+        shared_cache_close(s->shared_cache);
+        s->shared_cache = NULL;
+    }
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1821,6 +2192,13 @@ static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static int raw_get_raw_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    return s->fd;
+}
+
 static QemuOptsList raw_create_opts = {
     .name = "raw-create-opts",
     .head = QTAILQ_HEAD_INITIALIZER(raw_create_opts.head),
@@ -1868,10 +2246,12 @@ BlockDriver bdrv_file = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_get_raw_fd = raw_get_raw_fd,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
@@ -2311,10 +2691,12 @@ static BlockDriver bdrv_host_device = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_get_raw_fd = raw_get_raw_fd,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
     .bdrv_probe_blocksizes = hdev_probe_blocksizes,
@@ -2432,6 +2814,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -2562,6 +2945,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
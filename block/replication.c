@@ -498,7 +498,7 @@ static void replication_start(ReplicationState *rs, ReplicationMode mode,
 
         backup_start("replication-backup", s->secondary_disk->bs,
                      s->hidden_disk->bs, 0, MIRROR_SYNC_MODE_NONE, NULL, false,
-                     BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
+                     0, BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
                      backup_job_completed, s, NULL, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
@@ -0,0 +1,415 @@
+/*
+ * Host-wide cache of read-only image data
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/* Many guests often boot from the same base image, each through its own
+ * overlay.  With cache=none every QEMU process reads the same clusters of
+ * the base image (data and qcow2 metadata alike) from the disk.  The shared
+ * cache lets them do that I/O only once: it is a file, typically on tmpfs,
+ * that every process maps with MAP_SHARED.
+ *
+ * The file holds a set-associative table of SHARED_CACHE_SLOT_SIZE slots,
+ * keyed by an image identifier and an offset.  There is no daemon and no
+ * lock: each slot is protected by a sequence counter, so that readers copy
+ * data out optimistically and retry (or treat the lookup as a miss) if a
+ * writer was active.  Writers claim a slot by making its counter odd with a
+ * compare-and-swap and simply skip the insertion if that fails.  A process
+ * that dies in the middle of an insertion leaves the slot unusable, which
+ * only wastes a little space.
+ *
+ * The cache is trusted by every process that maps it: a process that can
+ * write the file can change what the others read, even for images that it
+ * cannot open itself.  The file must therefore be private to a single user,
+ * and shared only among QEMU processes that are trusted equally.
+ *
+ * Replacement within a set uses the CLOCK algorithm: lookups set the
+ * slot's referenced flag, and the insertion path evicts the first slot
+ * whose flag is clear, clearing flags as it goes.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/file.h>
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "block/shared-cache.h"
+#include "trace.h"
+
+#define SHARED_CACHE_MAGIC       "QEMUSHC"
+#define SHARED_CACHE_VERSION     1
+#define SHARED_CACHE_WAYS        8
+#define SHARED_CACHE_HEADER_SIZE 4096
+
+typedef struct SharedCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t ways;
+    uint32_t padding;
+    uint64_t nb_sets;
+    uint64_t data_offset;
+} SharedCacheHeader;
+
+typedef struct SharedCacheSlot {
+    uint32_t seq;           /* odd while the slot is being written */
+    uint32_t referenced;
+    uint64_t image_id;      /* zero if the slot is empty */
+    uint64_t offset;
+} SharedCacheSlot;
+
+struct SharedCache {
+    char *path;
+    int refcnt;
+
+    uint8_t *base;
+    uint64_t size;
+    uint64_t nb_sets;
+    SharedCacheSlot *slots;
+    uint8_t *data;
+
+    /* Statistics for this process only; shared counters would make every
+     * lookup bounce a cache line between all processes.
+     */
+    uint64_t hits;
+    uint64_t misses;
+
+    QLIST_ENTRY(SharedCache) next;
+};
+
+static QLIST_HEAD(, SharedCache) shared_caches =
+    QLIST_HEAD_INITIALIZER(shared_caches);
+
+/* The finalizer of MurmurHash3 */
+static inline uint64_t shared_cache_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t shared_cache_image_id(const struct stat *st)
+{
+    uint64_t h;
+#ifdef __APPLE__
+    const struct timespec *mtim = &st->st_mtimespec;
+    const struct timespec *ctim = &st->st_ctimespec;
+#else
+    const struct timespec *mtim = &st->st_mtim;
+    const struct timespec *ctim = &st->st_ctim;
+#endif
+
+    h = shared_cache_mix(st->st_dev);
+    h = shared_cache_mix(h ^ st->st_ino);
+    h = shared_cache_mix(h ^ st->st_size);
+    h = shared_cache_mix(h ^ mtim->tv_sec);
+    h = shared_cache_mix(h ^ mtim->tv_nsec);
+
+    /* Unlike the modification time, the change time cannot be set back by
+     * the writer, so any rewrite in place yields a new key.
+     */
+    h = shared_cache_mix(h ^ ctim->tv_sec);
+    h = shared_cache_mix(h ^ ctim->tv_nsec);
+
+    /* Zero marks empty slots */
+    return h ? h : 1;
+}
+
+static SharedCacheSlot *shared_cache_find_set(SharedCache *sc,
+                                              uint64_t image_id,
+                                              uint64_t offset)
+{
+    uint64_t h = shared_cache_mix(image_id ^ (offset / SHARED_CACHE_SLOT_SIZE));
+
+    return &sc->slots[(h % sc->nb_sets) * SHARED_CACHE_WAYS];
+}
+
+static inline void *shared_cache_slot_data(SharedCache *sc,
+                                           SharedCacheSlot *slot)
+{
+    return sc->data + (uint64_t)(slot - sc->slots) * SHARED_CACHE_SLOT_SIZE;
+}
+
+bool shared_cache_lookup(SharedCache *sc, uint64_t image_id, uint64_t offset,
+                         void *buf)
+{
+    SharedCacheSlot *set = shared_cache_find_set(sc, image_id, offset);
+    unsigned i;
+
+    assert(QEMU_IS_ALIGNED(offset, SHARED_CACHE_SLOT_SIZE));
+    for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+        SharedCacheSlot *slot = &set[i];
+        uint32_t seq = atomic_read(&slot->seq);
+
+        if (seq & 1) {
+            continue;
+        }
+        smp_rmb();
+        if (slot->image_id != image_id || slot->offset != offset) {
+            continue;
+        }
+        memcpy(buf, shared_cache_slot_data(sc, slot), SHARED_CACHE_SLOT_SIZE);
+
+        /* If the slot was rewritten meanwhile, buf holds garbage */
+        smp_rmb();
+        if (atomic_read(&slot->seq) != seq) {
+            break;
+        }
+        if (!atomic_read(&slot->referenced)) {
+            atomic_set(&slot->referenced, 1);
+        }
+        sc->hits++;
+        trace_shared_cache_lookup(sc, image_id, offset, true);
+        return true;
+    }
+
+    sc->misses++;
+    trace_shared_cache_lookup(sc, image_id, offset, false);
+    return false;
+}
+
+void shared_cache_insert(SharedCache *sc, uint64_t image_id, uint64_t offset,
+                         const void *buf)
+{
+    SharedCacheSlot *set = shared_cache_find_set(sc, image_id, offset);
+    SharedCacheSlot *victim = NULL;
+    unsigned start, i;
+    uint32_t seq;
+
+    assert(QEMU_IS_ALIGNED(offset, SHARED_CACHE_SLOT_SIZE));
+
+    /* Another process may have filled it in the meantime */
+    for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+        if (set[i].image_id == image_id && set[i].offset == offset) {
+            return;
+        }
+    }
+
+    /* Start from a different way for each offset, so that the sets do not
+     * all evict their first slot over and over.
+     */
+    start = (offset / SHARED_CACHE_SLOT_SIZE) % SHARED_CACHE_WAYS;
+    for (i = 0; i < 2 * SHARED_CACHE_WAYS; i++) {
+        SharedCacheSlot *slot = &set[(start + i) % SHARED_CACHE_WAYS];
+
+        if (!atomic_read(&slot->referenced)) {
+            victim = slot;
+            break;
+        }
+        atomic_set(&slot->referenced, 0);
+    }
+    if (!victim) {
+        victim = &set[start];
+    }
+
+    seq = atomic_read(&victim->seq);
+    if ((seq & 1) || atomic_cmpxchg(&victim->seq, seq, seq + 1) != seq) {
+        return;
+    }
+    smp_wmb();
+
+    victim->image_id = image_id;
+    victim->offset = offset;
+    memcpy(shared_cache_slot_data(sc, victim), buf, SHARED_CACHE_SLOT_SIZE);
+    atomic_set(&victim->referenced, 1);
+
+    smp_wmb();
+    atomic_set(&victim->seq, seq + 2);
+    trace_shared_cache_insert(sc, image_id, offset);
+}
+
+void shared_cache_get_stats(SharedCache *sc, uint64_t *hits, uint64_t *misses)
+{
+    *hits = sc->hits;
+    *misses = sc->misses;
+}
+
+/* Called with the file locked, so that only one process formats it */
+static int shared_cache_format(int fd, uint64_t size, Error **errp)
+{
+    SharedCacheHeader hdr = {
+        .version = SHARED_CACHE_VERSION,
+        .slot_size = SHARED_CACHE_SLOT_SIZE,
+        .ways = SHARED_CACHE_WAYS,
+    };
+    uint64_t nb_slots = 0, slots_size;
+#ifdef CONFIG_POSIX_FALLOCATE
+    int ret;
+#endif
+
+    if (size > SHARED_CACHE_HEADER_SIZE) {
+        nb_slots = (size - SHARED_CACHE_HEADER_SIZE) /
+                   (SHARED_CACHE_SLOT_SIZE + sizeof(SharedCacheSlot));
+    }
+    hdr.nb_sets = nb_slots / SHARED_CACHE_WAYS;
+    if (hdr.nb_sets == 0) {
+        error_setg(errp, "Shared cache size must be at least %d bytes",
+                   SHARED_CACHE_HEADER_SIZE + SHARED_CACHE_WAYS *
+                   (SHARED_CACHE_SLOT_SIZE + (int)sizeof(SharedCacheSlot)));
+        return -EINVAL;
+    }
+
+    slots_size = hdr.nb_sets * SHARED_CACHE_WAYS * sizeof(SharedCacheSlot);
+    hdr.data_offset = SHARED_CACHE_HEADER_SIZE +
+                      ROUND_UP(slots_size, SHARED_CACHE_HEADER_SIZE);
+    size = hdr.data_offset +
+           hdr.nb_sets * SHARED_CACHE_WAYS * SHARED_CACHE_SLOT_SIZE;
+
+    /* The new file is all zeroes, which means all slots are empty */
+    if (ftruncate(fd, size) < 0) {
+        error_setg_errno(errp, errno, "Could not resize shared cache");
+        return -errno;
+    }
+
+#ifdef CONFIG_POSIX_FALLOCATE
+    /* Back every page now.  On a full tmpfs, the first store to a hole in
+     * shared_cache_insert() would raise SIGBUS in the middle of a request.
+     * posix_fallocate() doesn't set errno.
+     */
+    ret = posix_fallocate(fd, 0, size);
+    if (ret) {
+        error_setg_errno(errp, ret, "Could not allocate shared cache");
+        return -ret;
+    }
+#endif
+
+    /* Write the magic last, a process that crashes here leaves behind a
+     * file that is not recognized and will fail to open.
+     */
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        error_setg_errno(errp, errno, "Could not write shared cache header");
+        return -errno;
+    }
+    memcpy(hdr.magic, SHARED_CACHE_MAGIC, sizeof(hdr.magic));
+    if (pwrite(fd, hdr.magic, sizeof(hdr.magic), 0) != sizeof(hdr.magic)) {
+        error_setg_errno(errp, errno, "Could not write shared cache header");
+        return -errno;
+    }
+    return 0;
+}
+
+static int shared_cache_map(SharedCache *sc, int fd, Error **errp)
+{
+    SharedCacheHeader *hdr;
+    struct stat st;
+    void *addr;
+
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Could not stat shared cache");
+        return -errno;
+    }
+    if (st.st_size < SHARED_CACHE_HEADER_SIZE) {
+        error_setg(errp, "Shared cache file is truncated");
+        return -EINVAL;
+    }
+
+    addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Could not map shared cache");
+        return -errno;
+    }
+    sc->base = addr;
+    sc->size = st.st_size;
+
+    hdr = addr;
+    if (memcmp(hdr->magic, SHARED_CACHE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != SHARED_CACHE_VERSION ||
+        hdr->slot_size != SHARED_CACHE_SLOT_SIZE ||
+        hdr->ways != SHARED_CACHE_WAYS ||
+        hdr->data_offset +
+        hdr->nb_sets * SHARED_CACHE_WAYS * SHARED_CACHE_SLOT_SIZE > sc->size) {
+        error_setg(errp, "'%s' is not a compatible shared cache", sc->path);
+        return -EINVAL;
+    }
+
+    sc->nb_sets = hdr->nb_sets;
+    sc->slots = (SharedCacheSlot *)(sc->base + SHARED_CACHE_HEADER_SIZE);
+    sc->data = sc->base + hdr->data_offset;
+    return 0;
+}
+
+static void shared_cache_free(SharedCache *sc)
+{
+    if (sc->base) {
+        munmap(sc->base, sc->size);
+    }
+    g_free(sc->path);
+    g_free(sc);
+}
+
+SharedCache *shared_cache_open(const char *path, uint64_t size, Error **errp)
+{
+    SharedCache *sc;
+    struct stat st;
+    int fd, ret;
+
+    QLIST_FOREACH(sc, &shared_caches, next) {
+        if (!strcmp(sc->path, path)) {
+            sc->refcnt++;
+            return sc;
+        }
+    }
+
+    fd = qemu_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Could not open shared cache '%s'",
+                         path);
+        return NULL;
+    }
+
+    sc = g_new0(SharedCache, 1);
+    sc->path = g_strdup(path);
+    sc->refcnt = 1;
+
+    if (flock(fd, LOCK_EX) < 0) {
+        error_setg_errno(errp, errno, "Could not lock shared cache '%s'",
+                         path);
+        goto fail;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Could not stat shared cache '%s'",
+                         path);
+        goto fail;
+    }
+    if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        error_setg(errp, "Shared cache '%s' must be owned by the current "
+                   "user and not writable by group or others", path);
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        ret = shared_cache_format(fd, size, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+    ret = shared_cache_map(sc, fd, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* The mapping keeps the file alive, the descriptor is not needed */
+    qemu_close(fd);
+
+    trace_shared_cache_open(sc, path, sc->size, sc->nb_sets);
+    QLIST_INSERT_HEAD(&shared_caches, sc, next);
+    return sc;
+
+fail:
+    qemu_close(fd);
+    shared_cache_free(sc);
+    return NULL;
+}
+
+void shared_cache_close(SharedCache *sc)
+{
+    if (--sc->refcnt > 0) {
+        return;
+    }
+    QLIST_REMOVE(sc, next);
+    shared_cache_free(sc);
+}
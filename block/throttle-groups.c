@@ -52,15 +52,32 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BlockBackend's timers only after verifying that
  * that BlockBackend has throttled requests in the queue.
+ *
+ * When the group is over its limits, the members take turns using
+ * start-time fair queueing: each member has a virtual time that advances
+ * by the cost of its requests divided by its weight, and the member with
+ * pending requests and the lowest virtual time goes next.  The group's
+ * virtual time follows the requests that are let through.  A member that
+ * was idle may lag behind it by at most THROTTLE_GROUP_BURST_CREDIT bytes
+ * of service, so it can burst that much ahead of the busy members, but
+ * it cannot save up any more than that.
  */
+
+/* Requests cost their size in bytes, but at least this much */
+#define THROTTLE_GROUP_MIN_COST      4096
+#define THROTTLE_GROUP_BURST_CREDIT  (256 * 1024)
+/* Scale of the virtual time, so that dividing by the weight stays precise */
+#define THROTTLE_GROUP_VTIME_SHIFT   10
+
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockBackendPublic) head;
     BlockBackend *tokens[2];
     bool any_timer_armed[2];
+    uint64_t vtime[2];
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
@@ -168,39 +185,82 @@ static BlockBackend *throttle_group_next_blk(BlockBackend *blk)
     return blk_by_public(next);
 }
 
-/* Return the next BlockBackend in the round-robin sequence with pending I/O
- * requests.
+/* Return the virtual time at which the next request of a BlockBackend
+ * starts, taking into account the burst credit of idle members.
  *
  * This assumes that tg->lock is held.
+ */
+static uint64_t throttle_group_start_vtime(ThrottleGroup *tg,
+                                           BlockBackendPublic *blkp,
+                                           bool is_write)
+{
+    uint64_t credit = ((uint64_t)THROTTLE_GROUP_BURST_CREDIT <<
+                       THROTTLE_GROUP_VTIME_SHIFT) / blkp->throttle_weight;
+    uint64_t min_vtime = tg->vtime[is_write] > credit ?
+                         tg->vtime[is_write] - credit : 0;
+
+    return MAX(blkp->throttle_vtime[is_write], min_vtime);
+}
+
+/* Return the BlockBackend whose request should go next: the one with the
+ * lowest start virtual time among those with pending requests and, if
+ * @submitting is true, the current BlockBackend.
  *
- * @blk:       the current BlockBackend
- * @is_write:  the type of operation (read/write)
- * @ret:       the next BlockBackend with pending requests, or blk if there is
- *             none.
+ * Idle members are never chosen, otherwise a member with a low virtual time
+ * but nothing to submit would hold the token while others have requests
+ * queued and no timer armed.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @blk:        the current BlockBackend
+ * @is_write:   the type of operation (read/write)
+ * @submitting: whether blk is about to submit a request of this type
+ * @ret:        the next BlockBackend, or blk if no other member has pending
+ *              requests
  */
-static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
+static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write,
+                                         bool submitting)
 {
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
-    BlockBackend *token, *start;
-
-    start = token = tg->tokens[is_write];
+    BlockBackendPublic *iter, *token = NULL;
+    uint64_t vtime, min_vtime = 0;
 
-    /* get next bs round in round robin style */
-    token = throttle_group_next_blk(token);
-    while (token != start && !blkp->pending_reqs[is_write]) {
-        token = throttle_group_next_blk(token);
+    if (submitting || blkp->pending_reqs[is_write]) {
+        token = blkp;
+        min_vtime = throttle_group_start_vtime(tg, blkp, is_write);
     }
 
-    /* If no IO are queued for scheduling on the next round robin token
-     * then decide the token is the current bs because chances are
-     * the current bs get the current request queued.
-     */
-    if (token == start && !blkp->pending_reqs[is_write]) {
-        token = blk;
+    QLIST_FOREACH(iter, &tg->head, round_robin) {
+        if (iter == blkp || !iter->pending_reqs[is_write]) {
+            continue;
+        }
+        vtime = throttle_group_start_vtime(tg, iter, is_write);
+        if (!token || vtime < min_vtime) {
+            token = iter;
+            min_vtime = vtime;
+        }
     }
 
-    return token;
+    return blk_by_public(token ? token : blkp);
+}
+
+/* Charge a request that is let through to the virtual time of its
+ * BlockBackend and advance the virtual time of the group.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_account_vtime(BlockBackend *blk, unsigned int bytes,
+                                         bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    uint64_t start = throttle_group_start_vtime(tg, blkp, is_write);
+    uint64_t cost = MAX(bytes, THROTTLE_GROUP_MIN_COST);
+
+    tg->vtime[is_write] = MAX(tg->vtime[is_write], start);
+    blkp->throttle_vtime[is_write] = start +
+        (cost << THROTTLE_GROUP_VTIME_SHIFT) / blkp->throttle_weight;
 }
 
 /* Check if the next I/O request for a BlockBackend needs to be throttled or
@@ -252,12 +312,14 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
 {
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    BlockBackendPublic *tokenp;
     bool must_wait;
     BlockBackend *token;
 
     /* Check if there's any pending request to schedule next */
-    token = next_throttle_token(blk, is_write);
-    if (!blkp->pending_reqs[is_write]) {
+    token = next_throttle_token(blk, is_write, false);
+    tokenp = blk_get_public(token);
+    if (!tokenp->pending_reqs[is_write]) {
         return;
     }
 
@@ -266,12 +328,11 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current blk */
-        if (qemu_in_coroutine() &&
-            qemu_co_queue_next(&blkp->throttled_reqs[is_write])) {
-            token = blk;
-        } else {
-            ThrottleTimers *tt = &blkp->throttle_timers;
+        /* Requests from the current blk can be restarted directly, the
+         * others must run in the AioContext of their BlockBackend */
+        if (token != blk || !qemu_in_coroutine() ||
+            !qemu_co_queue_next(&blkp->throttled_reqs[is_write])) {
+            ThrottleTimers *tt = &tokenp->throttle_timers;
             int64_t now = qemu_clock_get_ns(tt->clock_type);
             timer_mod(tt->timers[is_write], now + 1);
             tg->any_timer_armed[is_write] = true;
@@ -281,8 +342,7 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
 }
 
 /* Check if an I/O request needs to be throttled, wait and set a timer
- * if necessary, and schedule the next request using a round robin
- * algorithm.
+ * if necessary, and schedule the next request using the fair scheduler.
  *
  * @blk:       the current BlockBackend
  * @bytes:     the number of bytes for this I/O
@@ -300,20 +360,26 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
-    token = next_throttle_token(blk, is_write);
+    token = next_throttle_token(blk, is_write, true);
     must_wait = throttle_group_schedule_timer(token, is_write);
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || blkp->pending_reqs[is_write]) {
+        QEMUClockType clock_type = blkp->throttle_timers.clock_type;
+        int64_t start_ns = qemu_clock_get_ns(clock_type);
+
         blkp->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_queue_wait(&blkp->throttled_reqs[is_write]);
         qemu_mutex_lock(&tg->lock);
         blkp->pending_reqs[is_write]--;
+        blkp->throttled_ns[is_write] += qemu_clock_get_ns(clock_type) -
+                                        start_ns;
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(blkp->throttle_state, is_write, bytes);
+    throttle_group_account_vtime(blk, bytes, is_write);
 
     /* Schedule the next request */
     schedule_next_request(blk, is_write);
@@ -361,6 +427,48 @@ void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg)
     qemu_co_enter_next(&blkp->throttled_reqs[1]);
 }
 
+/* Set the weight of a BlockBackend in its throttling group, which is its
+ * share of the group's I/O when the group is over its limits, relative to
+ * the weights of the other members.
+ *
+ * @blk:    a BlockBackend, member of a group or not
+ * @weight: the weight, between 1 and THROTTLE_GROUP_WEIGHT_MAX
+ */
+void throttle_group_set_weight(BlockBackend *blk, unsigned int weight)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg;
+
+    assert(weight > 0 && weight <= THROTTLE_GROUP_WEIGHT_MAX);
+
+    if (!blkp->throttle_state) {
+        blkp->throttle_weight = weight;
+        return;
+    }
+
+    tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    qemu_mutex_lock(&tg->lock);
+    blkp->throttle_weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+unsigned int throttle_group_get_weight(BlockBackend *blk)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg;
+    unsigned int weight;
+
+    if (!blkp->throttle_state) {
+        return blkp->throttle_weight;
+    }
+
+    tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    qemu_mutex_lock(&tg->lock);
+    weight = blkp->throttle_weight;
+    qemu_mutex_unlock(&tg->lock);
+    return weight;
+}
+
 /* Get the throttle configuration from a particular group. Similar to
  * throttle_get_config(), but guarantees atomicity within the
  * throttling group.
@@ -446,6 +554,8 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
         if (!tg->tokens[i]) {
             tg->tokens[i] = blk;
         }
+        /* Join the fair scheduler at the group's current virtual time */
+        blkp->throttle_vtime[i] = tg->vtime[i];
     }
 
     QLIST_INSERT_HEAD(&tg->head, blkp, round_robin);
@@ -173,7 +173,12 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         writable = false;
     }
 
-    exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
+    /* There is no limit on the number of clients, and they all go
+     * through the same BlockBackend, so clients may open several
+     * connections to the export.  */
+    exp = nbd_export_new(bs, 0, -1,
+                         NBD_FLAG_CAN_MULTI_CONN |
+                         (writable ? 0 : NBD_FLAG_READ_ONLY),
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         return;
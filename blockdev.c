@@ -375,6 +375,8 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
             if (!strcmp(aio, "native")) {
                 *bdrv_flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(aio, "io_uring")) {
+                *bdrv_flags |= BDRV_O_IO_URING;
             } else if (!strcmp(aio, "threads")) {
                 /* this is the default */
             } else {
@@ -482,6 +484,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockdevDetectZeroesOptions detect_zeroes =
         BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
     const char *throttling_group = NULL;
+    uint64_t throttling_weight;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -528,6 +531,15 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    throttling_weight = qemu_opt_get_number(opts, "throttling.group-weight",
+                                            THROTTLE_GROUP_WEIGHT_DEFAULT);
+    if (throttling_weight < 1 ||
+        throttling_weight > THROTTLE_GROUP_WEIGHT_MAX) {
+        error_setg(errp, "throttling.group-weight must be between 1 and %d",
+                   THROTTLE_GROUP_WEIGHT_MAX);
+        goto early_err;
+    }
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
         if (is_help_option(buf)) {
             error_printf("Supported formats:");
@@ -624,6 +636,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         }
         blk_io_limits_enable(blk, throttling_group);
         blk_set_io_limits(blk, &cfg);
+        throttle_group_set_weight(blk, throttling_weight);
     }
 
     blk_set_enable_write_cache(blk, !writethrough);
@@ -2016,6 +2029,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2712,6 +2726,14 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         cfg.op_size = arg->iops_size;
     }
 
+    if (arg->has_group_weight &&
+        (arg->group_weight < 1 ||
+         arg->group_weight > THROTTLE_GROUP_WEIGHT_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "group_weight",
+                   "a value between 1 and 1000");
+        goto out;
+    }
+
     if (!throttle_is_valid(&cfg, errp)) {
         goto out;
     }
@@ -2729,6 +2751,9 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         }
         /* Set the new throttling configuration */
         blk_set_io_limits(blk, &cfg);
+        if (arg->has_group_weight) {
+            throttle_group_set_weight(blk, arg->group_weight);
+        }
     } else if (blk_get_public(blk)->throttle_state) {
         /* If all throttling settings are set to 0, disable I/O limits */
         blk_io_limits_disable(blk);
@@ -2738,12 +2763,102 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(bool has_device, const char *device,
+                                     bool has_id, const char *id,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     bool has_enable, bool enable,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    uint64List *type_boundaries[BLOCK_MAX_IOTYPE];
+    int i;
+
+    blk = qmp_get_blk(has_device ? device : NULL, has_id ? id : NULL, errp);
+    if (!blk) {
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+    stats = blk_get_stats(blk);
+
+    if (has_enable && !enable) {
+        if (has_boundaries || has_boundaries_read || has_boundaries_write ||
+            has_boundaries_flush) {
+            error_setg(errp, "Boundaries cannot be given when disabling the "
+                       "latency histograms");
+            goto out;
+        }
+        for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+            block_latency_histogram_remove(stats, i);
+        }
+        goto out;
+    }
+
+    type_boundaries[BLOCK_ACCT_READ] =
+        has_boundaries_read ? boundaries_read : boundaries;
+    type_boundaries[BLOCK_ACCT_WRITE] =
+        has_boundaries_write ? boundaries_write : boundaries;
+    type_boundaries[BLOCK_ACCT_FLUSH] =
+        has_boundaries_flush ? boundaries_flush : boundaries;
+
+    /* Check all the boundaries first, so that a failed command leaves the
+     * histograms untouched */
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        if (!block_latency_histogram_check(type_boundaries[i])) {
+            error_setg(errp, "Latency histogram boundaries must be greater "
+                       "than zero and strictly ascending");
+            goto out;
+        }
+    }
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        int ret = block_latency_histogram_set(stats, i, type_boundaries[i]);
+        assert(ret == 0);
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
+void qmp_block_latency_histogram_reset(bool has_device, const char *device,
+                                       bool has_id, const char *id,
+                                       Error **errp)
+{
+    BlockBackend *blk;
+    AioContext *aio_context;
+    int i;
+
+    blk = qmp_get_blk(has_device ? device : NULL, has_id ? id : NULL, errp);
+    if (!blk) {
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_reset(blk_get_stats(blk), i);
+    }
+    aio_context_release(aio_context);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2769,7 +2884,19 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    if (persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap != NULL) {
+        bdrv_dirty_bitmap_set_persistence(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -3181,6 +3308,14 @@ static void do_drive_backup(DriveBackup *backup, BlockJobTxn *txn, Error **errp)
     if (!backup->has_compress) {
         backup->compress = false;
     }
+    if (!backup->has_max_workers) {
+        backup->max_workers = 0;
+    } else if (backup->max_workers < 1 ||
+               backup->max_workers > BACKUP_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value in range [1, " stringify(BACKUP_MAX_WORKERS) "]");
+        return;
+    }
 
     bs = qmp_get_root_bs(backup->device, errp);
     if (!bs) {
@@ -3259,8 +3394,9 @@ static void do_drive_backup(DriveBackup *backup, BlockJobTxn *txn, Error **errp)
     }
 
     backup_start(backup->job_id, bs, target_bs, backup->speed, backup->sync,
-                 bmap, backup->compress, backup->on_source_error,
-                 backup->on_target_error, block_job_cb, bs, txn, &local_err);
+                 bmap, backup->compress, backup->max_workers,
+                 backup->on_source_error, backup->on_target_error,
+                 block_job_cb, bs, txn, &local_err);
     bdrv_unref(target_bs);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
@@ -3303,6 +3439,14 @@ void do_blockdev_backup(BlockdevBackup *backup, BlockJobTxn *txn, Error **errp)
     if (!backup->has_compress) {
         backup->compress = false;
     }
+    if (!backup->has_max_workers) {
+        backup->max_workers = 0;
+    } else if (backup->max_workers < 1 ||
+               backup->max_workers > BACKUP_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value in range [1, " stringify(BACKUP_MAX_WORKERS) "]");
+        return;
+    }
 
     bs = qmp_get_root_bs(backup->device, errp);
     if (!bs) {
@@ -3329,8 +3473,9 @@ void do_blockdev_backup(BlockdevBackup *backup, BlockJobTxn *txn, Error **errp)
         }
     }
     backup_start(backup->job_id, bs, target_bs, backup->speed, backup->sync,
-                 NULL, backup->compress, backup->on_source_error,
-                 backup->on_target_error, block_job_cb, bs, txn, &local_err);
+                 NULL, backup->compress, backup->max_workers,
+                 backup->on_source_error, backup->on_target_error,
+                 block_job_cb, bs, txn, &local_err);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
     }
@@ -4011,7 +4156,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = BDRV_OPT_CACHE_WB,
             .type = QEMU_OPT_BOOL,
@@ -4112,6 +4257,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.group",
             .type = QEMU_OPT_STRING,
             .help = "name of the block throttling group",
+        },{
+            .name = "throttling.group-weight",
+            .type = QEMU_OPT_NUMBER,
+            .help = "share of the throttling group's I/O for this drive",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -4146,7 +4295,7 @@ static QemuOptsList qemu_root_bds_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
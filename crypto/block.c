@@ -30,6 +30,28 @@ static const QCryptoBlockDriver *qcrypto_block_drivers[] = {
 };
 
 
+static QCryptoBlock *qcrypto_block_new(QCryptoBlockFormat format)
+{
+    QCryptoBlock *block = g_new0(QCryptoBlock, 1);
+
+    block->format = format;
+    qemu_mutex_init(&block->mutex);
+    qemu_cond_init(&block->cipher_cond);
+    return block;
+}
+
+
+/* Frees what qcrypto_block_new() allocated; the driver state, cipher and
+ * IV generator are released by the caller.
+ */
+static void qcrypto_block_destroy(QCryptoBlock *block)
+{
+    qemu_cond_destroy(&block->cipher_cond);
+    qemu_mutex_destroy(&block->mutex);
+    g_free(block);
+}
+
+
 bool qcrypto_block_has_format(QCryptoBlockFormat format,
                               const uint8_t *buf,
                               size_t len)
@@ -51,25 +73,24 @@ QCryptoBlock *qcrypto_block_open(QCryptoBlockOpenOptions *options,
                                  QCryptoBlockReadFunc readfunc,
                                  void *opaque,
                                  unsigned int flags,
+                                 size_t n_threads,
                                  Error **errp)
 {
-    QCryptoBlock *block = g_new0(QCryptoBlock, 1);
-
-    block->format = options->format;
+    QCryptoBlock *block;
 
     if (options->format >= G_N_ELEMENTS(qcrypto_block_drivers) ||
         !qcrypto_block_drivers[options->format]) {
         error_setg(errp, "Unsupported block driver %s",
                    QCryptoBlockFormat_lookup[options->format]);
-        g_free(block);
         return NULL;
     }
 
+    block = qcrypto_block_new(options->format);
     block->driver = qcrypto_block_drivers[options->format];
 
     if (block->driver->open(block, options,
-                            readfunc, opaque, flags, errp) < 0) {
-        g_free(block);
+                            readfunc, opaque, flags, n_threads, errp) < 0) {
+        qcrypto_block_destroy(block);
         return NULL;
     }
 
@@ -83,23 +104,21 @@ QCryptoBlock *qcrypto_block_create(QCryptoBlockCreateOptions *options,
                                    void *opaque,
                                    Error **errp)
 {
-    QCryptoBlock *block = g_new0(QCryptoBlock, 1);
-
-    block->format = options->format;
+    QCryptoBlock *block;
 
     if (options->format >= G_N_ELEMENTS(qcrypto_block_drivers) ||
         !qcrypto_block_drivers[options->format]) {
         error_setg(errp, "Unsupported block driver %s",
                    QCryptoBlockFormat_lookup[options->format]);
-        g_free(block);
         return NULL;
     }
 
+    block = qcrypto_block_new(options->format);
     block->driver = qcrypto_block_drivers[options->format];
 
     if (block->driver->create(block, options, initfunc,
                               writefunc, opaque, errp) < 0) {
-        g_free(block);
+        qcrypto_block_destroy(block);
         return NULL;
     }
 
@@ -146,7 +165,7 @@ int qcrypto_block_encrypt(QCryptoBlock *block,
 
 QCryptoCipher *qcrypto_block_get_cipher(QCryptoBlock *block)
 {
-    return block->cipher;
+    return block->n_ciphers > 0 ? block->ciphers[0] : NULL;
 }
 
 
@@ -176,95 +195,130 @@ void qcrypto_block_free(QCryptoBlock *block)
 
     block->driver->cleanup(block);
 
-    qcrypto_cipher_free(block->cipher);
+    qcrypto_block_free_cipher(block);
     qcrypto_ivgen_free(block->ivgen);
-    g_free(block);
+    qcrypto_block_destroy(block);
 }
 
 
-int qcrypto_block_decrypt_helper(QCryptoCipher *cipher,
-                                 size_t niv,
-                                 QCryptoIVGen *ivgen,
-                                 int sectorsize,
-                                 uint64_t startsector,
-                                 uint8_t *buf,
-                                 size_t len,
-                                 Error **errp)
+int qcrypto_block_init_cipher(QCryptoBlock *block,
+                              QCryptoCipherAlgorithm alg,
+                              QCryptoCipherMode mode,
+                              const uint8_t *key, size_t nkey,
+                              size_t n_threads, Error **errp)
 {
-    uint8_t *iv;
-    int ret = -1;
+    size_t i;
 
-    iv = niv ? g_new0(uint8_t, niv) : NULL;
+    assert(!block->ciphers && n_threads > 0);
 
-    while (len > 0) {
-        size_t nbytes;
-        if (niv) {
-            if (qcrypto_ivgen_calculate(ivgen,
-                                        startsector,
-                                        iv, niv,
-                                        errp) < 0) {
-                goto cleanup;
-            }
+    block->ciphers = g_new0(QCryptoCipher *, n_threads);
 
-            if (qcrypto_cipher_setiv(cipher,
-                                     iv, niv,
-                                     errp) < 0) {
-                goto cleanup;
-            }
+    for (i = 0; i < n_threads; i++) {
+        block->ciphers[i] = qcrypto_cipher_new(alg, mode, key, nkey, errp);
+        if (!block->ciphers[i]) {
+            qcrypto_block_free_cipher(block);
+            return -1;
         }
+        block->n_ciphers++;
+        block->n_free_ciphers++;
+    }
 
-        nbytes = len > sectorsize ? sectorsize : len;
-        if (qcrypto_cipher_decrypt(cipher, buf, buf,
-                                   nbytes, errp) < 0) {
-            goto cleanup;
-        }
+    return 0;
+}
 
-        startsector++;
-        buf += nbytes;
-        len -= nbytes;
+
+void qcrypto_block_free_cipher(QCryptoBlock *block)
+{
+    size_t i;
+
+    if (!block->ciphers) {
+        return;
     }
 
-    ret = 0;
- cleanup:
-    g_free(iv);
-    return ret;
+    assert(block->n_ciphers == block->n_free_ciphers);
+
+    for (i = 0; i < block->n_ciphers; i++) {
+        qcrypto_cipher_free(block->ciphers[i]);
+    }
+
+    g_free(block->ciphers);
+    block->ciphers = NULL;
+    block->n_ciphers = block->n_free_ciphers = 0;
 }
 
 
-int qcrypto_block_encrypt_helper(QCryptoCipher *cipher,
-                                 size_t niv,
-                                 QCryptoIVGen *ivgen,
-                                 int sectorsize,
-                                 uint64_t startsector,
-                                 uint8_t *buf,
-                                 size_t len,
-                                 Error **errp)
+static QCryptoCipher *qcrypto_block_pop_cipher(QCryptoBlock *block)
 {
+    QCryptoCipher *cipher;
+
+    qemu_mutex_lock(&block->mutex);
+    while (block->n_free_ciphers == 0) {
+        qemu_cond_wait(&block->cipher_cond, &block->mutex);
+    }
+    cipher = block->ciphers[--block->n_free_ciphers];
+    qemu_mutex_unlock(&block->mutex);
+
+    return cipher;
+}
+
+
+static void qcrypto_block_push_cipher(QCryptoBlock *block,
+                                      QCryptoCipher *cipher)
+{
+    qemu_mutex_lock(&block->mutex);
+    assert(block->n_free_ciphers < block->n_ciphers);
+    block->ciphers[block->n_free_ciphers++] = cipher;
+    qemu_cond_signal(&block->cipher_cond);
+    qemu_mutex_unlock(&block->mutex);
+}
+
+
+static int qcrypto_block_cipher_helper(QCryptoBlock *block,
+                                      int sectorsize,
+                                      uint64_t startsector,
+                                      uint8_t *buf,
+                                      size_t len,
+                                      bool encrypt,
+                                      Error **errp)
+{
+    QCryptoCipher *cipher;
     uint8_t *iv;
     int ret = -1;
+    int rv;
 
-    iv = niv ? g_new0(uint8_t, niv) : NULL;
+    cipher = qcrypto_block_pop_cipher(block);
+    iv = block->niv ? g_new0(uint8_t, block->niv) : NULL;
 
     while (len > 0) {
         size_t nbytes;
-        if (niv) {
-            if (qcrypto_ivgen_calculate(ivgen,
-                                        startsector,
-                                        iv, niv,
-                                        errp) < 0) {
+        if (block->niv) {
+            /* The IV generator may use a cipher of its own (ESSIV),
+             * so it is shared among threads under the lock.
+             */
+            qemu_mutex_lock(&block->mutex);
+            rv = qcrypto_ivgen_calculate(block->ivgen,
+                                         startsector,
+                                         iv, block->niv,
+                                         errp);
+            qemu_mutex_unlock(&block->mutex);
+            if (rv < 0) {
                 goto cleanup;
             }
 
             if (qcrypto_cipher_setiv(cipher,
-                                     iv, niv,
+                                     iv, block->niv,
                                      errp) < 0) {
                 goto cleanup;
             }
         }
 
         nbytes = len > sectorsize ? sectorsize : len;
-        if (qcrypto_cipher_encrypt(cipher, buf, buf,
-                                   nbytes, errp) < 0) {
+        if (encrypt) {
+            rv = qcrypto_cipher_encrypt(cipher, buf, buf, nbytes, errp);
+        } else {
+            rv = qcrypto_cipher_decrypt(cipher, buf, buf, nbytes, errp);
+        }
+        if (rv < 0) {
             goto cleanup;
         }
 
@@ -276,5 +330,30 @@ int qcrypto_block_encrypt_helper(QCryptoCipher *cipher,
     ret = 0;
  cleanup:
     g_free(iv);
+    qcrypto_block_push_cipher(block, cipher);
     return ret;
 }
+
+
+int qcrypto_block_decrypt_helper(QCryptoBlock *block,
+                                 int sectorsize,
+                                 uint64_t startsector,
+                                 uint8_t *buf,
+                                 size_t len,
+                                 Error **errp)
+{
+    return qcrypto_block_cipher_helper(block, sectorsize, startsector,
+                                       buf, len, false, errp);
+}
+
+
+int qcrypto_block_encrypt_helper(QCryptoBlock *block,
+                                 int sectorsize,
+                                 uint64_t startsector,
+                                 uint8_t *buf,
+                                 size_t len,
+                                 Error **errp)
+{
+    return qcrypto_block_cipher_helper(block, sectorsize, startsector,
+                                       buf, len, true, errp);
+}
@@ -27,6 +27,14 @@ typedef struct QCryptoCipherBuiltinAESContext QCryptoCipherBuiltinAESContext;
 struct QCryptoCipherBuiltinAESContext {
     AES_KEY enc;
     AES_KEY dec;
+#ifdef CONFIG_AESNI_OPT
+    /* Round keys in the byte order used by the AES-NI instructions;
+     * only valid if @aesni is true.
+     */
+    bool aesni;
+    uint8_t aesni_enc[AES_MAXNR + 1][AES_BLOCK_SIZE];
+    uint8_t aesni_dec[AES_MAXNR + 1][AES_BLOCK_SIZE];
+#endif
 };
 typedef struct QCryptoCipherBuiltinAES QCryptoCipherBuiltinAES;
 struct QCryptoCipherBuiltinAES {
@@ -73,16 +81,246 @@ static void qcrypto_cipher_free_aes(QCryptoCipher *cipher)
 }
 
 
-static void qcrypto_cipher_aes_ecb_encrypt(AES_KEY *key,
-                                           const void *in,
-                                           void *out,
-                                           size_t len)
+#ifdef CONFIG_AESNI_OPT
+#pragma GCC push_options
+#pragma GCC target("aes,sse2")
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+/* Number of blocks kept in flight by the AES-NI ECB and CBC decryption
+ * loops.  The AES instructions have a latency of several cycles but can
+ * be issued every cycle, so independent blocks are interleaved.
+ */
+#define AESNI_INTERLEAVE 8
+
+static bool qcrypto_aesni_available;
+
+static void __attribute__((constructor)) qcrypto_aesni_init(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        qcrypto_aesni_available = (c & bit_AES) && (d & bit_SSE2);
+    }
+}
+
+/* Converts the key schedules computed by crypto/aes.c, which hold each
+ * round key as four big-endian words, to the layout used by AES-NI.  The
+ * decryption schedule is the one of the "equivalent inverse cipher", as
+ * expected by AESDEC.
+ */
+static void qcrypto_aesni_set_key(QCryptoCipherBuiltinAESContext *ctx)
+{
+    int rounds = ctx->enc.rounds;
+    int i, j;
+
+    for (i = 0; i <= rounds; i++) {
+        for (j = 0; j < 4; j++) {
+            uint32_t w = ctx->enc.rd_key[i * 4 + j];
+
+            ctx->aesni_enc[i][j * 4] = w >> 24;
+            ctx->aesni_enc[i][j * 4 + 1] = w >> 16;
+            ctx->aesni_enc[i][j * 4 + 2] = w >> 8;
+            ctx->aesni_enc[i][j * 4 + 3] = w;
+        }
+    }
+
+    memcpy(ctx->aesni_dec[0], ctx->aesni_enc[rounds], AES_BLOCK_SIZE);
+    for (i = 1; i < rounds; i++) {
+        __m128i k = _mm_loadu_si128((__m128i *)ctx->aesni_enc[rounds - i]);
+        _mm_storeu_si128((__m128i *)ctx->aesni_dec[i], _mm_aesimc_si128(k));
+    }
+    memcpy(ctx->aesni_dec[rounds], ctx->aesni_enc[0], AES_BLOCK_SIZE);
+    ctx->aesni = true;
+}
+
+static inline __m128i qcrypto_aesni_round(__m128i x, __m128i k, bool enc)
+{
+    return enc ? _mm_aesenc_si128(x, k) : _mm_aesdec_si128(x, k);
+}
+
+static inline __m128i qcrypto_aesni_last(__m128i x, __m128i k, bool enc)
+{
+    return enc ? _mm_aesenclast_si128(x, k) : _mm_aesdeclast_si128(x, k);
+}
+
+static inline __m128i qcrypto_aesni_block(__m128i x, const __m128i *rk,
+                                          int rounds, bool enc)
+{
+    int r;
+
+    x = _mm_xor_si128(x, rk[0]);
+    for (r = 1; r < rounds; r++) {
+        x = qcrypto_aesni_round(x, rk[r], enc);
+    }
+    return qcrypto_aesni_last(x, rk[rounds], enc);
+}
+
+/* Runs AESNI_INTERLEAVE blocks through the cipher at the same time */
+static inline void qcrypto_aesni_blocks(__m128i *x, const __m128i *rk,
+                                        int rounds, bool enc)
+{
+    int i, r;
+
+    for (i = 0; i < AESNI_INTERLEAVE; i++) {
+        x[i] = _mm_xor_si128(x[i], rk[0]);
+    }
+    for (r = 1; r < rounds; r++) {
+        for (i = 0; i < AESNI_INTERLEAVE; i++) {
+            x[i] = qcrypto_aesni_round(x[i], rk[r], enc);
+        }
+    }
+    for (i = 0; i < AESNI_INTERLEAVE; i++) {
+        x[i] = qcrypto_aesni_last(x[i], rk[rounds], enc);
+    }
+}
+
+static inline void qcrypto_aesni_load_key(__m128i *rk,
+                                          uint8_t (*key)[AES_BLOCK_SIZE],
+                                          int rounds)
+{
+    int r;
+
+    for (r = 0; r <= rounds; r++) {
+        rk[r] = _mm_loadu_si128((__m128i *)key[r]);
+    }
+}
+
+static inline void qcrypto_aesni_ecb(const QCryptoCipherBuiltinAESContext *ctx,
+                                     const uint8_t *in, uint8_t *out,
+                                     size_t nblocks, bool enc)
+{
+    __m128i rk[AES_MAXNR + 1], x[AESNI_INTERLEAVE];
+    int rounds = ctx->enc.rounds;
+    int i;
+
+    qcrypto_aesni_load_key(rk, (uint8_t (*)[AES_BLOCK_SIZE])
+                           (enc ? ctx->aesni_enc : ctx->aesni_dec), rounds);
+
+    for (; nblocks >= AESNI_INTERLEAVE; nblocks -= AESNI_INTERLEAVE) {
+        for (i = 0; i < AESNI_INTERLEAVE; i++) {
+            x[i] = _mm_loadu_si128((__m128i *)in + i);
+        }
+        qcrypto_aesni_blocks(x, rk, rounds, enc);
+        for (i = 0; i < AESNI_INTERLEAVE; i++) {
+            _mm_storeu_si128((__m128i *)out + i, x[i]);
+        }
+        in += AESNI_INTERLEAVE * AES_BLOCK_SIZE;
+        out += AESNI_INTERLEAVE * AES_BLOCK_SIZE;
+    }
+
+    for (; nblocks > 0; nblocks--) {
+        x[0] = _mm_loadu_si128((__m128i *)in);
+        x[0] = qcrypto_aesni_block(x[0], rk, rounds, enc);
+        _mm_storeu_si128((__m128i *)out, x[0]);
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+}
+
+static void qcrypto_aesni_ecb_encrypt(const QCryptoCipherBuiltinAESContext *ctx,
+                                      const uint8_t *in, uint8_t *out,
+                                      size_t nblocks)
+{
+    qcrypto_aesni_ecb(ctx, in, out, nblocks, true);
+}
+
+static void qcrypto_aesni_ecb_decrypt(const QCryptoCipherBuiltinAESContext *ctx,
+                                      const uint8_t *in, uint8_t *out,
+                                      size_t nblocks)
+{
+    qcrypto_aesni_ecb(ctx, in, out, nblocks, false);
+}
+
+/* CBC encryption is inherently serial, only decryption is interleaved */
+static void qcrypto_aesni_cbc_encrypt(const QCryptoCipherBuiltinAESContext *ctx,
+                                      const uint8_t *in, uint8_t *out,
+                                      size_t nblocks, uint8_t *iv)
+{
+    __m128i rk[AES_MAXNR + 1];
+    int rounds = ctx->enc.rounds;
+    __m128i x = _mm_loadu_si128((__m128i *)iv);
+
+    qcrypto_aesni_load_key(rk, (uint8_t (*)[AES_BLOCK_SIZE])ctx->aesni_enc,
+                           rounds);
+
+    for (; nblocks > 0; nblocks--) {
+        x = _mm_xor_si128(x, _mm_loadu_si128((__m128i *)in));
+        x = qcrypto_aesni_block(x, rk, rounds, true);
+        _mm_storeu_si128((__m128i *)out, x);
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+    _mm_storeu_si128((__m128i *)iv, x);
+}
+
+static void qcrypto_aesni_cbc_decrypt(const QCryptoCipherBuiltinAESContext *ctx,
+                                      const uint8_t *in, uint8_t *out,
+                                      size_t nblocks, uint8_t *iv)
+{
+    __m128i rk[AES_MAXNR + 1], x[AESNI_INTERLEAVE], c[AESNI_INTERLEAVE];
+    int rounds = ctx->enc.rounds;
+    __m128i prev = _mm_loadu_si128((__m128i *)iv);
+    int i;
+
+    qcrypto_aesni_load_key(rk, (uint8_t (*)[AES_BLOCK_SIZE])ctx->aesni_dec,
+                           rounds);
+
+    /* All ciphertext blocks are loaded before the plaintext is stored,
+     * so that @in and @out may be the same buffer.
+     */
+    for (; nblocks >= AESNI_INTERLEAVE; nblocks -= AESNI_INTERLEAVE) {
+        for (i = 0; i < AESNI_INTERLEAVE; i++) {
+            c[i] = x[i] = _mm_loadu_si128((__m128i *)in + i);
+        }
+        qcrypto_aesni_blocks(x, rk, rounds, false);
+        _mm_storeu_si128((__m128i *)out, _mm_xor_si128(x[0], prev));
+        for (i = 1; i < AESNI_INTERLEAVE; i++) {
+            _mm_storeu_si128((__m128i *)out + i, _mm_xor_si128(x[i], c[i - 1]));
+        }
+        prev = c[AESNI_INTERLEAVE - 1];
+        in += AESNI_INTERLEAVE * AES_BLOCK_SIZE;
+        out += AESNI_INTERLEAVE * AES_BLOCK_SIZE;
+    }
+
+    for (; nblocks > 0; nblocks--) {
+        c[0] = _mm_loadu_si128((__m128i *)in);
+        x[0] = qcrypto_aesni_block(c[0], rk, rounds, false);
+        _mm_storeu_si128((__m128i *)out, _mm_xor_si128(x[0], prev));
+        prev = c[0];
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+    _mm_storeu_si128((__m128i *)iv, prev);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AESNI_OPT */
+
+
+static void
+qcrypto_cipher_aes_ecb_encrypt(const QCryptoCipherBuiltinAESContext *ctx,
+                               const void *in,
+                               void *out,
+                               size_t len)
 {
     const uint8_t *inptr = in;
     uint8_t *outptr = out;
+
+#ifdef CONFIG_AESNI_OPT
+    if (ctx->aesni) {
+        size_t nblocks = len / AES_BLOCK_SIZE;
+
+        qcrypto_aesni_ecb_encrypt(ctx, inptr, outptr, nblocks);
+        inptr += nblocks * AES_BLOCK_SIZE;
+        outptr += nblocks * AES_BLOCK_SIZE;
+        len -= nblocks * AES_BLOCK_SIZE;
+    }
+#endif
     while (len) {
         if (len > AES_BLOCK_SIZE) {
-            AES_encrypt(inptr, outptr, key);
+            AES_encrypt(inptr, outptr, &ctx->enc);
             inptr += AES_BLOCK_SIZE;
             outptr += AES_BLOCK_SIZE;
             len -= AES_BLOCK_SIZE;
@@ -91,7 +329,7 @@ static void qcrypto_cipher_aes_ecb_encrypt(AES_KEY *key,
             memcpy(tmp1, inptr, len);
             /* Fill with 0 to avoid valgrind uninitialized reads */
             memset(tmp1 + len, 0, sizeof(tmp1) - len);
-            AES_encrypt(tmp1, tmp2, key);
+            AES_encrypt(tmp1, tmp2, &ctx->enc);
             memcpy(outptr, tmp2, len);
             len = 0;
         }
@@ -99,16 +337,28 @@ static void qcrypto_cipher_aes_ecb_encrypt(AES_KEY *key,
 }
 
 
-static void qcrypto_cipher_aes_ecb_decrypt(AES_KEY *key,
-                                           const void *in,
-                                           void *out,
-                                           size_t len)
+static void
+qcrypto_cipher_aes_ecb_decrypt(const QCryptoCipherBuiltinAESContext *ctx,
+                               const void *in,
+                               void *out,
+                               size_t len)
 {
     const uint8_t *inptr = in;
     uint8_t *outptr = out;
+
+#ifdef CONFIG_AESNI_OPT
+    if (ctx->aesni) {
+        size_t nblocks = len / AES_BLOCK_SIZE;
+
+        qcrypto_aesni_ecb_decrypt(ctx, inptr, outptr, nblocks);
+        inptr += nblocks * AES_BLOCK_SIZE;
+        outptr += nblocks * AES_BLOCK_SIZE;
+        len -= nblocks * AES_BLOCK_SIZE;
+    }
+#endif
     while (len) {
         if (len > AES_BLOCK_SIZE) {
-            AES_decrypt(inptr, outptr, key);
+            AES_decrypt(inptr, outptr, &ctx->dec);
             inptr += AES_BLOCK_SIZE;
             outptr += AES_BLOCK_SIZE;
             len -= AES_BLOCK_SIZE;
@@ -117,7 +367,7 @@ static void qcrypto_cipher_aes_ecb_decrypt(AES_KEY *key,
             memcpy(tmp1, inptr, len);
             /* Fill with 0 to avoid valgrind uninitialized reads */
             memset(tmp1 + len, 0, sizeof(tmp1) - len);
-            AES_decrypt(tmp1, tmp2, key);
+            AES_decrypt(tmp1, tmp2, &ctx->dec);
             memcpy(outptr, tmp2, len);
             len = 0;
         }
@@ -132,8 +382,7 @@ static void qcrypto_cipher_aes_xts_encrypt(const void *ctx,
 {
     const QCryptoCipherBuiltinAESContext *aesctx = ctx;
 
-    qcrypto_cipher_aes_ecb_encrypt((AES_KEY *)&aesctx->enc,
-                                   src, dst, length);
+    qcrypto_cipher_aes_ecb_encrypt(aesctx, src, dst, length);
 }
 
 
@@ -144,8 +393,7 @@ static void qcrypto_cipher_aes_xts_decrypt(const void *ctx,
 {
     const QCryptoCipherBuiltinAESContext *aesctx = ctx;
 
-    qcrypto_cipher_aes_ecb_decrypt((AES_KEY *)&aesctx->dec,
-                                   src, dst, length);
+    qcrypto_cipher_aes_ecb_decrypt(aesctx, src, dst, length);
 }
 
 
@@ -159,10 +407,18 @@ static int qcrypto_cipher_encrypt_aes(QCryptoCipher *cipher,
 
     switch (cipher->mode) {
     case QCRYPTO_CIPHER_MODE_ECB:
-        qcrypto_cipher_aes_ecb_encrypt(&ctxt->state.aes.key.enc,
+        qcrypto_cipher_aes_ecb_encrypt(&ctxt->state.aes.key,
                                        in, out, len);
         break;
     case QCRYPTO_CIPHER_MODE_CBC:
+#ifdef CONFIG_AESNI_OPT
+        if (ctxt->state.aes.key.aesni) {
+            qcrypto_aesni_cbc_encrypt(&ctxt->state.aes.key, in, out,
+                                      len / AES_BLOCK_SIZE,
+                                      ctxt->state.aes.iv);
+            break;
+        }
+#endif
         AES_cbc_encrypt(in, out, len,
                         &ctxt->state.aes.key.enc,
                         ctxt->state.aes.iv, 1);
@@ -193,10 +449,18 @@ static int qcrypto_cipher_decrypt_aes(QCryptoCipher *cipher,
 
     switch (cipher->mode) {
     case QCRYPTO_CIPHER_MODE_ECB:
-        qcrypto_cipher_aes_ecb_decrypt(&ctxt->state.aes.key.dec,
+        qcrypto_cipher_aes_ecb_decrypt(&ctxt->state.aes.key,
                                        in, out, len);
         break;
     case QCRYPTO_CIPHER_MODE_CBC:
+#ifdef CONFIG_AESNI_OPT
+        if (ctxt->state.aes.key.aesni) {
+            qcrypto_aesni_cbc_decrypt(&ctxt->state.aes.key, in, out,
+                                      len / AES_BLOCK_SIZE,
+                                      ctxt->state.aes.iv);
+            break;
+        }
+#endif
         AES_cbc_encrypt(in, out, len,
                         &ctxt->state.aes.key.dec,
                         ctxt->state.aes.iv, 0);
@@ -285,6 +549,15 @@ static int qcrypto_cipher_init_aes(QCryptoCipher *cipher,
         }
     }
 
+#ifdef CONFIG_AESNI_OPT
+    if (qcrypto_aesni_available) {
+        qcrypto_aesni_set_key(&ctxt->state.aes.key);
+        if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
+            qcrypto_aesni_set_key(&ctxt->state.aes.key_tweak);
+        }
+    }
+#endif
+
     ctxt->blocksize = AES_BLOCK_SIZE;
     ctxt->free = qcrypto_cipher_free_aes;
     ctxt->setiv = qcrypto_cipher_setiv_aes;
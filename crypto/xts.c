@@ -24,20 +24,77 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "crypto/xts.h"
 
+/* Number of blocks passed to the cipher function in one call by
+ * xts_tweak_crypt_blocks().  Ciphers that can keep several independent
+ * blocks in flight (e.g. AES-NI) overlap their latency this way.
+ */
+#define XTS_BATCH_BLOCKS 8
+
 static void xts_mult_x(uint8_t *I)
 {
-    int x;
-    uint8_t t, tt;
+    uint64_t lo = ldq_le_p(I);
+    uint64_t hi = ldq_le_p(I + 8);
+    uint64_t carry = hi >> 63;
+
+    hi = (hi << 1) | (lo >> 63);
+    lo = (lo << 1) ^ (carry * 0x87);
+
+    stq_le_p(I, lo);
+    stq_le_p(I + 8, hi);
+}
+
+
+static void xts_xor_blocks(uint8_t *dst, const uint8_t *src,
+                           const uint8_t *tweaks, size_t len)
+{
+    size_t x;
 
-    for (x = t = 0; x < 16; x++) {
-        tt = I[x] >> 7;
-        I[x] = ((I[x] << 1) | t) & 0xFF;
-        t = tt;
+    for (x = 0; x < len; x += 8) {
+        stq_he_p(dst + x, ldq_he_p(src + x) ^ ldq_he_p(tweaks + x));
     }
-    if (tt) {
-        I[0] ^= 0x87;
+}
+
+
+/**
+ * xts_tweak_crypt_blocks:
+ * @ctx: the cipher context
+ * @func: the cipher function
+ * @src: buffer providing @nblocks blocks of input
+ * @dst: buffer to output @nblocks blocks
+ * @T: the tweak for the first block
+ * @nblocks: number of XTS_BLOCK_SIZE blocks to process
+ *
+ * Encrypt or decrypt (depending on @func) whole blocks, advancing @T
+ * past them.  Up to XTS_BATCH_BLOCKS blocks are handed to @func at once.
+ */
+static void xts_tweak_crypt_blocks(const void *ctx,
+                                   xts_cipher_func *func,
+                                   const uint8_t *src,
+                                   uint8_t *dst,
+                                   uint8_t *T,
+                                   unsigned long nblocks)
+{
+    uint8_t tweaks[XTS_BATCH_BLOCKS * XTS_BLOCK_SIZE];
+
+    while (nblocks > 0) {
+        unsigned long i, n = MIN(nblocks, XTS_BATCH_BLOCKS);
+        size_t len = n * XTS_BLOCK_SIZE;
+
+        for (i = 0; i < n; i++) {
+            memcpy(tweaks + i * XTS_BLOCK_SIZE, T, XTS_BLOCK_SIZE);
+            xts_mult_x(T);
+        }
+
+        xts_xor_blocks(dst, src, tweaks, len);
+        func(ctx, len, dst, dst);
+        xts_xor_blocks(dst, dst, tweaks, len);
+
+        src += len;
+        dst += len;
+        nblocks -= n;
     }
 }
 
@@ -104,12 +161,9 @@ void xts_decrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T, iv);
 
-    for (i = 0; i < lim; i++) {
-        xts_tweak_decrypt(datactx, decfunc, src, dst, T);
-
-        src += XTS_BLOCK_SIZE;
-        dst += XTS_BLOCK_SIZE;
-    }
+    xts_tweak_crypt_blocks(datactx, decfunc, src, dst, T, lim);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
@@ -199,12 +253,9 @@ void xts_encrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T, iv);
 
-    for (i = 0; i < lim; i++) {
-        xts_tweak_encrypt(datactx, encfunc, src, dst, T);
-
-        dst += XTS_BLOCK_SIZE;
-        src += XTS_BLOCK_SIZE;
-    }
+    xts_tweak_crypt_blocks(datactx, encfunc, src, dst, T, lim);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
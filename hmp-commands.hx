@@ -1611,6 +1611,39 @@ STEXI
 @item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
 @findex block_set_io_throttle
 Change I/O throttle limits for a block drive to @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+ETEXI
+
+    {
+        .name       = "block_latency_histogram_set",
+        .args_type  = "device:B,boundaries:s?",
+        .params     = "device [boundaries|off]",
+        .help       = "enable or disable the latency histograms of a block drive",
+        .cmd        = hmp_block_latency_histogram_set,
+    },
+
+STEXI
+@item block_latency_histogram_set @var{device} [@var{boundaries}|off]
+@findex block_latency_histogram_set
+Enable the read, write and flush latency histograms of a block drive, which
+are then shown by @code{info blockstats}.  @var{boundaries} is a
+comma-separated list of ascending interval boundaries in nanoseconds, for
+example @code{100000,1000000,10000000}; without it, a default log-linear set
+of intervals from 1 microsecond to 10 seconds is used.  @code{off} disables
+the histograms.
+ETEXI
+
+    {
+        .name       = "block_latency_histogram_reset",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "clear the latency histograms of a block drive",
+        .cmd        = hmp_block_latency_histogram_reset,
+    },
+
+STEXI
+@item block_latency_histogram_reset @var{device}
+@findex block_latency_histogram_reset
+Clear the counts of the latency histograms of a block drive.
 ETEXI
 
     {
@@ -530,9 +530,37 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
     qapi_free_BlockDeviceInfoList(blockdev_list);
 }
 
+/* Print the non-empty bins of a latency histogram on one line */
+static void print_latency_histogram(Monitor *mon, const char *type,
+                                    BlockLatencyHistogramInfo *hist)
+{
+    uint64List *bin = hist->bins;
+    uint64List *boundary = hist->boundaries;
+    uint64_t lower = 0;
+
+    monitor_printf(mon, "    %s_latency_histogram_ns:", type);
+    for (; bin; bin = bin->next) {
+        if (bin->value) {
+            if (boundary) {
+                monitor_printf(mon, " [%" PRIu64 ",%" PRIu64 ")=%" PRIu64,
+                               lower, boundary->value, bin->value);
+            } else {
+                monitor_printf(mon, " [%" PRIu64 ",inf)=%" PRIu64,
+                               lower, bin->value);
+            }
+        }
+        if (boundary) {
+            lower = boundary->value;
+            boundary = boundary->next;
+        }
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
 {
     BlockStatsList *stats_list, *stats;
+    BlockDeviceStats *ds;
 
     stats_list = qmp_query_blockstats(false, false, NULL);
 
@@ -565,6 +593,17 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->rd_merged,
                        stats->value->stats->wr_merged,
                        stats->value->stats->idle_time_ns);
+
+        ds = stats->value->stats;
+        if (ds->has_rd_latency_histogram) {
+            print_latency_histogram(mon, "rd", ds->rd_latency_histogram);
+        }
+        if (ds->has_wr_latency_histogram) {
+            print_latency_histogram(mon, "wr", ds->wr_latency_histogram);
+        }
+        if (ds->has_flush_latency_histogram) {
+            print_latency_histogram(mon, "flush", ds->flush_latency_histogram);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -1453,6 +1492,56 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_block_latency_histogram_set(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    const char *device = qdict_get_str(qdict, "device");
+    const char *str = qdict_get_try_str(qdict, "boundaries");
+    uint64List *boundaries = NULL, **next = &boundaries;
+
+    if (str && !strcmp(str, "off")) {
+        qmp_block_latency_histogram_set(true, device, false, NULL,
+                                        false, NULL, false, NULL,
+                                        false, NULL, false, NULL,
+                                        true, false, &err);
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    while (str && *str) {
+        uint64_t value;
+
+        if (qemu_strtoull(str, &str, 10, &value) < 0 ||
+            (*str != ',' && *str != '\0')) {
+            error_setg(&err, "Invalid latency histogram boundaries");
+            goto out;
+        }
+        *next = g_new0(uint64List, 1);
+        (*next)->value = value;
+        next = &(*next)->next;
+        if (*str == ',') {
+            str++;
+        }
+    }
+
+    qmp_block_latency_histogram_set(true, device, false, NULL,
+                                    boundaries != NULL, boundaries,
+                                    false, NULL, false, NULL, false, NULL,
+                                    false, false, &err);
+out:
+    qapi_free_uint64List(boundaries);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_block_latency_histogram_reset(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    const char *device = qdict_get_str(qdict, "device");
+
+    qmp_block_latency_histogram_reset(true, device, false, NULL, &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_block_stream(Monitor *mon, const QDict *qdict)
 {
     Error *error = NULL;
@@ -2043,8 +2132,17 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        IOThreadInfo *value = info->value;
+
+        monitor_printf(mon, "%s:\n", value->id);
+        monitor_printf(mon, "  thread_id=%" PRId64 "\n", value->thread_id);
+        monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
+        monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
+        monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        monitor_printf(mon, "  poll-ns=%" PRId64 "\n", value->poll_ns);
+        monitor_printf(mon, "  poll-hits=%" PRId64 "\n", value->poll_hits);
+        monitor_printf(mon, "  poll-misses=%" PRId64 "\n",
+                       value->poll_misses);
     }
 
     qapi_free_IOThreadInfoList(info_list);
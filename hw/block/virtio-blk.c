@@ -929,6 +929,10 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     blk_set_guest_block_size(s->blk, s->conf.conf.logical_block_size);
 
     blk_iostatus_enable(s->blk);
+
+    /* Keep enough coroutines around for a good part of the requests
+     * that the queues can hold */
+    qemu_coroutine_increase_pool_batch_size(conf->num_queues * 128 / 2);
 }
 
 static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
@@ -936,6 +940,7 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
 
+    qemu_coroutine_decrease_pool_batch_size(s->conf.num_queues * 128 / 2);
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
@@ -26,6 +26,7 @@
 #define BLOCK_ACCOUNTING_H
 
 #include "qemu/timed-average.h"
+#include "qapi-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 
@@ -42,6 +43,16 @@ struct BlockAcctTimedStats {
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
+typedef struct BlockLatencyHistogram {
+    /* Bin i counts the requests whose latency is in the interval
+     * [boundaries[i - 1], boundaries[i]), where boundaries[-1] stands for 0
+     * and boundaries[nbins - 1] for +inf.  bins is NULL if the histogram is
+     * disabled.  */
+    int nbins;
+    uint64_t *boundaries; /* nbins - 1 values in ascending order */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
@@ -51,6 +62,7 @@ typedef struct BlockAcctStats {
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
     bool account_invalid;
     bool account_failed;
 } BlockAcctStats;
@@ -77,5 +89,12 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
+bool block_latency_histogram_check(uint64List *boundaries);
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries);
+void block_latency_histogram_reset(BlockAcctStats *stats,
+                                   enum BlockAcctType type);
+void block_latency_histogram_remove(BlockAcctStats *stats,
+                                    enum BlockAcctType type);
 
 #endif
@@ -46,6 +46,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct ThreadPool;
 struct LinuxAioState;
@@ -128,12 +129,33 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
 
     int external_disable_cnt;
 
+    /* Number of AioHandlers without .io_poll() */
+    int poll_disable_cnt;
+
+    /* Polling mode parameters */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+
+    /* Polling mode statistics: aio_poll() calls in which polling found an
+     * event (hits) or timed out so that the thread had to block (misses).
+     */
+    uint64_t poll_hits;
+    uint64_t poll_misses;
+
     /* epoll(7) state used when built with CONFIG_EPOLL */
     int epollfd;
     bool epoll_enabled;
@@ -337,6 +359,23 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Attach a polling callback to the handler registered for @fd.  While the
+ * AioContext is in polling mode, aio_poll() busy-waits on io_poll() instead
+ * of sleeping in ppoll(); io_poll() must check for new events without making
+ * system calls, process them and return true if progress was made.
+ *
+ * Polling is only used while every handler of the AioContext has a polling
+ * callback.  The callback is dropped together with the fd handler.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Like aio_set_fd_poll, for a handler registered with
+ * aio_set_event_notifier.  io_poll() is invoked with @notifier as argument.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -348,6 +387,12 @@ struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Setup the LuringState bound to this AioContext */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+
+/* Return the LuringState bound to this AioContext */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -454,4 +499,20 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: polling time growth factor; 0 selects the default
+ * @shrink: polling time shrink factor; 0 resets the polling time to 0
+ * @errp: error object
+ *
+ * Poll mode can be used to avoid the latency of blocking in ppoll() and
+ * being woken up.  The polling time adapts itself between 0 and @max_ns
+ * depending on how long the event loop actually had to wait for events.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 #endif
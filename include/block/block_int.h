@@ -224,6 +224,11 @@ struct BlockDriver {
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
 
+    /* Return a host file descriptor that holds the guest-visible data at
+     * the same offsets, for zero-copy reads that bypass the block layer.
+     * Only drivers that do not transform the data may implement this.  */
+    int (*bdrv_get_raw_fd)(BlockDriverState *bs);
+
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
                                           int64_t pos);
@@ -320,6 +325,16 @@ struct BlockDriver {
     void (*bdrv_del_child)(BlockDriverState *parent, BdrvChild *child,
                            Error **errp);
 
+    /**
+     * Check whether a new persistent dirty bitmap with the given name and
+     * granularity can be stored in the image.  Drivers that store persistent
+     * bitmaps save them when the image is closed or inactivated.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -473,6 +488,8 @@ struct BlockDriverState {
 
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
+    /* Requests that bypass tracked_requests, see bdrv_inc_in_flight() */
+    unsigned int in_flight;
 
     /* Offset after the highest byte written to */
     uint64_t wr_highest_offset;
@@ -736,6 +753,9 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/* Upper limit of the max-workers option of backup jobs */
+#define BACKUP_MAX_WORKERS 64
+
 /*
  * backup_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
@@ -745,6 +765,9 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
+ * @compress: Whether to compress the data written to @target.
+ * @max_workers: The maximum number of concurrent background copy requests,
+ * between 1 and BACKUP_MAX_WORKERS, or 0 for the default.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -757,7 +780,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
 void backup_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
-                  bool compress,
+                  bool compress, int max_workers,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb, void *opaque,
@@ -0,0 +1,85 @@
+/*
+ * Host-wide cache of read-only image data
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_SHARED_CACHE_H
+#define BLOCK_SHARED_CACHE_H
+
+/* Size of the data cached for each (image, offset) key.  This matches the
+ * default qcow2 cluster size.
+ */
+#define SHARED_CACHE_SLOT_SIZE  65536
+
+#define SHARED_CACHE_DEFAULT_SIZE  (1ULL << 30)
+
+typedef struct SharedCache SharedCache;
+
+/**
+ * shared_cache_open:
+ * @path: file backing the cache, usually on tmpfs or hugetlbfs
+ * @size: size of the file if it has to be created
+ * @errp: error object
+ *
+ * Map the cache at @path, creating and formatting it if it does not exist
+ * or is empty.  All processes that open the same file share its contents.
+ * Opening the same path twice in one process returns the same object.
+ */
+SharedCache *shared_cache_open(const char *path, uint64_t size, Error **errp);
+
+/**
+ * shared_cache_close:
+ * @sc: cache returned by shared_cache_open()
+ *
+ * Drop a reference to @sc, unmapping it when the last one goes away.
+ */
+void shared_cache_close(SharedCache *sc);
+
+/**
+ * shared_cache_image_id:
+ * @st: result of fstat() on the image
+ *
+ * Return a key identifying the image contents.  Any change of the file's
+ * size, modification time or change time (at the file system's timestamp
+ * resolution) yields a different key, so stale entries are never returned
+ * for an image that was rewritten.
+ */
+uint64_t shared_cache_image_id(const struct stat *st);
+
+/**
+ * shared_cache_lookup:
+ * @sc: the cache
+ * @image_id: key returned by shared_cache_image_id()
+ * @offset: offset in the image, aligned to SHARED_CACHE_SLOT_SIZE
+ * @buf: buffer of SHARED_CACHE_SLOT_SIZE bytes
+ *
+ * Copy the cached data for @image_id and @offset to @buf and return true,
+ * or return false if it is not in the cache.  Never blocks.
+ */
+bool shared_cache_lookup(SharedCache *sc, uint64_t image_id, uint64_t offset,
+                         void *buf);
+
+/**
+ * shared_cache_insert:
+ * @sc: the cache
+ * @image_id: key returned by shared_cache_image_id()
+ * @offset: offset in the image, aligned to SHARED_CACHE_SLOT_SIZE
+ * @buf: SHARED_CACHE_SLOT_SIZE bytes of image data
+ *
+ * Add data to the cache, evicting an older entry if needed.  The insertion
+ * is silently skipped if another process is writing the chosen slot.
+ */
+void shared_cache_insert(SharedCache *sc, uint64_t image_id, uint64_t offset,
+                         const void *buf);
+
+/**
+ * shared_cache_get_stats:
+ * @sc: the cache
+ * @hits: number of successful lookups by this process
+ * @misses: number of failed lookups by this process
+ */
+void shared_cache_get_stats(SharedCache *sc, uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -74,6 +74,7 @@ typedef enum {
  * @readfunc: callback for reading data from the volume
  * @opaque: data to pass to @readfunc
  * @flags: bitmask of QCryptoBlockOpenFlags values
+ * @n_threads: number of threads that may encrypt or decrypt concurrently
  * @errp: pointer to a NULL-initialized error object
  *
  * Create a new block encryption object for an existing
@@ -93,6 +94,11 @@ typedef enum {
  * metadata such as the payload offset. There will be
  * no cipher or ivgen objects available.
  *
+ * Up to @n_threads calls to qcrypto_block_encrypt() and
+ * qcrypto_block_decrypt() can run in parallel; each of them
+ * uses a separate cipher object.  Further calls wait until
+ * one of the cipher objects becomes free.
+ *
  * If any part of initializing the encryption context
  * fails an error will be returned. This could be due
  * to the volume being in the wrong format, a cipher
@@ -105,6 +111,7 @@ QCryptoBlock *qcrypto_block_open(QCryptoBlockOpenOptions *options,
                                  QCryptoBlockReadFunc readfunc,
                                  void *opaque,
                                  unsigned int flags,
+                                 size_t n_threads,
                                  Error **errp);
 
 /**
@@ -196,7 +203,10 @@ int qcrypto_block_encrypt(QCryptoBlock *block,
  * qcrypto_block_get_cipher:
  * @block: the block encryption object
  *
- * Get the cipher to use for payload encryption
+ * Get the cipher to use for payload encryption.  If the
+ * block was opened for more than one thread, this is the
+ * first of the cipher objects, which must not be used
+ * while I/O is in progress.
  *
  * Returns: the cipher object
  */
@@ -32,6 +32,11 @@
 
 #define XTS_BLOCK_SIZE 16
 
+/*
+ * Encrypts or decrypts @length bytes from @src into @dst in ECB mode.
+ * @length is always a multiple of XTS_BLOCK_SIZE, but may cover more
+ * than one block; @dst and @src may be the same buffer.
+ */
 typedef void xts_cipher_func(const void *ctx,
                              size_t length,
                              uint8_t *dst,
@@ -92,6 +92,24 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
  */
 bool qemu_in_coroutine(void);
 
+/**
+ * Statistics of the calling thread's pool of free coroutines
+ */
+typedef struct CoroutinePoolStats {
+    uint64_t hits;      /* coroutines taken from the pool */
+    uint64_t misses;    /* coroutines that had to be allocated */
+    unsigned int size;  /* coroutines currently in the pool */
+} CoroutinePoolStats;
+
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats);
+
+/**
+ * Raise or lower the number of free coroutines that each thread keeps
+ * around, e.g. by the number of requests that a device can have in flight
+ */
+void qemu_coroutine_increase_pool_batch_size(unsigned int additional_pool_size);
+void qemu_coroutine_decrease_pool_batch_size(unsigned int removing_pool_size);
+
 
 
 /**
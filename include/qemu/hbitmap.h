@@ -145,6 +145,101 @@ void hbitmap_reset_all(HBitmap *hb);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_serialization_granularity:
+ * @hb: HBitmap to operate on.
+ *
+ * Granularity of serialization chunks, used by other serialization functions.
+ * For every chunk:
+ * 1. Chunk start should be aligned to this granularity.
+ * 2. Chunk size should be aligned too, except for last chunk (for which
+ *      start + count == hb->size)
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: Starting bit
+ * @count: Number of bits
+ *
+ * Return number of bytes hbitmap_(de)serialize_part needs
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to store serialized bitmap.
+ * @start: First bit to store.
+ * @count: Number of bits to store.
+ *
+ * Stores HBitmap data corresponding to given region.  Bits are stored
+ * in little-endian order, one bit per granularity group, so that bit @i
+ * of the output is at bit (@i % 8) of byte (@i / 8).
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to restore bitmap data from.
+ * @start: First bit to restore.
+ * @count: Number of bits to restore.
+ * @finish: Whether to call hbitmap_deserialize_finish automatically.
+ *
+ * Restores HBitmap data corresponding to given region.  The format is the
+ * same as produced by hbitmap_serialize_part.
+ *
+ * If @finish is false, caller must call hbitmap_deserialize_finish before
+ * using the bitmap.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish);
+
+/**
+ * hbitmap_deserialize_zeroes
+ * @hb: HBitmap to operate on.
+ * @start: First bit to restore.
+ * @count: Number of bits to restore.
+ * @finish: Whether to call hbitmap_deserialize_finish automatically.
+ *
+ * Fills the bitmap with zeroes.
+ *
+ * If @finish is false, caller must call hbitmap_deserialize_finish before
+ * using the bitmap.
+ */
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish);
+
+/**
+ * hbitmap_deserialize_ones
+ * @hb: HBitmap to operate on.
+ * @start: First bit to restore.
+ * @count: Number of bits to restore.
+ * @finish: Whether to call hbitmap_deserialize_finish automatically.
+ *
+ * Fills the bitmap with ones.
+ *
+ * If @finish is false, caller must call hbitmap_deserialize_finish before
+ * using the bitmap.
+ */
+void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
+                              bool finish);
+
+/**
+ * hbitmap_deserialize_finish
+ * @hb: HBitmap to operate on.
+ *
+ * Repair HBitmap after calling hbitmap_deserialize_part or
+ * hbitmap_deserialize_zeroes/ones: rebuild the upper levels and the count
+ * of set bits from the last level.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -153,6 +248,15 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item);
  */
 void hbitmap_free(HBitmap *hb);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Switch the bulk word operations to the next less preferred vectorized
+ * implementation, for use by unit tests and benchmarks.  Returns false
+ * once the portable C loops are in use.
+ */
+bool test_hbitmap_next_accel(void);
+
 /**
  * hbitmap_iter_init:
  * @hbi: HBitmapIter to initialize.
@@ -198,6 +198,36 @@ void *qemu_anon_ram_alloc(size_t size, uint64_t *align);
 void qemu_vfree(void *ptr);
 void qemu_anon_ram_free(void *ptr, size_t size);
 
+/**
+ * qemu_alloc_stack:
+ * @sz: pointer to a size_t holding the requested usable stack size
+ *
+ * Allocate memory that can be used as a stack, for instance for
+ * coroutines. If the memory cannot be allocated, this function
+ * will abort (like g_malloc()).
+ *
+ * The memory is mapped on demand, so only the pages that the stack
+ * actually touches are committed. On POSIX hosts, the stack is
+ * preceded by a guard page that is neither readable nor writable,
+ * so that a stack overflow faults instead of corrupting memory.
+ *
+ * The size is rounded up to a multiple of the page size and the
+ * guard page is added to it; the new value is stored in @sz and
+ * must be passed to qemu_free_stack().
+ *
+ * Returns: pointer to (the lowest address of) the stack memory.
+ */
+void *qemu_alloc_stack(size_t *sz);
+
+/**
+ * qemu_free_stack:
+ * @stack: stack to free
+ * @sz: size of stack in bytes, as returned in @sz by qemu_alloc_stack()
+ *
+ * Free a stack allocated via qemu_alloc_stack().
+ */
+void qemu_free_stack(void *stack, size_t sz);
+
 #define QEMU_MADV_INVALID -1
 
 #if defined(CONFIG_MADVISE)
@@ -383,7 +413,19 @@ unsigned long qemu_getauxval(unsigned long type);
 
 void qemu_set_tty_echo(int fd, bool echo);
 
-void os_mem_prealloc(int fd, char *area, size_t sz, Error **errp);
+/**
+ * os_mem_prealloc:
+ * @fd: file descriptor backing @area, or -1
+ * @area: start of the memory to preallocate
+ * @sz: size of @area
+ * @max_threads: maximum number of threads touching the memory in parallel
+ * @errp: error object
+ *
+ * Fault in every page of @area, failing if the host runs out of memory
+ * (e.g. huge pages) instead of crashing the guest later on.
+ */
+void os_mem_prealloc(int fd, char *area, size_t sz, int max_threads,
+                     Error **errp);
 
 int qemu_read_password(char *buf, int buf_size);
 
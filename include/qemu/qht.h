@@ -15,6 +15,7 @@ struct qht {
     struct qht_map *map;
     QemuMutex lock; /* serializes setters of ht->map */
     unsigned int mode;
+    size_t n_buckets_min; /* auto-resize does not shrink below this */
 };
 
 /**
@@ -42,7 +43,7 @@ struct qht_stats {
 typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
 typedef void (*qht_iter_func_t)(struct qht *ht, void *p, uint32_t h, void *up);
 
-#define QHT_MODE_AUTO_RESIZE 0x1 /* auto-resize when heavily loaded */
+#define QHT_MODE_AUTO_RESIZE 0x1 /* auto-resize when heavily/lightly loaded */
 
 /**
  * qht_init - Initialize a QHT
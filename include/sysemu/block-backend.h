@@ -76,6 +76,11 @@ typedef struct BlockBackendPublic {
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
     QLIST_ENTRY(BlockBackendPublic) round_robin;
+    /* Share of the group's I/O and virtual time of the fair scheduler */
+    unsigned int   throttle_weight;
+    uint64_t       throttle_vtime[2];
+    /* Total time that requests spent throttled, in nanoseconds */
+    uint64_t       throttled_ns[2];
 } BlockBackendPublic;
 
 BlockBackend *blk_new(void);
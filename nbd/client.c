@@ -129,6 +129,11 @@ static int nbd_handle_reply_err(QIOChannel *ioc, uint32_t opt, uint32_t type,
                    opt);
         break;
 
+    case NBD_REP_ERR_UNKNOWN:
+        error_setg(errp, "Requested export not available for option %" PRIx32,
+                   opt);
+        break;
+
     default:
         error_setg(errp, "Unknown error code when asking for option %" PRIx32,
                    opt);
@@ -309,6 +314,184 @@ static int nbd_receive_query_exports(QIOChannel *ioc,
     return 0;
 }
 
+/* Send option @opt with a payload of @len bytes from @data.  Returns 0 on
+ * success, -1 with errp set on failure.
+ */
+static int nbd_send_option_request(QIOChannel *ioc, uint32_t opt,
+                                   uint32_t len, const char *data,
+                                   Error **errp)
+{
+    uint8_t buf[8 + 4 + 4];
+
+    TRACE("Sending option request %" PRIu32 ", len %" PRIu32, opt, len);
+
+    stq_be_p(buf, NBD_OPTS_MAGIC);
+    stl_be_p(buf + 8, opt);
+    stl_be_p(buf + 12, len);
+
+    if (write_sync(ioc, buf, sizeof(buf)) != sizeof(buf)) {
+        error_setg(errp, "Failed to send option request header");
+        return -1;
+    }
+    if (len && write_sync(ioc, (char *)data, len) != len) {
+        error_setg(errp, "Failed to send option request data");
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the header of a reply to option @opt.  Returns 1 and fills in
+ * @type and @len if the reply is not an error; the caller must then
+ * consume @len bytes of payload.  Error replies are handled (and their
+ * payload consumed) by nbd_handle_reply_err, and the return value is
+ * the same as for that function.
+ */
+static int nbd_receive_option_reply(QIOChannel *ioc, uint32_t opt,
+                                    uint32_t *type, uint32_t *len,
+                                    Error **errp)
+{
+    uint8_t buf[8 + 4 + 4];
+    int error;
+
+    if (read_sync(ioc, buf, sizeof(buf)) != sizeof(buf)) {
+        error_setg(errp, "failed to read option reply");
+        return -1;
+    }
+    if (ldq_be_p(buf) != NBD_REP_MAGIC) {
+        error_setg(errp, "Unexpected option reply magic");
+        return -1;
+    }
+    if (ldl_be_p(buf + 8) != opt) {
+        error_setg(errp, "Unexpected option type %" PRIx32 " expected %x",
+                   ldl_be_p(buf + 8), opt);
+        return -1;
+    }
+    *type = ldl_be_p(buf + 12);
+    error = nbd_handle_reply_err(ioc, opt, *type, errp);
+    if (error <= 0) {
+        return error;
+    }
+
+    if (read_sync(ioc, len, sizeof(*len)) != sizeof(*len)) {
+        error_setg(errp, "failed to read option length");
+        return -1;
+    }
+    *len = be32_to_cpu(*len);
+    return 1;
+}
+
+/* Ask the server to use structured replies.  Returns 1 if the server
+ * agreed, 0 if it does not support them, -1 on error.
+ */
+static int nbd_receive_structured_reply(QIOChannel *ioc, Error **errp)
+{
+    uint32_t type, len;
+    int ret;
+
+    TRACE("Requesting structured replies");
+    if (nbd_send_option_request(ioc, NBD_OPT_STRUCTURED_REPLY, 0, NULL,
+                                errp) < 0) {
+        return -1;
+    }
+    ret = nbd_receive_option_reply(ioc, NBD_OPT_STRUCTURED_REPLY,
+                                   &type, &len, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+    if (type != NBD_REP_ACK || len != 0) {
+        error_setg(errp, "Unexpected reply type %" PRIx32 " for structured "
+                   "reply option", type);
+        return -1;
+    }
+    return 1;
+}
+
+/* Select the "base:allocation" meta context for export @name.  On success
+ * ext->base_allocation tells whether the server knows the context; returns
+ * 0 if the server does not support meta contexts, -1 on error.
+ */
+static int nbd_receive_base_allocation(QIOChannel *ioc, const char *name,
+                                       NBDExtensions *ext, Error **errp)
+{
+    const char *query = NBD_META_BASE_ALLOCATION;
+    uint32_t namelen = strlen(name);
+    uint32_t querylen = strlen(query);
+    uint32_t type, len;
+    char *buf, *p;
+    int ret;
+
+    /* Option payload
+       [ 0 ..  3]    export name length
+       [ 4 ..  xx]   export name
+       [xx .. +3]    number of queries (1)
+       [xx .. +3]    query length
+       [xx .. yy]    query
+     */
+    len = 4 + namelen + 4 + 4 + querylen;
+    p = buf = g_malloc(len);
+    stl_be_p(p, namelen);
+    memcpy(p + 4, name, namelen);
+    p += 4 + namelen;
+    stl_be_p(p, 1);
+    stl_be_p(p + 4, querylen);
+    memcpy(p + 8, query, querylen);
+
+    TRACE("Requesting meta context '%s'", query);
+    ret = nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, len, buf,
+                                  errp);
+    g_free(buf);
+    if (ret < 0) {
+        return -1;
+    }
+
+    while (1) {
+        char context[NBD_MAX_NAME_SIZE + 1];
+        uint32_t id;
+
+        ret = nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT,
+                                       &type, &len, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+        if (type == NBD_REP_ACK) {
+            if (len != 0) {
+                error_setg(errp, "length too long for option end");
+                return -1;
+            }
+            break;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            error_setg(errp, "Unexpected reply type %" PRIx32 " expected %x",
+                       type, NBD_REP_META_CONTEXT);
+            return -1;
+        }
+        if (len < sizeof(id) || len - sizeof(id) > NBD_MAX_NAME_SIZE) {
+            error_setg(errp, "incorrect meta context length");
+            return -1;
+        }
+        if (read_sync(ioc, &id, sizeof(id)) != sizeof(id)) {
+            error_setg(errp, "failed to read meta context id");
+            return -1;
+        }
+        len -= sizeof(id);
+        if (read_sync(ioc, context, len) != len) {
+            error_setg(errp, "failed to read meta context name");
+            return -1;
+        }
+        context[len] = '\0';
+
+        if (g_str_equal(context, query)) {
+            ext->base_allocation = true;
+            ext->base_allocation_id = be32_to_cpu(id);
+            TRACE("Meta context '%s' has id %" PRIu32, context,
+                  ext->base_allocation_id);
+        } else {
+            TRACE("Ignoring meta context '%s'", context);
+        }
+    }
+    return 1;
+}
+
 static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
                                         QCryptoTLSCreds *tlscreds,
                                         const char *hostname, Error **errp)
@@ -410,7 +593,7 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
 
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
-                          QIOChannel **outioc,
+                          QIOChannel **outioc, NBDExtensions *ext,
                           off_t *size, Error **errp)
 {
     char buf[256];
@@ -425,6 +608,9 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
     if (outioc) {
         *outioc = NULL;
     }
+    if (ext) {
+        memset(ext, 0, sizeof(*ext));
+    }
     if (tlscreds && !outioc) {
         error_setg(errp, "Output I/O channel required for TLS");
         goto fail;
@@ -515,6 +701,22 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+
+            /* Block status information is only sent in structured
+             * replies, so only ask for it if they are available.
+             */
+            if (ext) {
+                int ret = nbd_receive_structured_reply(ioc, errp);
+                if (ret < 0) {
+                    goto fail;
+                }
+                ext->structured_reply = ret > 0;
+            }
+            if (ext && ext->structured_reply) {
+                if (nbd_receive_base_allocation(ioc, name, ext, errp) < 0) {
+                    goto fail;
+                }
+            }
         }
         /* write the export name */
         magic = cpu_to_be64(magic);
@@ -736,29 +938,70 @@ ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
+    magic = ldl_be_p(buf);
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* The rest of the chunk header follows the first bytes closely,
+         * so wait for it rather than leave a partial header behind.
+         */
+        do {
+            ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                            NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+            if (ret == -EAGAIN) {
+                qio_channel_wait(ioc, G_IO_IN);
+            }
+        } while (ret == -EAGAIN);
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags
+           [ 6 ..  7]    type
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload
+         */
+        reply->structured = true;
+        reply->error  = 0;
+        reply->flags  = lduw_be_p(buf + 4);
+        reply->type   = lduw_be_p(buf + 6);
+        reply->handle = ldq_be_p(buf + 8);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got structured reply chunk: { .flags = 0x%" PRIx16
+              ", .type = %" PRIu16 ", handle = %" PRIu64
+              ", .length = %" PRIu32 " }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = ldl_be_p(buf);
+    reply->structured = false;
     reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
+    reply->flags  = 0;
+    reply->type   = 0;
+    reply->length = 0;
 
     reply->error = nbd_errno_to_system_errno(reply->error);
 
@@ -773,3 +1016,72 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
     return 0;
 }
 
+ssize_t nbd_drop(QIOChannel *ioc, size_t size)
+{
+    ssize_t ret, dropped = size;
+    uint8_t *buffer;
+
+    if (!size) {
+        return 0;
+    }
+
+    buffer = g_malloc(MIN(65536, size));
+    while (size > 0) {
+        ret = read_sync(ioc, buffer, MIN(65536, size));
+        if (ret <= 0) {
+            g_free(buffer);
+            return ret < 0 ? ret : -EIO;
+        }
+
+        assert(ret <= size);
+        size -= ret;
+    }
+
+    g_free(buffer);
+    return dropped;
+}
+
+int nbd_receive_error_chunk(QIOChannel *ioc, struct nbd_reply *reply)
+{
+    uint8_t buf[4 + 2];
+    uint32_t error;
+    uint16_t msglen;
+    ssize_t ret;
+
+    /* Error chunk payload
+       [ 0 ..  3]    error
+       [ 4 ..  5]    message length
+       [ 6 ..  xx]   message
+       NBD_REPLY_TYPE_ERROR_OFFSET is followed by a 64-bit offset.
+     */
+    assert(reply->structured && NBD_REPLY_TYPE_IS_ERR(reply->type));
+    if (reply->length < sizeof(buf)) {
+        LOG("error chunk too short");
+        return -EINVAL;
+    }
+    if (read_sync(ioc, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("read failed");
+        return -EIO;
+    }
+    error = ldl_be_p(buf);
+    msglen = lduw_be_p(buf + 4);
+    if (msglen > reply->length - sizeof(buf)) {
+        LOG("error message too long");
+        return -EINVAL;
+    }
+    if (error == 0) {
+        LOG("error chunk without an error code");
+        return -EINVAL;
+    }
+
+    ret = nbd_drop(ioc, reply->length - sizeof(buf));
+    if (ret != reply->length - sizeof(buf)) {
+        return ret < 0 ? ret : -EIO;
+    }
+
+    reply->error = nbd_errno_to_system_errno(error);
+    TRACE("Got error chunk: { .error = %" PRId32 ", .type = %" PRIu16 " }",
+          reply->error, reply->type);
+    return 0;
+}
+
@@ -18,8 +18,13 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "block/thread-pool.h"
 #include "nbd-internal.h"
 
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -92,6 +97,10 @@ struct NBDClient {
 
     bool can_read;
 
+    bool structured_reply;
+    bool base_allocation;   /* "base:allocation" meta context selected */
+    bool no_sendfile;       /* sendfile() is not supported, don't retry */
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -193,12 +202,20 @@ static ssize_t nbd_negotiate_drop_sync(QIOChannel *ioc, size_t size)
 
 */
 
-static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+/* Meta context id of "base:allocation", the only context we support */
+#define NBD_META_ID_BASE_ALLOCATION 1
+
+/* Maximum number of extents in a reply to NBD_CMD_BLOCK_STATUS */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 64
+
+/* Send a reply header; @len bytes of payload must follow it.  */
+static int nbd_negotiate_send_rep_len(QIOChannel *ioc, uint32_t type,
+                                      uint32_t opt, uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
-    TRACE("Reply opt=%" PRIx32 " type=%" PRIx32, type, opt);
+    TRACE("Reply opt=%" PRIx32 " type=%" PRIx32 " len=%" PRIu32,
+          type, opt, len);
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (nbd_negotiate_write(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -215,7 +232,7 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (nbd_negotiate_write(ioc, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -223,6 +240,11 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+{
+    return nbd_negotiate_send_rep_len(ioc, type, opt, 0);
+}
+
 static int nbd_negotiate_send_rep_list(QIOChannel *ioc, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -319,6 +341,158 @@ fail:
 }
 
 
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                 uint32_t length)
+{
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID,
+                                      NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    TRACE("Using structured replies");
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+static int nbd_negotiate_send_meta_context(QIOChannel *ioc, uint32_t opt,
+                                           uint32_t id, const char *name)
+{
+    uint32_t len = strlen(name);
+
+    if (nbd_negotiate_send_rep_len(ioc, NBD_REP_META_CONTEXT, opt,
+                                   sizeof(id) + len) < 0) {
+        return -EINVAL;
+    }
+    id = cpu_to_be32(id);
+    if (nbd_negotiate_write(ioc, &id, sizeof(id)) != sizeof(id)) {
+        LOG("write failed (context id)");
+        return -EINVAL;
+    }
+    if (nbd_negotiate_write(ioc, (char *)name, len) != len) {
+        LOG("write failed (context name)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.  Only the
+ * "base:allocation" context is known; it describes the allocation status
+ * of the export as reported by the block layer.  */
+static int nbd_negotiate_handle_meta_context(NBDClient *client,
+                                             uint32_t opt, uint32_t length)
+{
+    char name[NBD_MAX_NAME_SIZE + 1];
+    uint32_t namelen, nb_queries, querylen, i;
+    bool base_allocation = false;
+    int ret;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx ..  +3]   number of queries
+        then, for each query:
+        [ 0 ..   3]   query length
+        [ 4 ..  xx]   query
+     */
+    if (opt == NBD_OPT_SET_META_CONTEXT && !client->structured_reply) {
+        TRACE("Meta contexts require structured replies");
+        goto invalid;
+    }
+
+    if (length < sizeof(namelen) ||
+        nbd_negotiate_read(client->ioc, &namelen, sizeof(namelen)) !=
+        sizeof(namelen)) {
+        goto invalid;
+    }
+    length -= sizeof(namelen);
+    namelen = be32_to_cpu(namelen);
+    if (namelen >= sizeof(name) || namelen > length) {
+        goto invalid;
+    }
+    if (nbd_negotiate_read(client->ioc, name, namelen) != namelen) {
+        return -EIO;
+    }
+    name[namelen] = '\0';
+    length -= namelen;
+
+    if (length < sizeof(nb_queries) ||
+        nbd_negotiate_read(client->ioc, &nb_queries, sizeof(nb_queries)) !=
+        sizeof(nb_queries)) {
+        goto invalid;
+    }
+    length -= sizeof(nb_queries);
+    nb_queries = be32_to_cpu(nb_queries);
+
+    for (i = 0; i < nb_queries; i++) {
+        char query[NBD_MAX_NAME_SIZE + 1];
+
+        if (length < sizeof(querylen) ||
+            nbd_negotiate_read(client->ioc, &querylen, sizeof(querylen)) !=
+            sizeof(querylen)) {
+            goto invalid;
+        }
+        length -= sizeof(querylen);
+        querylen = be32_to_cpu(querylen);
+        if (querylen > length) {
+            goto invalid;
+        }
+        if (querylen >= sizeof(query)) {
+            /* Too long to be anything we know about */
+            if (nbd_negotiate_drop_sync(client->ioc, querylen) != querylen) {
+                return -EIO;
+            }
+            length -= querylen;
+            continue;
+        }
+        if (nbd_negotiate_read(client->ioc, query, querylen) != querylen) {
+            return -EIO;
+        }
+        query[querylen] = '\0';
+        length -= querylen;
+
+        TRACE("Client asked for meta context '%s'", query);
+        if (!strcmp(query, "base:") ||
+            !strcmp(query, NBD_META_BASE_ALLOCATION)) {
+            base_allocation = true;
+        }
+    }
+    if (length) {
+        goto invalid;
+    }
+
+    if (!nbd_export_find(name)) {
+        TRACE("Export '%s' not found", name);
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_UNKNOWN, opt);
+    }
+
+    /* Listing with no queries returns all contexts */
+    if (opt == NBD_OPT_LIST_META_CONTEXT && !nb_queries) {
+        base_allocation = true;
+    }
+    if (base_allocation) {
+        ret = nbd_negotiate_send_meta_context(client->ioc, opt,
+                                              NBD_META_ID_BASE_ALLOCATION,
+                                              NBD_META_BASE_ALLOCATION);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        client->base_allocation = base_allocation;
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt);
+
+invalid:
+    if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+        return -EIO;
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID, opt);
+}
+
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
                                                  uint32_t length)
 {
@@ -487,6 +661,22 @@ static int nbd_negotiate_options(NBDClient *client)
             case NBD_OPT_EXPORT_NAME:
                 return nbd_negotiate_handle_export_name(client, length);
 
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_meta_context(client, clientflags,
+                                                        length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             case NBD_OPT_STARTTLS:
                 if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
                     return -EIO;
@@ -985,6 +1175,435 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+static void nbd_set_chunk_header(uint8_t *buf, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 uint32_t length)
+{
+    TRACE("Sending structured reply chunk to client: { .flags = 0x%" PRIx16
+          ", .type = %" PRIu16 ", handle = %" PRIu64 ", .length = %" PRIu32
+          " }", flags, type, handle, length);
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, length);
+}
+
+/* Send a structured reply chunk whose payload is made of @niov buffers */
+static int coroutine_fn nbd_co_send_chunk(NBDClient *client, uint64_t handle,
+                                          uint16_t flags, uint16_t type,
+                                          struct iovec *iov, unsigned niov)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec chunk_iov[3];
+    size_t length = iov_size(iov, niov);
+    ssize_t ret;
+
+    assert(niov < ARRAY_SIZE(chunk_iov));
+    nbd_set_chunk_header(buf, handle, flags, type, length);
+
+    chunk_iov[0].iov_base = buf;
+    chunk_iov[0].iov_len = sizeof(buf);
+    if (niov) {
+        memcpy(&chunk_iov[1], iov, niov * sizeof(*iov));
+    }
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    ret = nbd_wr_syncv(client->ioc, chunk_iov, niov + 1,
+                       sizeof(buf) + length, false);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    if (ret != sizeof(buf) + length) {
+        LOG("writing to socket failed");
+        return -EIO;
+    }
+    return 0;
+}
+
+static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
+                                                     uint64_t handle,
+                                                     int error)
+{
+    uint8_t buf[4 + 2];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    /* Payload
+       [ 0 ..  3]    error
+       [ 4 ..  5]    message length (0, we send no message)
+     */
+    stl_be_p(buf, system_errno_to_nbd_errno(error));
+    stw_be_p(buf + 4, 0);
+
+    return nbd_co_send_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, &iov, 1);
+}
+
+#ifdef CONFIG_SENDFILE
+typedef struct NBDSendfileData {
+    int out_fd;
+    int in_fd;
+    off_t offset;
+    size_t len;
+} NBDSendfileData;
+
+static int nbd_sendfile_worker(void *opaque)
+{
+    NBDSendfileData *data = opaque;
+    ssize_t ret;
+
+    do {
+        ret = sendfile(data->out_fd, data->in_fd, &data->offset, data->len);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+/* Copy @len bytes at @offset of @fd, the raw file of @bs, to the socket
+ * within the kernel.  This runs in the thread pool, because reading the
+ * file may block.  Returns the number of bytes sent, which is short if
+ * sendfile() failed.  Called with send_lock taken.  */
+static size_t coroutine_fn nbd_co_sendfile(NBDClient *client,
+                                           BlockDriverState *bs, int fd,
+                                           uint64_t offset, size_t len)
+{
+    ThreadPool *pool;
+    NBDSendfileData data = {
+        .out_fd = client->sioc->fd,
+        .in_fd = fd,
+        .offset = offset,
+        .len = len,
+    };
+    int ret;
+
+    while (data.len > 0) {
+        /* nbd_restart_write() must not enter us while the worker runs */
+        client->send_coroutine = NULL;
+        nbd_set_handlers(client);
+        /* The worker reads @bs behind the block layer's back, so let
+         * bdrv_drain() wait for it.  This does not cover the wait for the
+         * socket below, whose handler is disabled while draining.  */
+        bdrv_inc_in_flight(bs);
+        pool = aio_get_thread_pool(client->exp->ctx);
+        ret = thread_pool_submit_co(pool, nbd_sendfile_worker, &data);
+        bdrv_dec_in_flight(bs);
+        client->send_coroutine = qemu_coroutine_self();
+        nbd_set_handlers(client);
+
+        if (ret == -EAGAIN) {
+            /* Socket buffer full, wait until it is writable again */
+            qemu_coroutine_yield();
+            continue;
+        }
+        if (ret <= 0) {
+            if (ret == -EINVAL || ret == -ENOSYS) {
+                client->no_sendfile = true;
+            }
+            break;
+        }
+
+        /* sendfile() has already advanced data.offset */
+        data.len -= ret;
+    }
+
+    return len - data.len;
+}
+#endif
+
+/* Send the @niov buffers of a reply header, followed by @len bytes of the
+ * export at @offset that are copied from the image file to the socket with
+ * sendfile(), saving the copies through a bounce buffer.
+ *
+ * This is only possible for plain sockets and exports whose data is
+ * stored as is in a host file; otherwise -ENOTSUP is returned and nothing
+ * is sent.  Once the header is out, errors can only be reported by dropping
+ * the connection, so any other failure returns -EIO.  @buf is the bounce
+ * buffer for whatever sendfile() could not send.  */
+static int coroutine_fn nbd_co_send_sendfile(NBDClient *client,
+                                             struct iovec *iov,
+                                             unsigned niov, uint8_t *buf,
+                                             uint64_t offset, uint32_t len)
+{
+#ifdef CONFIG_SENDFILE
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    BlockAcctCookie acct;
+    size_t hdrlen = iov_size(iov, niov);
+    size_t done;
+    ssize_t ret;
+    int fd;
+
+    /* Throttling and TLS need the data to go through QEMU */
+    if (client->no_sendfile || len == 0 ||
+        client->ioc != QIO_CHANNEL(client->sioc) ||
+        blk_get_public(exp->blk)->throttle_state) {
+        return -ENOTSUP;
+    }
+    fd = bdrv_get_raw_fd(bs);
+    if (fd < 0) {
+        return -ENOTSUP;
+    }
+    /* The block layer may reopen the image while the worker uses it */
+    fd = qemu_dup(fd);
+    if (fd < 0) {
+        return -ENOTSUP;
+    }
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    qio_channel_set_cork(client->ioc, true);
+    ret = nbd_wr_syncv(client->ioc, iov, niov, hdrlen, false);
+    if (ret != hdrlen) {
+        ret = -EIO;
+        goto out;
+    }
+
+    block_acct_start(blk_get_stats(exp->blk), &acct, len, BLOCK_ACCT_READ);
+    done = nbd_co_sendfile(client, bs, fd, exp->dev_offset + offset, len);
+    if (done < len) {
+        TRACE("sendfile() sent %zu of %" PRIu32 " bytes, reading the rest",
+              done, len);
+        client->send_coroutine = NULL;
+        nbd_set_handlers(client);
+        ret = blk_pread(exp->blk, exp->dev_offset + offset + done,
+                        buf + done, len - done);
+        client->send_coroutine = qemu_coroutine_self();
+        nbd_set_handlers(client);
+        if (ret < 0) {
+            block_acct_failed(blk_get_stats(exp->blk), &acct);
+            ret = -EIO;
+            goto out;
+        }
+    }
+    block_acct_done(blk_get_stats(exp->blk), &acct);
+
+    if (done < len &&
+        write_sync(client->ioc, buf + done, len - done) != len - done) {
+        ret = -EIO;
+        goto out;
+    }
+    ret = 0;
+
+out:
+    qio_channel_set_cork(client->ioc, false);
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    close(fd);
+    return ret;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+/* Return the allocation status of the export in [offset, offset + size)
+ * as BDRV_BLOCK_* flags, and in *pnum the number of bytes starting at
+ * @offset that share it.  */
+static int64_t coroutine_fn nbd_co_block_status(NBDExport *exp,
+                                                uint64_t offset,
+                                                uint32_t size,
+                                                uint32_t *pnum)
+{
+    uint64_t pos = exp->dev_offset + offset;
+    int64_t sector_num = pos >> BDRV_SECTOR_BITS;
+    int nb_sectors = DIV_ROUND_UP(pos + size, BDRV_SECTOR_SIZE) - sector_num;
+    BlockDriverState *file;
+    int64_t ret;
+    int n;
+
+    ret = bdrv_get_block_status_above(blk_bs(exp->blk), NULL, sector_num,
+                                      nb_sectors, &n, &file);
+    if (ret < 0) {
+        return ret;
+    }
+    if (n == 0) {
+        return -EIO;
+    }
+    *pnum = MIN(((sector_num + n) << BDRV_SECTOR_BITS) - pos, size);
+    return ret;
+}
+
+/* Reply to NBD_CMD_READ with structured replies.  Ranges that read as
+ * zeroes are sent as hole chunks, so that they need not be read nor
+ * transferred.  Returns a negative value if the connection must be
+ * dropped.  */
+static int coroutine_fn nbd_co_send_sparse_read(NBDRequest *req,
+                                                uint64_t handle,
+                                                uint64_t offset,
+                                                uint32_t size)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    uint32_t progress = 0;
+    int ret;
+
+    if (size == 0) {
+        return nbd_co_send_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0);
+    }
+
+    while (progress < size) {
+        uint8_t buf[8 + 4];
+        struct iovec iov[2];
+        uint16_t flags;
+        uint32_t pnum;
+        int64_t status;
+
+        status = nbd_co_block_status(exp, offset + progress, size - progress,
+                                     &pnum);
+        if (status < 0) {
+            /* Not fatal, just read the rest of the request */
+            status = BDRV_BLOCK_DATA;
+            pnum = size - progress;
+        }
+        flags = progress + pnum == size ? NBD_REPLY_FLAG_DONE : 0;
+
+        /* Payload
+           [ 0 ..  7]    offset
+           [ 8 .. xx]    data (OFFSET_DATA), or
+           [ 8 .. 11]    length of the hole (OFFSET_HOLE)
+         */
+        stq_be_p(buf, offset + progress);
+        iov[0].iov_base = buf;
+        if (status & BDRV_BLOCK_ZERO) {
+            stl_be_p(buf + 8, pnum);
+            iov[0].iov_len = 12;
+            ret = nbd_co_send_chunk(client, handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE, iov, 1);
+        } else {
+            uint8_t chunk[NBD_STRUCTURED_REPLY_SIZE];
+            struct iovec sendfile_iov[2] = {
+                { .iov_base = chunk, .iov_len = sizeof(chunk) },
+                { .iov_base = buf, .iov_len = 8 },
+            };
+
+            nbd_set_chunk_header(chunk, handle, flags,
+                                 NBD_REPLY_TYPE_OFFSET_DATA, 8 + pnum);
+            ret = nbd_co_send_sendfile(client, sendfile_iov, 2,
+                                       req->data + progress,
+                                       offset + progress, pnum);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->blk, exp->dev_offset + offset + progress,
+                                req->data + progress, pnum);
+                if (ret < 0) {
+                    LOG("reading from file failed");
+                    return nbd_co_send_structured_error(client, handle, -ret);
+                }
+                iov[0].iov_len = 8;
+                iov[1].iov_base = req->data + progress;
+                iov[1].iov_len = pnum;
+                ret = nbd_co_send_chunk(client, handle, flags,
+                                        NBD_REPLY_TYPE_OFFSET_DATA, iov, 2);
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        progress += pnum;
+    }
+
+    TRACE("Read %" PRIu32" byte(s)", size);
+    return 0;
+}
+
+/* Reply to NBD_CMD_BLOCK_STATUS for the "base:allocation" context.
+ * Adjacent extents with the same flags are merged.  Returns a negative
+ * value if the connection must be dropped.  */
+static int coroutine_fn nbd_co_send_block_status(NBDClient *client,
+                                                 uint64_t handle,
+                                                 uint64_t offset,
+                                                 uint32_t length,
+                                                 bool req_one)
+{
+    uint8_t buf[4 + NBD_MAX_BLOCK_STATUS_EXTENTS * 8];
+    unsigned max_extents = req_one ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    unsigned nb_extents = 0;
+    uint32_t progress = 0;
+    uint32_t last_flags = 0;
+    struct iovec iov;
+
+    /* Payload
+       [ 0 ..  3]    meta context id
+       then, for each extent:
+       [ 0 ..  3]    length
+       [ 4 ..  7]    NBD_STATE_* flags
+     */
+    stl_be_p(buf, NBD_META_ID_BASE_ALLOCATION);
+    while (progress < length) {
+        uint8_t *extent;
+        uint32_t pnum, flags;
+        int64_t status;
+
+        status = nbd_co_block_status(client->exp, offset + progress,
+                                     length - progress, &pnum);
+        if (status < 0) {
+            LOG("block status failed");
+            return nbd_co_send_structured_error(client, handle, -status);
+        }
+        flags = (status & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+
+        if (nb_extents && flags == last_flags) {
+            extent = buf + 4 + (nb_extents - 1) * 8;
+            stl_be_p(extent, ldl_be_p(extent) + pnum);
+        } else {
+            if (nb_extents == max_extents) {
+                break;
+            }
+            extent = buf + 4 + nb_extents * 8;
+            stl_be_p(extent, pnum);
+            stl_be_p(extent + 4, flags);
+            nb_extents++;
+            last_flags = flags;
+        }
+        progress += pnum;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = 4 + nb_extents * 8;
+    return nbd_co_send_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_BLOCK_STATUS, &iov, 1);
+}
+
+/* Reply to NBD_CMD_READ with a simple reply whose data is sent with
+ * nbd_co_send_sendfile().  */
+static int coroutine_fn nbd_co_send_sendfile_reply(NBDRequest *req,
+                                                   struct nbd_reply *reply,
+                                                   uint64_t offset,
+                                                   uint32_t len)
+{
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    /* Reply
+       [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
+       [ 4 ..  7]    error   (0 == no error)
+       [ 8 .. 15]    handle
+     */
+    assert(reply->error == 0);
+    stl_be_p(buf, NBD_REPLY_MAGIC);
+    stl_be_p(buf + 4, 0);
+    stq_be_p(buf + 8, reply->handle);
+
+    return nbd_co_send_sendfile(req->client, &iov, 1, req->data, offset, len);
+}
+
 /* Collect a client request.  Return 0 if request looks valid, -EAGAIN
  * to keep trying the collection, -EIO to drop connection right away,
  * and any other negative value to report an error to the client
@@ -994,7 +1613,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req,
                                       struct nbd_request *request)
 {
     NBDClient *client = req->client;
-    uint32_t command;
+    uint32_t command, valid_flags;
     ssize_t rc;
 
     g_assert(qemu_in_coroutine());
@@ -1067,12 +1686,22 @@ static ssize_t nbd_co_receive_request(NBDRequest *req,
         rc = command == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
         goto out;
     }
-    if (request->type & ~NBD_CMD_MASK_COMMAND & ~NBD_CMD_FLAG_FUA) {
+    valid_flags = NBD_CMD_FLAG_FUA;
+    if (command == NBD_CMD_BLOCK_STATUS) {
+        valid_flags |= NBD_CMD_FLAG_REQ_ONE;
+    }
+    if (request->type & ~NBD_CMD_MASK_COMMAND & ~valid_flags) {
         LOG("unsupported flags (got 0x%x)",
             request->type & ~NBD_CMD_MASK_COMMAND);
         rc = -EINVAL;
         goto out;
     }
+    if (command == NBD_CMD_BLOCK_STATUS &&
+        (!client->base_allocation || !request->len)) {
+        LOG("unexpected block status request");
+        rc = -EINVAL;
+        goto out;
+    }
 
     rc = 0;
 
@@ -1138,6 +1767,23 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, request.handle, request.from,
+                                        request.len) < 0) {
+                goto out;
+            }
+            break;
+        }
+
+        ret = nbd_co_send_sendfile_reply(req, &reply, request.from,
+                                         request.len);
+        if (ret != -ENOTSUP) {
+            if (ret < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1206,6 +1852,14 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (nbd_co_send_block_status(client, request.handle, request.from,
+                                     request.len,
+                                     request.type & NBD_CMD_FLAG_REQ_ONE) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%" PRIu32 ") received", request.type);
         reply.error = EINVAL;
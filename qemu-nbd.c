@@ -112,7 +112,7 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-"      --aio=MODE            set AIO mode (native or threads)\n"
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, unmap)\n"
 "      --image-opts          treat FILE as a full set of image options\n"
@@ -267,7 +267,7 @@ static void *nbd_client_thread(void *arg)
     }
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), NULL, &nbdflags,
-                                NULL, NULL, NULL,
+                                NULL, NULL, NULL, NULL,
                                 &size, &local_error);
     if (ret < 0) {
         if (local_error) {
@@ -567,6 +567,8 @@ int main(int argc, char **argv)
             seen_aio = true;
             if (!strcmp(optarg, "native")) {
                 flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(optarg, "io_uring")) {
+                flags |= BDRV_O_IO_URING;
             } else if (!strcmp(optarg, "threads")) {
                 /* this is the default */
             } else {
@@ -910,6 +912,12 @@ int main(int argc, char **argv)
         }
     }
 
+    /* All clients share one BlockBackend, so a flush from any of them
+     * covers the writes of all the others.  */
+    if (shared > 1) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
+
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed,
                          writethrough, NULL, &local_err);
     if (!exp) {
@@ -292,7 +292,8 @@ DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
 STEXI
 @item -mem-prealloc
 @findex -mem-prealloc
-Preallocate memory when using -mem-path.
+Preallocate memory when using -mem-path.  The memory is touched by up to
+one thread per virtual CPU.
 ETEXI
 
 DEF("k", HAS_ARG, QEMU_OPTION_k,
@@ -518,7 +519,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -561,7 +562,9 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native", or "io_uring" and selects between pthread
+based disk I/O, native Linux AIO, or Linux io_uring.  Unlike native Linux AIO,
+io_uring does not require @option{cache.direct=on}.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -3784,6 +3787,11 @@ The @option{share} boolean option determines whether the memory
 region is marked as private to QEMU, or shared. The latter allows
 a co-operating external process to access the QEMU memory region.
 
+Memory backends also accept @option{prealloc=on} to allocate all the
+memory when the object is created, and @option{prealloc-threads} to
+set how many threads do that in parallel (by default one per virtual
+CPU, but no more than the number of host CPUs).
+
 @item -object rng-random,id=@var{id},filename=@var{/dev/random}
 
 Creates a random number generator backend which obtains entropy from
@@ -3894,6 +3902,21 @@ Dump the network traffic on netdev @var{dev} to the file specified by
 The file format is libpcap, so it can be analyzed with tools such as tcpdump
 or Wireshark.
 
+@item -object iothread,id=@var{id}[,poll-max-ns=@var{ns}][,poll-grow=@var{factor}][,poll-shrink=@var{divisor}]
+
+Creates a dedicated event loop thread that devices can be assigned to, for
+example with @option{-device virtio-blk-pci,iothread=@var{id}}.
+
+When @var{poll-max-ns} is non-zero, the thread busy-waits for up to
+@var{poll-max-ns} nanoseconds for new virtqueue requests and I/O completions
+before going to sleep, which lowers latency at the cost of CPU time.  Polling
+is disabled by default.  The actual polling time adapts itself to the
+workload: it is multiplied by @var{poll-grow} (2 by default) when an event
+arrives shortly after the thread went to sleep, and divided by
+@var{poll-shrink} when events arrive later than @var{poll-max-ns}.  If
+@var{poll-shrink} is 0, polling restarts from scratch instead.  All three
+properties can be changed at run-time with @code{qom-set}.
+
 @item -object secret,id=@var{id},data=@var{string},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 @item -object secret,id=@var{id},file=@var{filename},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 
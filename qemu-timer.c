@@ -67,7 +67,16 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+
+    /* Pending timers, as a binary min-heap ordered by expire_time.  The
+     * first element is the next timer to fire.  Timers with the same
+     * expire_time fire in the order in which they were armed.
+     */
+    QEMUTimer **active_timers;
+    size_t nb_active_timers;
+    size_t active_timers_size;
+    uint64_t timer_seq;
+
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -94,6 +103,11 @@ static bool timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+static inline QEMUTimer *timerlist_first(QEMUTimerList *timer_list)
+{
+    return timer_list->nb_active_timers ? timer_list->active_timers[0] : NULL;
+}
+
 QEMUTimerList *timerlist_new(QEMUClockType type,
                              QEMUTimerListNotifyCB *cb,
                              void *opaque)
@@ -118,6 +132,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -174,7 +189,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!timer_list->active_timers;
+    return !!timer_list->nb_active_timers;
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -188,11 +203,11 @@ bool timerlist_expired(QEMUTimerList *timer_list)
     int64_t expire_time;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nb_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return false;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     return expire_time < qemu_clock_get_ns(timer_list->clock->type);
@@ -223,11 +238,11 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nb_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return -1;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -352,43 +367,115 @@ void timer_free(QEMUTimer *ts)
     g_free(ts);
 }
 
-static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+static inline bool timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
 
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
+static inline void timerlist_heap_set(QEMUTimerList *timer_list, size_t i,
+                                      QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timerlist_sift_up(QEMUTimerList *timer_list, size_t i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+
+        if (!timer_before(ts, timer_list->active_timers[parent])) {
             break;
         }
-        pt = &t->next;
+        timerlist_heap_set(timer_list, i, timer_list->active_timers[parent]);
+        i = parent;
     }
+    timerlist_heap_set(timer_list, i, ts);
 }
 
-static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
-                                QEMUTimer *ts, int64_t expire_time)
+static void timerlist_sift_down(QEMUTimerList *timer_list, size_t i)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer *ts = timer_list->active_timers[i];
+    size_t n = timer_list->nb_active_timers;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
     for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
+        size_t child = 2 * i + 1;
+
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            timer_before(timer_list->active_timers[child + 1],
+                         timer_list->active_timers[child])) {
+            child++;
+        }
+        if (!timer_before(timer_list->active_timers[child], ts)) {
             break;
         }
-        pt = &t->next;
+        timerlist_heap_set(timer_list, i, timer_list->active_timers[child]);
+        i = child;
+    }
+    timerlist_heap_set(timer_list, i, ts);
+}
+
+/* Restore the heap property after the key of element i changed */
+static void timerlist_heap_update(QEMUTimerList *timer_list, size_t i)
+{
+    if (i > 0 && timer_before(timer_list->active_timers[i],
+                              timer_list->active_timers[(i - 1) / 2])) {
+        timerlist_sift_up(timer_list, i);
+    } else {
+        timerlist_sift_down(timer_list, i);
     }
+}
+
+static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    size_t i = ts->heap_index;
+    size_t last;
+
+    if (ts->expire_time == -1) {
+        return;
+    }
+    ts->expire_time = -1;
+
+    assert(timer_list->active_timers[i] == ts);
+    last = --timer_list->nb_active_timers;
+    if (i != last) {
+        timerlist_heap_set(timer_list, i, timer_list->active_timers[last]);
+        timerlist_heap_update(timer_list, i);
+    }
+}
+
+/* Arm ts, or move it if it is already pending.  Return true if it became
+ * the first timer in the list.
+ */
+static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
+                                QEMUTimer *ts, int64_t expire_time)
+{
+    bool pending = ts->expire_time != -1;
+
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = timer_list->timer_seq++;
 
-    return pt == &timer_list->active_timers;
+    if (pending) {
+        timerlist_heap_update(timer_list, ts->heap_index);
+    } else {
+        if (timer_list->nb_active_timers == timer_list->active_timers_size) {
+            timer_list->active_timers_size =
+                MAX(timer_list->active_timers_size * 2, 16);
+            timer_list->active_timers =
+                g_renew(QEMUTimer *, timer_list->active_timers,
+                        timer_list->active_timers_size);
+        }
+        timerlist_heap_set(timer_list, timer_list->nb_active_timers++, ts);
+        timerlist_sift_up(timer_list, ts->heap_index);
+    }
+
+    return ts->heap_index == 0;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -420,7 +507,6 @@ void timer_mod_ns(QEMUTimer *ts, int64_t expire_time)
     bool rearm;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    timer_del_locked(timer_list, ts);
     rearm = timer_mod_ns_locked(timer_list, ts, expire_time);
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
@@ -439,9 +525,6 @@ void timer_mod_anticipate_ns(QEMUTimer *ts, int64_t expire_time)
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
     if (ts->expire_time == -1 || ts->expire_time > expire_time) {
-        if (ts->expire_time != -1) {
-            timer_del_locked(timer_list, ts);
-        }
         rearm = timer_mod_ns_locked(timer_list, ts, expire_time);
     } else {
         rearm = false;
@@ -482,7 +565,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     void *opaque;
 
     qemu_event_reset(&timer_list->timers_done_ev);
-    if (!timer_list->clock->enabled || !timer_list->active_timers) {
+    if (!timer_list->clock->enabled || !timer_list->nb_active_timers) {
         goto out;
     }
 
@@ -510,16 +593,14 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     for(;;) {
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
+        ts = timerlist_first(timer_list);
         if (!timer_expired_ns(ts, current_time)) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             break;
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
         qemu_mutex_unlock(&timer_list->active_timers_lock);
@@ -0,0 +1,173 @@
+/*
+ * HBitmap benchmark
+ *
+ * Times bulk set/reset, iteration, serialization and rebuilding of the
+ * upper levels on a large bitmap, once for each word-loop implementation
+ * supported by the host.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/hbitmap.h"
+#include "qemu/timer.h"
+
+static unsigned int size_shift = 30;
+static unsigned int chunk_shift = 20;
+static unsigned int sparse_shift = 16;
+static unsigned int repeat = 3;
+
+static HBitmap *hb;
+static uint8_t *buf;
+
+static const char commands_string[] =
+    " -c = log2 of the number of bits set or reset by each call (default 20)\n"
+    " -n = number of repetitions of each operation\n"
+    " -p = log2 of the distance between bits in the sparse tests (default 16)\n"
+    " -s = log2 of the number of bits in the bitmap (default 30)";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+static void op_set(void)
+{
+    uint64_t i;
+
+    for (i = 0; i < (1ULL << size_shift); i += 1ULL << chunk_shift) {
+        hbitmap_set(hb, i, 1ULL << chunk_shift);
+    }
+}
+
+static void op_reset(void)
+{
+    uint64_t i;
+
+    for (i = 0; i < (1ULL << size_shift); i += 1ULL << chunk_shift) {
+        hbitmap_reset(hb, i, 1ULL << chunk_shift);
+    }
+}
+
+static void op_set_sparse(void)
+{
+    uint64_t i;
+
+    hbitmap_reset_all(hb);
+    for (i = 0; i < (1ULL << size_shift); i += 1ULL << sparse_shift) {
+        hbitmap_set(hb, i, 1);
+    }
+}
+
+static void op_iter(void)
+{
+    HBitmapIter hbi;
+    uint64_t n = 0;
+
+    hbitmap_iter_init(&hbi, hb, 0);
+    while (hbitmap_iter_next(&hbi) >= 0) {
+        n++;
+    }
+    assert(n == hbitmap_count(hb));
+}
+
+static void op_serialize(void)
+{
+    hbitmap_serialize_part(hb, buf, 0, 1ULL << size_shift);
+}
+
+static void op_deserialize(void)
+{
+    hbitmap_deserialize_part(hb, buf, 0, 1ULL << size_shift, true);
+}
+
+static double run_op(void (*op)(void))
+{
+    int64_t start, best = INT64_MAX;
+    unsigned int i;
+
+    for (i = 0; i < repeat; i++) {
+        start = get_clock();
+        op();
+        best = MIN(best, get_clock() - start);
+    }
+    /* Report the best run, in Gbit/s.  */
+    return (double)(1ULL << size_shift) / best;
+}
+
+static void run_all(void)
+{
+    printf("  set:             %8.2f Gbit/s\n", run_op(op_set));
+    printf("  iterate (dense): %8.2f Gbit/s\n", run_op(op_iter));
+    printf("  serialize:       %8.2f Gbit/s\n", run_op(op_serialize));
+    printf("  reset:           %8.2f Gbit/s\n", run_op(op_reset));
+    op_set_sparse();
+    printf("  iterate (sparse):%8.2f Gbit/s\n", run_op(op_iter));
+    op_serialize();
+    printf("  deserialize:     %8.2f Gbit/s\n", run_op(op_deserialize));
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "c:hn:p:s:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'c':
+            chunk_shift = atoi(optarg);
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            exit(0);
+        case 'n':
+            repeat = atoi(optarg);
+            break;
+        case 'p':
+            sparse_shift = atoi(optarg);
+            break;
+        case 's':
+            size_shift = atoi(optarg);
+            break;
+        default:
+            usage_complete(argc, argv);
+        }
+    }
+    if (!repeat || size_shift < 6 || size_shift > 40 ||
+        chunk_shift > size_shift || sparse_shift > size_shift) {
+        usage_complete(argc, argv);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int pass = 0;
+
+    parse_args(argc, argv);
+
+    init_clocks();
+    hb = hbitmap_alloc(1ULL << size_shift, 0);
+    buf = g_malloc(hbitmap_serialization_size(hb, 0, 1ULL << size_shift));
+
+    printf("Parameters:\n");
+    printf(" bitmap size:  2^%u bits\n", size_shift);
+    printf(" chunk size:   2^%u bits\n", chunk_shift);
+    printf(" sparse step:  2^%u bits\n", sparse_shift);
+    printf(" repetitions:  %u\n", repeat);
+    printf("Results (best run):\n");
+    do {
+        printf(" implementation %u:\n", pass++);
+        hbitmap_reset_all(hb);
+        run_all();
+    } while (test_hbitmap_next_accel());
+
+    g_free(buf);
+    hbitmap_free(hb);
+    return 0;
+}
@@ -26,7 +26,8 @@ struct thread_info {
     void (*func)(struct thread_info *);
     struct thread_stats stats;
     uint64_t r;
-    bool write_op; /* writes alternate between insertions and removals */
+    bool write_op; /* insertion or removal, spread according to insert_rate */
+    double insert_credit;
     bool resize_down;
 } QEMU_ALIGNED(64); /* avoid false sharing among threads */
 
@@ -55,6 +56,7 @@ static unsigned int n_rz_threads = 1;
 static QemuThread *rz_threads;
 
 static double update_rate; /* 0.0 to 1.0 */
+static double insert_rate = 0.5; /* 0.0 to 1.0, fraction of updates */
 static uint64_t update_threshold;
 static uint64_t resize_threshold;
 
@@ -80,6 +82,8 @@ static const char commands_string[] =
     " -r = update range of keys (will be rounded up to pow2)\n"
     "\n"
     " -u = update rate (0.0 to 100.0), 50/50 split of insertions/removals\n"
+    " -i = insertion rate (0.0 to 100.0) of the updates, default 50.0\n"
+    "      Below 50 the table drains, which makes -R also shrink it\n"
     "\n"
     " -R = enable auto-resize\n"
     " -S = resize rate (0.0 to 100.0)\n"
@@ -159,6 +163,14 @@ static void do_rw(struct thread_info *info)
     } else {
         p = &keys[info->r & (update_range - 1)];
         hash = h(*p);
+
+        /* spread the insertions evenly among the updates */
+        info->insert_credit += insert_rate;
+        info->write_op = info->insert_credit >= 1.0;
+        if (info->write_op) {
+            info->insert_credit -= 1.0;
+        }
+
         if (info->write_op) {
             bool written = false;
 
@@ -182,7 +194,6 @@ static void do_rw(struct thread_info *info)
                 stats->not_rm++;
             }
         }
-        info->write_op = !info->write_op;
     }
 }
 
@@ -214,7 +225,7 @@ static void prepare_thread_info(struct thread_info *info, int i)
     /* seed for the RNG; each thread should have a different one */
     info->r = (i + 1) ^ time(NULL);
     /* the first update will be a write */
-    info->write_op = true;
+    info->insert_credit = 1.0 - insert_rate;
     /* the first resize will be down */
     info->resize_down = true;
 
@@ -264,6 +275,7 @@ static void pr_params(void)
         printf(" # resize threads   %u\n", n_rz_threads);
     }
     printf(" update rate:       %f%%\n", update_rate * 100.0);
+    printf(" insertion rate:    %f%%\n", insert_rate * 100.0);
     printf(" offset:            %ld\n", populate_offset);
     printf(" initial key range: %zu\n", init_range);
     printf(" lookup range:      %lu\n", lookup_range);
@@ -355,6 +367,7 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
 static void pr_stats(void)
 {
     struct thread_stats s = {};
+    struct qht_stats st;
     double tx;
 
     add_stats(&s, rw_info, n_rw_threads);
@@ -383,6 +396,12 @@ static void pr_stats(void)
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+
+    qht_statistics_init(&ht, &st);
+    printf(" Final head buckets: %zu (%zu used)\n",
+           st.head_buckets, st.used_head_buckets);
+    printf(" Final entries:     %zu\n", st.entries);
+    qht_statistics_destroy(&st);
 }
 
 static void run_test(void)
@@ -412,7 +431,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:r:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:g:i:k:K:l:hn:N:o:r:Rs:S:u:");
         if (c < 0) {
             break;
         }
@@ -433,6 +452,12 @@ static void parse_args(int argc, char *argv[])
         case 'h':
             usage_complete(argc, argv);
             exit(0);
+        case 'i':
+            insert_rate = atof(optarg) / 100.0;
+            if (insert_rate > 1.0) {
+                insert_rate = 1.0;
+            }
+            break;
         case 'k':
             init_size = atol(optarg);
             break;
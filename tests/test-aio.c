@@ -448,6 +448,52 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+#ifdef CONFIG_POSIX
+static bool event_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+
+    if (!data->active) {
+        return false;
+    }
+    data->n++;
+    data->active--;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 0 };
+    uint64_t hits;
+
+    event_notifier_init(&data.e, false);
+    set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+    aio_context_set_poll_params(ctx, 1000000, 0, 0, &error_abort);
+
+    /* Polling starts once an event arrived quickly after blocking */
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* The event is now found by io_poll() without touching the fd */
+    hits = ctx->poll_hits;
+    data.active = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert_cmpint(data.active, ==, 0);
+    g_assert_cmpuint(ctx->poll_hits, ==, hits + 1);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+#endif
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -856,6 +902,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
+#ifdef CONFIG_POSIX
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+#endif
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -183,6 +183,37 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that terminated coroutines are reused from the thread's pool
+ */
+
+static void test_pool(void)
+{
+    CoroutinePoolStats before, after;
+    Coroutine *coroutine;
+    bool done = false;
+    int i;
+
+    /* Warm up the pool */
+    coroutine = qemu_coroutine_create(set_and_exit, &done);
+    qemu_coroutine_enter(coroutine);
+
+    qemu_coroutine_get_pool_stats(&before);
+    g_assert_cmpint(before.size, >=, 1);
+
+    for (i = 0; i < 10; i++) {
+        done = false;
+        coroutine = qemu_coroutine_create(set_and_exit, &done);
+        qemu_coroutine_enter(coroutine);
+        g_assert(done);
+    }
+
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpint(after.hits - before.hits, ==, 10);
+    g_assert_cmpint(after.misses, ==, before.misses);
+    g_assert_cmpint(after.size, ==, before.size);
+}
+
 
 #define RECORD_SIZE 10 /* Leave some room for expansion */
 struct coroutine_position {
@@ -383,6 +414,7 @@ int main(int argc, char **argv)
      */
     if (CONFIG_COROUTINE_POOL) {
         g_test_add_func("/basic/co_queue", test_co_queue);
+        g_test_add_func("/basic/pool", test_pool);
     }
 
     g_test_add_func("/basic/lifecycle", test_lifecycle);
@@ -22,6 +22,7 @@
 
 #include "crypto/init.h"
 #include "crypto/cipher.h"
+#include "crypto/aes.h"
 #include "qapi/error.h"
 
 typedef struct QCryptoCipherTestData QCryptoCipherTestData;
@@ -149,6 +150,68 @@ static QCryptoCipherTestData test_data[] = {
             "39f23369a9d9bacfa530e26304231461"
             "b2eb05e2c39be9fcda6c19078c6a9d1b",
     },
+    {
+        /* More blocks than the AES-NI code interleaves, computed
+         * with "openssl enc -nopad" */
+        .path = "/crypto/cipher/aes-ecb-128-long",
+        .alg = QCRYPTO_CIPHER_ALG_AES_128,
+        .mode = QCRYPTO_CIPHER_MODE_ECB,
+        .key = "2b7e151628aed2a6abf7158809cf4f3c",
+        .plaintext =
+            "000102030405060708090a0b0c0d0e0f"
+            "101112131415161718191a1b1c1d1e1f"
+            "202122232425262728292a2b2c2d2e2f"
+            "303132333435363738393a3b3c3d3e3f"
+            "404142434445464748494a4b4c4d4e4f"
+            "505152535455565758595a5b5c5d5e5f"
+            "606162636465666768696a6b6c6d6e6f"
+            "707172737475767778797a7b7c7d7e7f"
+            "808182838485868788898a8b8c8d8e8f"
+            "909192939495969798999a9b9c9d9e9f",
+        .ciphertext =
+            "50fe67cc996d32b6da0937e99bafec60"
+            "c84af0b613435d5d9182801a9bd9320b"
+            "25f33f023d8e724c675044e80b193498"
+            "5ce99ca02f4e9733f193bf28000bd44c"
+            "576076a2e3950d73f8e9bf794a7b5d95"
+            "c34ab882088b5393daa9a661d6903436"
+            "6f8db13c3b464e73ddf4e248ed296793"
+            "3459d4ca18c19941b910aea3c3490777"
+            "637175e242b86544733697827da6de91"
+            "f96dd3e427dae3a4b2ce3678d0ccb5a4",
+    },
+    {
+        /* Same as above, for CBC */
+        .path = "/crypto/cipher/aes-cbc-256-long",
+        .alg = QCRYPTO_CIPHER_ALG_AES_256,
+        .mode = QCRYPTO_CIPHER_MODE_CBC,
+        .key =
+            "603deb1015ca71be2b73aef0857d7781"
+            "1f352c073b6108d72d9810a30914dff4",
+        .iv = "000102030405060708090a0b0c0d0e0f",
+        .plaintext =
+            "000102030405060708090a0b0c0d0e0f"
+            "101112131415161718191a1b1c1d1e1f"
+            "202122232425262728292a2b2c2d2e2f"
+            "303132333435363738393a3b3c3d3e3f"
+            "404142434445464748494a4b4c4d4e4f"
+            "505152535455565758595a5b5c5d5e5f"
+            "606162636465666768696a6b6c6d6e6f"
+            "707172737475767778797a7b7c7d7e7f"
+            "808182838485868788898a8b8c8d8e8f"
+            "909192939495969798999a9b9c9d9e9f",
+        .ciphertext =
+            "e568f68194cf76d6174d4cc04310a854"
+            "d09ef932b9ff1244ec7a1dc1ccb1c637"
+            "573bd29fbd6fb3179897aa76a70b5519"
+            "284f1339bec2004df1c51b33b56d39b4"
+            "bdef8d50881d977914e6c57dd4c8c341"
+            "67d3c1c69cc0cd1bc7dadf9a45accc6d"
+            "bf69e322ad69df01667a1386f270eab4"
+            "cda45b986c91e9f7c5d5ac9f6103bc96"
+            "f9bdf40de54296114b2a13ed5e70226e"
+            "c54309c9362511093f9979857e395301",
+    },
     {
         .path = "/crypto/cipher/des-rfb-ecb-56",
         .alg = QCRYPTO_CIPHER_ALG_DES_RFB,
@@ -524,6 +587,41 @@ static void test_cipher(const void *opaque)
 
     g_assert_cmpstr(outtexthex, ==, data->plaintext);
 
+    g_free(outtexthex);
+
+    /* Block drivers encrypt and decrypt in place */
+    if (iv) {
+        g_assert(qcrypto_cipher_setiv(cipher,
+                                      iv, niv,
+                                      &error_abort) == 0);
+    }
+    g_assert(qcrypto_cipher_encrypt(cipher,
+                                    outtext,
+                                    outtext,
+                                    nplaintext,
+                                    &error_abort) == 0);
+
+    outtexthex = hex_string(outtext, nciphertext);
+
+    g_assert_cmpstr(outtexthex, ==, data->ciphertext);
+
+    g_free(outtexthex);
+
+    if (iv) {
+        g_assert(qcrypto_cipher_setiv(cipher,
+                                      iv, niv,
+                                      &error_abort) == 0);
+    }
+    g_assert(qcrypto_cipher_decrypt(cipher,
+                                    outtext,
+                                    outtext,
+                                    nplaintext,
+                                    &error_abort) == 0);
+
+    outtexthex = hex_string(outtext, nplaintext);
+
+    g_assert_cmpstr(outtexthex, ==, data->plaintext);
+
  cleanup:
     g_free(outtext);
     g_free(outtexthex);
@@ -607,6 +705,70 @@ static void test_cipher_short_plaintext(void)
     qcrypto_cipher_free(cipher);
 }
 
+/* Compares in-place ECB and CBC with the table based implementation in
+ * crypto/aes.c, for lengths around multiples of the AES-NI interleave */
+static void test_cipher_aes_table(void)
+{
+    static const size_t nblocks[] = { 1, 7, 8, 9, 16, 17, 31 };
+    static const QCryptoCipherAlgorithm algs[] = {
+        QCRYPTO_CIPHER_ALG_AES_128,
+        QCRYPTO_CIPHER_ALG_AES_192,
+        QCRYPTO_CIPHER_ALG_AES_256,
+    };
+    uint8_t key[32], iv[AES_BLOCK_SIZE], tmpiv[AES_BLOCK_SIZE];
+    uint8_t plaintext[31 * AES_BLOCK_SIZE];
+    uint8_t expected[sizeof(plaintext)], buf[sizeof(plaintext)];
+    size_t i, j, k, len, nkey;
+    AES_KEY aeskey;
+
+    for (i = 0; i < sizeof(key); i++) {
+        key[i] = g_test_rand_int();
+    }
+    for (i = 0; i < sizeof(iv); i++) {
+        iv[i] = g_test_rand_int();
+    }
+    for (i = 0; i < sizeof(plaintext); i++) {
+        plaintext[i] = g_test_rand_int();
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(algs); i++) {
+        QCryptoCipher *ecb, *cbc;
+
+        nkey = qcrypto_cipher_get_key_len(algs[i]);
+        AES_set_encrypt_key(key, nkey * 8, &aeskey);
+        ecb = qcrypto_cipher_new(algs[i], QCRYPTO_CIPHER_MODE_ECB,
+                                 key, nkey, &error_abort);
+        cbc = qcrypto_cipher_new(algs[i], QCRYPTO_CIPHER_MODE_CBC,
+                                 key, nkey, &error_abort);
+
+        for (j = 0; j < G_N_ELEMENTS(nblocks); j++) {
+            len = nblocks[j] * AES_BLOCK_SIZE;
+
+            for (k = 0; k < len; k += AES_BLOCK_SIZE) {
+                AES_encrypt(plaintext + k, expected + k, &aeskey);
+            }
+            memcpy(buf, plaintext, len);
+            qcrypto_cipher_encrypt(ecb, buf, buf, len, &error_abort);
+            g_assert(memcmp(buf, expected, len) == 0);
+            qcrypto_cipher_decrypt(ecb, buf, buf, len, &error_abort);
+            g_assert(memcmp(buf, plaintext, len) == 0);
+
+            memcpy(tmpiv, iv, sizeof(iv));
+            AES_cbc_encrypt(plaintext, expected, len, &aeskey, tmpiv, 1);
+            memcpy(buf, plaintext, len);
+            qcrypto_cipher_setiv(cbc, iv, sizeof(iv), &error_abort);
+            qcrypto_cipher_encrypt(cbc, buf, buf, len, &error_abort);
+            g_assert(memcmp(buf, expected, len) == 0);
+            qcrypto_cipher_setiv(cbc, iv, sizeof(iv), &error_abort);
+            qcrypto_cipher_decrypt(cbc, buf, buf, len, &error_abort);
+            g_assert(memcmp(buf, plaintext, len) == 0);
+        }
+
+        qcrypto_cipher_free(ecb);
+        qcrypto_cipher_free(cbc);
+    }
+}
+
 int main(int argc, char **argv)
 {
     size_t i;
@@ -627,5 +789,10 @@ int main(int argc, char **argv)
     g_test_add_func("/crypto/cipher/short-plaintext",
                     test_cipher_short_plaintext);
 
+    if (qcrypto_cipher_supports(QCRYPTO_CIPHER_ALG_AES_256)) {
+        g_test_add_func("/crypto/cipher/aes-table",
+                        test_cipher_aes_table);
+    }
+
     return g_test_run();
 }
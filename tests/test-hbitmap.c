@@ -11,6 +11,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
+#include "qemu/bswap.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
 
@@ -634,6 +635,155 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void hbitmap_test_serialize_range(TestHBitmapData *data,
+                                         uint8_t *buf, size_t buf_size,
+                                         uint64_t pos, uint64_t count)
+{
+    size_t i;
+    unsigned long *el = (unsigned long *)buf;
+
+    assert(hbitmap_granularity(data->hb) == 0);
+    hbitmap_reset_all(data->hb);
+    memset(buf, 0, buf_size);
+    if (count) {
+        hbitmap_set(data->hb, pos, count);
+    }
+    hbitmap_serialize_part(data->hb, buf, 0, data->size);
+
+    /* Serialized data is little-endian */
+    for (i = 0; i < buf_size / sizeof(unsigned long); i++) {
+        el[i] = (BITS_PER_LONG == 32 ? le32_to_cpu(el[i]) : le64_to_cpu(el[i]));
+    }
+
+    for (i = 0; i < data->size; i++) {
+        int is_set = test_bit(i, (unsigned long *)buf);
+        if (i >= pos && i < pos + count) {
+            g_assert(is_set);
+        } else {
+            g_assert(!is_set);
+        }
+    }
+
+    /* Re-serialize for deserialization testing */
+    memset(buf, 0, buf_size);
+    hbitmap_serialize_part(data->hb, buf, 0, data->size);
+    hbitmap_reset_all(data->hb);
+    hbitmap_deserialize_part(data->hb, buf, 0, data->size, true);
+
+    for (i = 0; i < data->size; i++) {
+        int is_set = hbitmap_get(data->hb, i);
+        if (i >= pos && i < pos + count) {
+            g_assert(is_set);
+        } else {
+            g_assert(!is_set);
+        }
+    }
+    g_assert_cmpint(hbitmap_count(data->hb), ==, count);
+}
+
+static void test_hbitmap_serialize_basic(TestHBitmapData *data,
+                                         const void *unused)
+{
+    int i, j;
+    size_t buf_size;
+    uint8_t *buf;
+    uint64_t positions[] = { 0, 1, L1 - 1, L1, L2 - 1, L2, L2 + 1, L3 - 1 };
+    int num_positions = sizeof(positions) / sizeof(positions[0]);
+
+    hbitmap_test_init(data, L3, 0);
+    buf_size = hbitmap_serialization_size(data->hb, 0, data->size);
+    buf = g_malloc0(buf_size);
+
+    for (i = 0; i < num_positions; i++) {
+        for (j = 0; j < num_positions; j++) {
+            hbitmap_test_serialize_range(data, buf, buf_size,
+                                         positions[i],
+                                         MIN(positions[j], L3 - positions[i]));
+        }
+    }
+
+    g_free(buf);
+}
+
+static void test_hbitmap_serialize_part(TestHBitmapData *data,
+                                        const void *unused)
+{
+    int i, j, k;
+    size_t buf_size;
+    uint8_t *buf;
+    uint64_t positions[] = { 0, 1, L1 - 1, L1, L2 - 1, L2, L2 + 1, L3 - 1 };
+    int num_positions = sizeof(positions) / sizeof(positions[0]);
+
+    hbitmap_test_init(data, L3, 0);
+    buf_size = L2;
+    buf = g_malloc0(buf_size);
+
+    for (i = 0; i < num_positions; i++) {
+        hbitmap_set(data->hb, positions[i], 1);
+    }
+
+    for (i = 0; i < data->size; i += buf_size * 8) {
+        hbitmap_serialize_part(data->hb, buf, i, buf_size * 8);
+        for (j = 0; j < buf_size * 8; j++) {
+            bool should_set = false;
+            for (k = 0; k < num_positions; k++) {
+                if (positions[k] == j + i) {
+                    should_set = true;
+                    break;
+                }
+            }
+            g_assert_cmpint(should_set, ==,
+                            !!(buf[j / 8] & (1 << (j % 8))));
+        }
+    }
+
+    g_free(buf);
+}
+
+static void test_hbitmap_serialize_ones(TestHBitmapData *data,
+                                        const void *unused)
+{
+    uint64_t gran;
+
+    /* The last chunk is incomplete; bits past the end must be dropped */
+    hbitmap_test_init(data, L2 + 17, 0);
+    gran = hbitmap_serialization_granularity(data->hb);
+
+    hbitmap_deserialize_zeroes(data->hb, 0, gran, false);
+    hbitmap_deserialize_ones(data->hb, gran, data->size - gran, true);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, data->size - gran);
+    g_assert(!hbitmap_get(data->hb, gran - 1));
+    g_assert(hbitmap_get(data->hb, gran));
+    g_assert(hbitmap_get(data->hb, data->size - 1));
+
+    hbitmap_test_set(data, gran, data->size - gran);
+    hbitmap_test_check(data, 0);
+}
+
+/* Long ranges go through the vectorized word loops; run the same sequence
+ * with each implementation that the host supports.
+ */
+static void test_hbitmap_accel(TestHBitmapData *data,
+                               const void *unused)
+{
+    do {
+        hbitmap_test_init(data, L3, 0);
+        hbitmap_test_set(data, 17, L2 * 3 + 5);
+        hbitmap_test_set(data, L2 * 5, L2 * 2);
+        hbitmap_test_reset(data, L2 + 3, L2 * 2);
+        hbitmap_test_reset(data, L2 * 5 + L1, L1 * 20);
+        hbitmap_test_set(data, L1 * 7 + 1, L1 * 30);
+        hbitmap_test_set(data, L3 - 1, 1);
+
+        /* Rebuilding the upper levels scans for nonzero words.  */
+        hbitmap_deserialize_finish(data->hb);
+        hbitmap_test_check(data, 0);
+
+        hbitmap_test_reset(data, 0, L3);
+        hbitmap_test_teardown(data, NULL);
+    } while (test_hbitmap_next_accel());
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -683,6 +833,16 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/basic",
+                     test_hbitmap_serialize_basic);
+    hbitmap_test_add("/hbitmap/serialize/part",
+                     test_hbitmap_serialize_part);
+    hbitmap_test_add("/hbitmap/serialize/ones",
+                     test_hbitmap_serialize_ones);
+
+    /* Keep this last, it leaves the slowest implementation selected.  */
+    hbitmap_test_add("/hbitmap/accel", test_hbitmap_accel);
     g_test_run();
 
     return 0;
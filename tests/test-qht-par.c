@@ -8,18 +8,24 @@
 
 #define TEST_QHT_STRING "tests/qht-bench 1>/dev/null 2>&1 -R -S0.1 -D10000 -N1 "
 
-static void test_qht(int n_threads, int update_rate, int duration)
+static void test_qht_args(int n_threads, int update_rate, int duration,
+                          const char *extra)
 {
     char *str;
     int rc;
 
-    str = g_strdup_printf(TEST_QHT_STRING "-n %d -u %d -d %d",
-                          n_threads, update_rate, duration);
+    str = g_strdup_printf(TEST_QHT_STRING "-n %d -u %d -d %d %s",
+                          n_threads, update_rate, duration, extra);
     rc = system(str);
     g_free(str);
     g_assert_cmpint(rc, ==, 0);
 }
 
+static void test_qht(int n_threads, int update_rate, int duration)
+{
+    test_qht_args(n_threads, update_rate, duration, "");
+}
+
 static void test_2th0u1s(void)
 {
     test_qht(2, 0, 1);
@@ -40,6 +46,12 @@ static void test_2th20u5s(void)
     test_qht(2, 20, 5);
 }
 
+/* mostly removals, so that auto-resize shrinks the table while in use */
+static void test_2th20u1s_shrink(void)
+{
+    test_qht_args(2, 20, 1, "-i 10");
+}
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
@@ -47,6 +59,8 @@ int main(int argc, char *argv[])
     if (g_test_quick()) {
         g_test_add_func("/qht/parallel/2threads-0%updates-1s", test_2th0u1s);
         g_test_add_func("/qht/parallel/2threads-20%updates-1s", test_2th20u1s);
+        g_test_add_func("/qht/parallel/2threads-20%updates-1s-shrink",
+                        test_2th20u1s_shrink);
     } else {
         g_test_add_func("/qht/parallel/2threads-0%updates-5s", test_2th0u5s);
         g_test_add_func("/qht/parallel/2threads-20%updates-5s", test_2th20u5s);
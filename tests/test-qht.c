@@ -153,10 +153,47 @@ static void test_resize(void)
     qht_test(QHT_MODE_AUTO_RESIZE);
 }
 
+static size_t head_buckets(void)
+{
+    struct qht_stats stats;
+    size_t ret;
+
+    qht_statistics_init(&ht, &stats);
+    ret = stats.head_buckets;
+    qht_statistics_destroy(&stats);
+    return ret;
+}
+
+static void test_shrink(void)
+{
+    size_t init_buckets, grown_buckets;
+
+    qht_init(&ht, 64, QHT_MODE_AUTO_RESIZE);
+    init_buckets = head_buckets();
+
+    insert(0, N * 2);
+    grown_buckets = head_buckets();
+    g_assert_cmpuint(grown_buckets, >, init_buckets);
+
+    /* emptying most of the table shrinks it, but not below its initial size */
+    rm(0, N * 2 - 10);
+    check(N * 2 - 10, N * 2, true);
+    check_n(10);
+    g_assert_cmpuint(head_buckets(), <, grown_buckets);
+    g_assert_cmpuint(head_buckets(), >=, init_buckets);
+
+    rm(N * 2 - 10, N * 2);
+    check_n(0);
+    g_assert_cmpuint(head_buckets(), ==, init_buckets);
+
+    qht_destroy(&ht);
+}
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/qht/mode/default", test_default);
     g_test_add_func("/qht/mode/resize", test_resize);
+    g_test_add_func("/qht/mode/shrink", test_shrink);
     return g_test_run();
 }
@@ -0,0 +1,171 @@
+/*
+ * Shared image cache tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/shared-cache.h"
+
+#define CACHE_SIZE (2 * 1024 * 1024)
+
+static char *make_cache_path(void)
+{
+    char *path = g_strdup("/tmp/qtest-shared-cache.XXXXXX");
+    int fd = mkstemp(path);
+
+    g_assert(fd >= 0);
+    close(fd);
+    return path;
+}
+
+static void fill_slot(uint8_t *buf, uint64_t image_id, uint64_t offset)
+{
+    memset(buf, (image_id + offset / SHARED_CACHE_SLOT_SIZE) & 0xff,
+           SHARED_CACHE_SLOT_SIZE);
+}
+
+static bool check_slot(uint8_t *buf, uint64_t image_id, uint64_t offset)
+{
+    uint8_t *expected = g_malloc(SHARED_CACHE_SLOT_SIZE);
+    bool ret;
+
+    fill_slot(expected, image_id, offset);
+    ret = !memcmp(buf, expected, SHARED_CACHE_SLOT_SIZE);
+    g_free(expected);
+    return ret;
+}
+
+static void test_basic(void)
+{
+    char *path = make_cache_path();
+    uint8_t *buf = g_malloc(SHARED_CACHE_SLOT_SIZE);
+    uint64_t hits, misses;
+    SharedCache *sc;
+
+    sc = shared_cache_open(path, CACHE_SIZE, &error_abort);
+    g_assert(!shared_cache_lookup(sc, 1, 0, buf));
+
+    fill_slot(buf, 1, 0);
+    shared_cache_insert(sc, 1, 0, buf);
+    memset(buf, 0, SHARED_CACHE_SLOT_SIZE);
+    g_assert(shared_cache_lookup(sc, 1, 0, buf));
+    g_assert(check_slot(buf, 1, 0));
+
+    /* Same offset in a different image */
+    g_assert(!shared_cache_lookup(sc, 2, 0, buf));
+
+    shared_cache_get_stats(sc, &hits, &misses);
+    g_assert_cmpint(hits, ==, 1);
+    g_assert_cmpint(misses, ==, 2);
+
+    shared_cache_close(sc);
+    unlink(path);
+    g_free(buf);
+    g_free(path);
+}
+
+static void test_reopen(void)
+{
+    char *path = make_cache_path();
+    uint8_t *buf = g_malloc(SHARED_CACHE_SLOT_SIZE);
+    SharedCache *sc, *sc2;
+
+    sc = shared_cache_open(path, CACHE_SIZE, &error_abort);
+    sc2 = shared_cache_open(path, CACHE_SIZE, &error_abort);
+    g_assert(sc == sc2);
+    shared_cache_close(sc2);
+
+    fill_slot(buf, 1, SHARED_CACHE_SLOT_SIZE);
+    shared_cache_insert(sc, 1, SHARED_CACHE_SLOT_SIZE, buf);
+    shared_cache_close(sc);
+
+    /* The data survives in the file, like for another process */
+    sc = shared_cache_open(path, 0, &error_abort);
+    memset(buf, 0, SHARED_CACHE_SLOT_SIZE);
+    g_assert(shared_cache_lookup(sc, 1, SHARED_CACHE_SLOT_SIZE, buf));
+    g_assert(check_slot(buf, 1, SHARED_CACHE_SLOT_SIZE));
+    shared_cache_close(sc);
+
+    unlink(path);
+    g_free(buf);
+    g_free(path);
+}
+
+static void test_evict(void)
+{
+    char *path = make_cache_path();
+    uint8_t *buf = g_malloc(SHARED_CACHE_SLOT_SIZE);
+    unsigned n_slots = CACHE_SIZE / SHARED_CACHE_SLOT_SIZE;
+    unsigned i, hits = 0;
+    uint64_t offset;
+    SharedCache *sc;
+
+    sc = shared_cache_open(path, CACHE_SIZE, &error_abort);
+    for (i = 0; i < n_slots * 4; i++) {
+        offset = (uint64_t)i * SHARED_CACHE_SLOT_SIZE;
+        fill_slot(buf, 7, offset);
+        shared_cache_insert(sc, 7, offset, buf);
+
+        /* What was just inserted must be there */
+        memset(buf, 0, SHARED_CACHE_SLOT_SIZE);
+        g_assert(shared_cache_lookup(sc, 7, offset, buf));
+        g_assert(check_slot(buf, 7, offset));
+    }
+
+    /* Whatever survived must have the right contents */
+    for (i = 0; i < n_slots * 4; i++) {
+        offset = (uint64_t)i * SHARED_CACHE_SLOT_SIZE;
+        if (shared_cache_lookup(sc, 7, offset, buf)) {
+            g_assert(check_slot(buf, 7, offset));
+            hits++;
+        }
+    }
+    g_assert_cmpint(hits, >, 0);
+    g_assert_cmpint(hits, <=, n_slots);
+
+    shared_cache_close(sc);
+    unlink(path);
+    g_free(buf);
+    g_free(path);
+}
+
+static void test_too_small(void)
+{
+    char *path = make_cache_path();
+    Error *local_err = NULL;
+
+    g_assert(!shared_cache_open(path, SHARED_CACHE_SLOT_SIZE, &local_err));
+    g_assert(local_err);
+    error_free(local_err);
+
+    unlink(path);
+    g_free(path);
+}
+
+static void test_group_writable(void)
+{
+    char *path = make_cache_path();
+    Error *local_err = NULL;
+
+    g_assert(chmod(path, 0620) == 0);
+    g_assert(!shared_cache_open(path, CACHE_SIZE, &local_err));
+    g_assert(local_err);
+    error_free(local_err);
+
+    unlink(path);
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/shared-cache/basic", test_basic);
+    g_test_add_func("/shared-cache/reopen", test_reopen);
+    g_test_add_func("/shared-cache/evict", test_evict);
+    g_test_add_func("/shared-cache/too-small", test_too_small);
+    g_test_add_func("/shared-cache/group-writable", test_group_writable);
+    return g_test_run();
+}
@@ -0,0 +1,157 @@
+/*
+ * Thread pool throughput benchmark
+ *
+ * Keeps a number of requests in flight on a ThreadPool and reports how many
+ * of them complete per second, for an increasing number of worker threads.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
+
+static AioContext *ctx;
+static ThreadPool *pool;
+
+static unsigned int duration = 1;
+static unsigned int max_threads = 16;
+static unsigned int queue_depth = 128;
+static unsigned int work_ns;
+
+static bool stopping;
+static unsigned int in_flight;
+static uint64_t n_ops;
+
+static const char commands_string[] =
+    " -d = duration of each run, in seconds\n"
+    " -n = maximum number of worker threads (runs with 1, 2, 4, ... threads)\n"
+    " -q = number of requests in flight\n"
+    " -w = busy work done by each request, in nanoseconds";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+static int worker_cb(void *opaque)
+{
+    int64_t end;
+
+    if (work_ns) {
+        end = get_clock() + work_ns;
+        while (get_clock() < end) {
+            /* spin */
+        }
+    }
+    return 0;
+}
+
+static void done_cb(void *opaque, int ret)
+{
+    n_ops++;
+    if (stopping) {
+        in_flight--;
+        return;
+    }
+    thread_pool_submit_aio(pool, worker_cb, NULL, done_cb, NULL);
+}
+
+static double run_test(unsigned int n_threads)
+{
+    int64_t start, end;
+    unsigned int i;
+
+    thread_pool_set_max_threads(pool, n_threads);
+
+    stopping = false;
+    n_ops = 0;
+    for (i = 0; i < queue_depth; i++) {
+        thread_pool_submit_aio(pool, worker_cb, NULL, done_cb, NULL);
+        in_flight++;
+    }
+
+    start = get_clock();
+    end = start + duration * NANOSECONDS_PER_SECOND;
+    while (get_clock() < end) {
+        aio_poll(ctx, true);
+    }
+    end = get_clock();
+
+    stopping = true;
+    while (in_flight) {
+        aio_poll(ctx, true);
+    }
+
+    return (double)n_ops * NANOSECONDS_PER_SECOND / (end - start);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "d:hn:q:w:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            exit(0);
+        case 'n':
+            max_threads = atoi(optarg);
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            break;
+        case 'w':
+            work_ns = atoi(optarg);
+            break;
+        default:
+            usage_complete(argc, argv);
+        }
+    }
+    if (!duration || !max_threads || !queue_depth) {
+        usage_complete(argc, argv);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Error *local_error = NULL;
+    unsigned int n_threads;
+    double ops;
+
+    parse_args(argc, argv);
+
+    init_clocks();
+    ctx = aio_context_new(&local_error);
+    if (!ctx) {
+        error_reportf_err(local_error, "Failed to create AIO Context: ");
+        exit(1);
+    }
+    pool = aio_get_thread_pool(ctx);
+
+    printf("Parameters:\n");
+    printf(" duration:    %u s\n", duration);
+    printf(" queue depth: %u\n", queue_depth);
+    printf(" work:        %u ns\n", work_ns);
+    printf("Results:\n");
+    for (n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        ops = run_test(n_threads);
+        printf(" %3u threads: %.2f Mops/s\n", n_threads, ops / 1e6);
+    }
+
+    aio_context_unref(ctx);
+    return 0;
+}
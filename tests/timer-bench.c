@@ -0,0 +1,173 @@
+/*
+ * Timer list benchmark
+ *
+ * Arms a number of timers on a QEMUTimerList, then re-arms randomly chosen
+ * ones with random deadlines and reports how many operations complete per
+ * second.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/timer.h"
+
+static unsigned int duration = 1;
+static unsigned int n_timers = 10000;
+static int64_t max_delay_ns = 10 * SCALE_MS;
+
+static QEMUTimerList *timer_list;
+static QEMUTimer *timers;
+static uint64_t rand_state = 88172645463325252ULL;
+
+static const char commands_string[] =
+    " -d = duration of each run, in seconds\n"
+    " -m = maximum timer delay, in microseconds\n"
+    " -n = number of timers";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+/* xorshift64, much cheaper than the operations being measured */
+static inline uint64_t bench_rand(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static void timer_cb(void *opaque)
+{
+}
+
+static void notify_cb(void *opaque)
+{
+}
+
+static void op_mod(int64_t now)
+{
+    QEMUTimer *ts = &timers[bench_rand() % n_timers];
+
+    timer_mod_ns(ts, now + bench_rand() % max_delay_ns);
+}
+
+static void op_del_mod(int64_t now)
+{
+    QEMUTimer *ts = &timers[bench_rand() % n_timers];
+
+    timer_del(ts);
+    timer_mod_ns(ts, now + bench_rand() % max_delay_ns);
+}
+
+static void op_anticipate(int64_t now)
+{
+    QEMUTimer *ts = &timers[bench_rand() % n_timers];
+
+    timer_mod_anticipate_ns(ts, now + bench_rand() % max_delay_ns);
+}
+
+static void op_mod_deadline(int64_t now)
+{
+    op_mod(now);
+    timerlist_deadline_ns(timer_list);
+}
+
+static double run_test(void (*op)(int64_t))
+{
+    int64_t start, end, now;
+    uint64_t n_ops = 0;
+    unsigned int i;
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    for (i = 0; i < n_timers; i++) {
+        timer_mod_ns(&timers[i], now + bench_rand() % max_delay_ns);
+    }
+
+    start = get_clock();
+    end = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        /* The deadlines only need to look realistic, do not read the
+         * clock for every operation.
+         */
+        for (i = 0; i < 1024; i++) {
+            op(now);
+        }
+        n_ops += 1024;
+        now = get_clock();
+    } while (now < end);
+
+    for (i = 0; i < n_timers; i++) {
+        timer_del(&timers[i]);
+    }
+    return (double)n_ops * NANOSECONDS_PER_SECOND / (now - start);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "d:hm:n:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            exit(0);
+        case 'm':
+            max_delay_ns = (int64_t)atoi(optarg) * SCALE_US;
+            break;
+        case 'n':
+            n_timers = atoi(optarg);
+            break;
+        default:
+            usage_complete(argc, argv);
+        }
+    }
+    if (!duration || !n_timers || max_delay_ns <= 0) {
+        usage_complete(argc, argv);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int i;
+
+    parse_args(argc, argv);
+
+    init_clocks();
+    timer_list = timerlist_new(QEMU_CLOCK_REALTIME, notify_cb, NULL);
+    timers = g_new0(QEMUTimer, n_timers);
+    for (i = 0; i < n_timers; i++) {
+        timer_init_tl(&timers[i], timer_list, SCALE_NS, timer_cb, NULL);
+    }
+
+    printf("Parameters:\n");
+    printf(" duration:  %u s\n", duration);
+    printf(" timers:    %u\n", n_timers);
+    printf(" max delay: %" PRId64 " us\n", max_delay_ns / SCALE_US);
+    printf("Results:\n");
+    printf(" timer_mod:            %.2f Mops/s\n", run_test(op_mod) / 1e6);
+    printf(" timer_del+timer_mod:  %.2f Mops/s\n",
+           run_test(op_del_mod) / 1e6);
+    printf(" timer_mod_anticipate: %.2f Mops/s\n",
+           run_test(op_anticipate) / 1e6);
+    printf(" timer_mod+deadline:   %.2f Mops/s\n",
+           run_test(op_mod_deadline) / 1e6);
+
+    for (i = 0; i < n_timers; i++) {
+        timer_deinit(&timers[i]);
+    }
+    g_free(timers);
+    timerlist_free(timer_list);
+    return 0;
+}
@@ -49,6 +49,11 @@ struct ThreadPoolElement {
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Link in the completed list, which is lock-free, and then in
+     * the batch of completions that the bottom half is processing.
+     */
+    QSLIST_ENTRY(ThreadPoolElement) done;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -64,16 +69,44 @@ struct ThreadPool {
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSLIST_HEAD(, ThreadPoolElement) batch;
+
+    /* Worker threads push requests here when they are done, without taking
+     * the lock; the completion bottom half takes the whole list at once.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) completed;
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
     int cur_threads;
     int idle_threads;
+    int pending_wakeups; /* posts to sem that no thread has consumed yet */
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     bool stopping;
 };
 
+/* Hand a finished request over to the pool's AioContext.  Only the
+ * thread that moves the completed list from empty to non-empty needs
+ * to schedule the bottom half; the others piggyback on it.
+ */
+static void thread_pool_complete(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolElement *old;
+
+    /* Like QSLIST_INSERT_HEAD_ATOMIC, but remember the old head: req may
+     * be completed and freed as soon as it is visible in the list.
+     */
+    do {
+        old = atomic_read(&pool->completed.slh_first);
+        req->done.sle_next = old;
+    } while (atomic_cmpxchg(&pool->completed.slh_first, old, req) != old);
+
+    if (!old) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -86,15 +119,21 @@ static void *worker_thread(void *opaque)
         ThreadPoolElement *req;
         int ret;
 
-        do {
+        /* Busy workers go straight to the next request; only idle
+         * ones sleep and need to be woken up.
+         */
+        if (QTAILQ_EMPTY(&pool->request_list)) {
             pool->idle_threads++;
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+            if (ret == 0) {
+                pool->pending_wakeups--;
+            } else if (QTAILQ_EMPTY(&pool->request_list)) {
+                break;
+            }
+            continue;
         }
 
         req = QTAILQ_FIRST(&pool->request_list);
@@ -109,9 +148,9 @@ static void *worker_thread(void *opaque)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
+        thread_pool_complete(pool, req);
 
-        qemu_bh_schedule(pool->completion_bh);
+        qemu_mutex_lock(&pool->lock);
     }
 
     pool->cur_threads--;
@@ -163,14 +202,32 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    ThreadPoolElement *elem;
 
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
+    for (;;) {
+        /* A nested call from a callback below continues the current
+         * batch; otherwise take everything that completed so far.
+         */
+        if (QSLIST_EMPTY(&pool->batch)) {
+            QSLIST_HEAD(, ThreadPoolElement) completed;
+
+            QSLIST_MOVE_ATOMIC(&completed, &pool->completed);
+            if (QSLIST_EMPTY(&completed)) {
+                break;
+            }
+
+            /* The completed list is LIFO, reverse it to complete requests
+             * in the order in which they finished.
+             */
+            while ((elem = QSLIST_FIRST(&completed)) != NULL) {
+                QSLIST_REMOVE_HEAD(&completed, done);
+                QSLIST_INSERT_HEAD(&pool->batch, elem, done);
+            }
         }
 
+        elem = QSLIST_FIRST(&pool->batch);
+        QSLIST_REMOVE_HEAD(&pool->batch, done);
+
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
@@ -185,11 +242,8 @@ restart:
             qemu_bh_schedule(pool->completion_bh);
 
             elem->common.cb(elem->common.opaque, elem->ret);
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
 }
 
@@ -201,18 +255,16 @@ static void thread_pool_cancel(BlockAIOCB *acb)
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
     qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
+    if (elem->state == THREAD_QUEUED) {
+        /* No thread has yet started working on elem, so we can "steal"
+         * the item from the workers.  A worker that was woken up for it
+         * will find the request list empty and go back to sleep.
          */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        thread_pool_complete(pool, elem);
     }
 
     qemu_mutex_unlock(&pool->lock);
@@ -248,12 +300,15 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     trace_thread_pool_submit(pool, req, arg);
 
     qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    if (pool->idle_threads > pool->pending_wakeups) {
+        /* Wake up an idle thread that nobody has woken up yet */
+        pool->pending_wakeups++;
+        qemu_sem_post(&pool->sem);
+    } else if (pool->cur_threads < pool->max_threads) {
         spawn_thread(pool);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
     qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
     return &req->common;
 }
 
@@ -301,6 +356,8 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
+    QSLIST_INIT(&pool->batch);
+    QSLIST_INIT(&pool->completed);
     QTAILQ_INIT(&pool->request_list);
 }
 
@@ -311,6 +368,15 @@ ThreadPool *thread_pool_new(AioContext *ctx)
     return pool;
 }
 
+void thread_pool_set_max_threads(ThreadPool *pool, int max_threads)
+{
+    assert(max_threads > 0);
+
+    qemu_mutex_lock(&pool->lock);
+    pool->max_threads = max_threads;
+    qemu_mutex_unlock(&pool->lock);
+}
+
 void thread_pool_free(ThreadPool *pool)
 {
     if (!pool) {
@@ -329,6 +395,7 @@ void thread_pool_free(ThreadPool *pool)
     /* Wait for worker threads to terminate */
     pool->stopping = true;
     while (pool->cur_threads > 0) {
+        pool->pending_wakeups++;
         qemu_sem_post(&pool->sem);
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
@@ -13,6 +13,9 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "qemu/notify.h"
+#include "qemu/thread.h"
 #include "trace.h"
 #include "trace/control.h"
 #include "trace/simple.h"
@@ -29,9 +32,6 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
  * Trace records are written out by a dedicated thread.  The thread waits for
  * records to become available, writes them out, and then waits again.
@@ -44,14 +44,45 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 16,
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+QEMU_BUILD_BUG_ON(TRACE_BUF_LEN & (TRACE_BUF_LEN - 1));
+
+/*
+ * Each thread that records events has a ring buffer of its own, so that
+ * tracing from several vCPUs and IOThreads does not bounce a shared index
+ * between them.  A thread is the only producer for its buffer and the writeout
+ * thread is the only consumer, so plain loads and stores plus barriers are
+ * enough to hand records over.  Indices run freely and are masked on access.
+ *
+ * Buffers are never freed.  When a thread exits its buffer is marked as
+ * unowned and is adopted by the next thread that needs one, once the writeout
+ * thread has drained it.
+ */
+struct TraceThreadBuffer {
+    /* Written by the owning thread only */
+    unsigned int reserve_idx;
+    unsigned int commit_idx;
+    unsigned int nesting;
+    unsigned int dropped;
+    int owned;
+
+    /* Written by the writeout thread only */
+    unsigned int read_idx QEMU_ALIGNED(64);
+    unsigned int end_idx;
+    unsigned int dropped_reported;
+
+    TraceThreadBuffer *next;
+    uint8_t data[TRACE_BUF_LEN] QEMU_ALIGNED(64);
+};
+
+static TraceThreadBuffer *trace_buffers;
+static __thread TraceThreadBuffer *thread_buf;
+static __thread bool thread_buf_exited;
+static __thread Notifier thread_buf_exit_notifier;
+
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
@@ -72,53 +103,25 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
-
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void read_from_buffer(TraceThreadBuffer *buf, unsigned int idx,
+                             void *dataptr, size_t size)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t first = MIN(size, TRACE_BUF_LEN - off);
+
+    memcpy(dataptr, &buf->data[off], first);
+    memcpy((uint8_t *)dataptr + first, buf->data, size - first);
 }
-/**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
- *
- * Returns false if the record is not valid.
- */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
-{
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
-    }
+static unsigned int write_to_buffer(TraceThreadBuffer *buf, unsigned int idx,
+                                    const void *dataptr, size_t size)
+{
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t first = MIN(size, TRACE_BUF_LEN - off);
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    memcpy(&buf->data[off], dataptr, first);
+    memcpy(buf->data, (const uint8_t *)dataptr + first, size - first);
+    return idx + size; /* most callers wants to know where to write next */
 }
 
 /**
@@ -150,125 +153,230 @@ static void wait_for_trace_records_available(void)
     g_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+static void write_dropped_record(unsigned int dropped_count)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
-    int dropped_count;
     size_t unused __attribute__ ((unused));
 
-    for (;;) {
-        wait_for_trace_records_available();
+    dropped.rec.event = DROPPED_EVENT_ID;
+    dropped.rec.timestamp_ns = get_clock();
+    dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t);
+    dropped.rec.pid = trace_pid;
+    dropped.rec.arguments[0] = dropped_count;
+    unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+}
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
-            dropped.rec.pid = trace_pid;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
-        }
+/**
+ * Peek at the timestamp of the oldest unwritten record of a buffer
+ *
+ * Returns false if the buffer has no records up to its end_idx snapshot.
+ */
+static bool peek_trace_record(TraceThreadBuffer *buf, uint64_t *timestamp_ns)
+{
+    TraceRecord record;
+
+    if (buf->read_idx == buf->end_idx) {
+        return false;
+    }
+    read_from_buffer(buf, buf->read_idx, &record, sizeof(TraceRecord));
+    *timestamp_ns = record.timestamp_ns;
+    return true;
+}
+
+static void write_trace_record(TraceThreadBuffer *buf)
+{
+    TraceRecord record;
+    unsigned int off = buf->read_idx & (TRACE_BUF_LEN - 1);
+    size_t first;
+    size_t unused __attribute__ ((unused));
+
+    read_from_buffer(buf, buf->read_idx, &record, sizeof(TraceRecord));
+    first = MIN(record.length, TRACE_BUF_LEN - off);
+    unused = fwrite(&buf->data[off], first, 1, trace_fp);
+    if (first < record.length) {
+        unused = fwrite(buf->data, record.length - first, 1, trace_fp);
+    }
+
+    smp_mb(); /* finish reading the record before its space is reused */
+    atomic_set(&buf->read_idx, buf->read_idx + record.length);
+}
+
+/*
+ * Write out everything that was committed when the function was entered,
+ * merging the per-thread buffers so that the file is sorted by timestamp.
+ */
+static void writeout_trace_records(void)
+{
+    TraceThreadBuffer *buf, *oldest;
+    uint64_t timestamp_ns, oldest_ns;
+    unsigned int dropped_count = 0;
+    unsigned int dropped;
+
+    for (buf = atomic_rcu_read(&trace_buffers); buf; buf = buf->next) {
+        buf->end_idx = atomic_read(&buf->commit_idx);
+        dropped = atomic_read(&buf->dropped);
+        dropped_count += dropped - buf->dropped_reported;
+        buf->dropped_reported = dropped;
+    }
+    smp_rmb(); /* read memory barrier before accessing records */
+
+    if (dropped_count) {
+        write_dropped_record(dropped_count);
+    }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+    for (;;) {
+        oldest = NULL;
+        oldest_ns = 0;
+        for (buf = atomic_rcu_read(&trace_buffers); buf; buf = buf->next) {
+            if (peek_trace_record(buf, &timestamp_ns) &&
+                (!oldest || timestamp_ns < oldest_ns)) {
+                oldest = buf;
+                oldest_ns = timestamp_ns;
+            }
+        }
+        if (!oldest) {
+            break;
         }
+        write_trace_record(oldest);
+    }
+}
 
+static gpointer writeout_thread(gpointer opaque)
+{
+    for (;;) {
+        wait_for_trace_records_available();
+        writeout_trace_records();
         fflush(trace_fp);
     }
     return NULL;
 }
 
+static void trace_thread_buffer_exit(Notifier *n, void *value)
+{
+    TraceThreadBuffer *buf = thread_buf;
+
+    thread_buf = NULL;
+    thread_buf_exited = true;
+    atomic_mb_set(&buf->owned, false);
+}
+
+/*
+ * Find a buffer for the current thread, preferably a drained one that was
+ * left behind by a thread that exited.
+ */
+static TraceThreadBuffer *trace_thread_buffer_get(void)
+{
+    TraceThreadBuffer *buf, *head;
+
+    if (thread_buf_exited) {
+        return NULL;
+    }
+
+    for (buf = atomic_rcu_read(&trace_buffers); buf; buf = buf->next) {
+        if (!atomic_read(&buf->owned) &&
+            atomic_read(&buf->read_idx) == atomic_read(&buf->commit_idx) &&
+            !atomic_cmpxchg(&buf->owned, false, true)) {
+            break;
+        }
+    }
+
+    if (!buf) {
+        /* don't use g_malloc, can deadlock when traced */
+        buf = calloc(1, sizeof(*buf));
+        if (!buf) {
+            return NULL;
+        }
+        buf->owned = true;
+        do {
+            head = atomic_read(&trace_buffers);
+            buf->next = head;
+        } while (atomic_cmpxchg(&trace_buffers, head, buf) != head);
+    }
+
+    smp_mb(); /* see the final indices of a previous owner */
+    buf->reserve_idx = buf->commit_idx;
+    thread_buf = buf;
+    thread_buf_exit_notifier.notify = trace_thread_buffer_exit;
+    qemu_thread_atexit_add(&thread_buf_exit_notifier);
+    return buf;
+}
+
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceThreadBuffer *buf = thread_buf;
+    TraceRecord record;
+    unsigned int idx;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
-
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
+    if (unlikely(!buf)) {
+        buf = trace_thread_buffer_get();
+        if (!buf) {
             return -ENOSPC;
         }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
+    }
 
-    idx = old_idx % TRACE_BUF_LEN;
+    /* A signal handler may record an event while this one is being filled */
+    buf->nesting++;
+    barrier();
+
+    idx = buf->reserve_idx;
+    if (idx + rec_len - atomic_read(&buf->read_idx) > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        atomic_set(&buf->dropped, buf->dropped + 1);
+        barrier();
+        buf->nesting--;
+        return -ENOSPC;
+    }
+    smp_rmb(); /* don't write before the space was released by the reader */
+    buf->reserve_idx = idx + rec_len;
+    barrier();
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    record.event = event;
+    record.timestamp_ns = get_clock();
+    record.length = rec_len;
+    record.pid = trace_pid;
+    write_to_buffer(buf, idx, &record, sizeof(TraceRecord));
 
+    rec->tbuf = buf;
     rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->rec_off  = idx + sizeof(TraceRecord);
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+void trace_record_finish(TraceBufferRecord *rec)
 {
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
-}
+    TraceThreadBuffer *buf = rec->tbuf;
+    unsigned int used;
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
+    barrier();
+    if (--buf->nesting) {
+        /* the outer record will commit this one together with itself */
+        return;
     }
-    return idx; /* most callers wants to know where to write next */
-}
 
-void trace_record_finish(TraceBufferRecord *rec)
-{
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    smp_wmb(); /* write barrier before publishing the records */
+    atomic_set(&buf->commit_idx, buf->reserve_idx);
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    used = buf->commit_idx - atomic_read(&buf->read_idx);
+    if (used > TRACE_BUF_FLUSH_THRESHOLD && !atomic_read(&trace_available)) {
         flush_trace_file(false);
     }
 }
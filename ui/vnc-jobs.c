@@ -44,18 +44,26 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds the VncDisplay lock in
+ * shared mode to avoid screen corruption (this does not block vnc_refresh()
+ * because it uses trylock()) but the output lock is not held because the
+ * thread works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Several worker threads take jobs from the queue.  The encoders keep
+ * per-client state (e.g. zlib streams) that must see updates in order, so
+ * a job is only started once all earlier jobs for the same client are done;
+ * jobs for different clients are encoded in parallel.
  */
 
+#define VNC_WORKER_THREADS 4
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
+    QemuThread threads[VNC_WORKER_THREADS];
+    int n_running;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
@@ -63,8 +71,7 @@ struct VncJobQueue {
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * We use a single global queue, shared by all worker threads
  */
 static VncJobQueue *queue;
 
@@ -144,7 +151,7 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        if ((job->vs == vs || !vs) && !job->in_progress) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
         }
     }
@@ -215,20 +222,44 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->lossy_rect = local->lossy_rect;
 }
 
+/* Returns the oldest job whose client has no earlier job in the queue */
+static VncJob *vnc_queue_next_job_locked(VncJobQueue *queue)
+{
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->in_progress) {
+            continue;
+        }
+        for (prev = QTAILQ_FIRST(&queue->jobs); prev != job;
+             prev = QTAILQ_NEXT(prev, next)) {
+            if (prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
 static int vnc_worker_thread_loop(VncJobQueue *queue)
 {
-    VncJob *job;
+    VncJob *job = NULL;
     VncRectEntry *entry, *tmp;
     VncState vs = {};
     int n_rectangles;
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!queue->exit && !(job = vnc_queue_next_job_locked(queue))) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
     /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
+    if (job) {
+        job->in_progress = true;
+    }
     vnc_unlock_queue(queue);
 
     if (queue->exit) {
@@ -260,12 +291,12 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->ioc == NULL) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
             /* Copy persistent encoding data */
             vnc_async_encoding_end(job->vs, &vs);
             goto disconnected;
@@ -279,7 +310,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -329,11 +360,16 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
-
-    qemu_thread_get_self(&queue->thread);
+    bool last;
 
     while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+
+    vnc_lock_queue(queue);
+    last = --queue->n_running == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
@@ -345,12 +381,16 @@ static bool vnc_worker_thread_running(void)
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
+    int i;
 
     if (vnc_worker_thread_running())
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
+    q->n_running = VNC_WORKER_THREADS;
     queue = q; /* Set global queue */
+    for (i = 0; i < VNC_WORKER_THREADS; i++) {
+        qemu_thread_create(&q->threads[i], "vnc_worker", vnc_worker_thread, q,
+                           QEMU_THREAD_DETACHED);
+    }
 }
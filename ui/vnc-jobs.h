@@ -44,7 +44,14 @@ void vnc_start_worker_thread(void);
 /* Locks */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return -EBUSY;
+    }
+    if (vd->n_encoders) {
+        qemu_mutex_unlock(&vd->mutex);
+        return -EBUSY;
+    }
+    return 0;
 }
 
 static inline void vnc_lock_display(VncDisplay *vd)
@@ -57,6 +64,25 @@ static inline void vnc_unlock_display(VncDisplay *vd)
     qemu_mutex_unlock(&vd->mutex);
 }
 
+/*
+ * Encoders only read the server surface, so several workers can encode
+ * updates for clients of the same display at once.  vnc_trylock_display()
+ * fails while any of them is running.
+ */
+static inline void vnc_lock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->n_encoders++;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->n_encoders--;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
 static inline void vnc_lock_output(VncState *vs)
 {
     qemu_mutex_lock(&vs->output_mutex);
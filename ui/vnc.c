@@ -2841,6 +2841,123 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Copy a dirty tile of the guest surface into the server surface, and
+ * return whether its contents changed.  Compare and copy are done in one
+ * pass over the tile.  Full tiles are VNC_TILE_BYTES long; shorter ones
+ * at the right edge of the surface always use vnc_update_tile_int.
+ */
+#define VNC_TILE_BYTES (VNC_DIRTY_PIXELS_PER_BIT * VNC_SERVER_FB_BYTES)
+
+static bool vnc_update_tile_int(uint8_t *server, const uint8_t *guest,
+                                int len)
+{
+    if (memcmp(server, guest, len) == 0) {
+        return false;
+    }
+    memcpy(server, guest, len);
+    return true;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static bool vnc_update_tile_sse2(uint8_t *server, const uint8_t *guest,
+                                 int len)
+{
+    __m128i g0 = _mm_loadu_si128((__m128i *)guest);
+    __m128i g1 = _mm_loadu_si128((__m128i *)guest + 1);
+    __m128i g2 = _mm_loadu_si128((__m128i *)guest + 2);
+    __m128i g3 = _mm_loadu_si128((__m128i *)guest + 3);
+    __m128i eq;
+
+    eq = _mm_cmpeq_epi8(g0, _mm_loadu_si128((__m128i *)server)) &
+         _mm_cmpeq_epi8(g1, _mm_loadu_si128((__m128i *)server + 1)) &
+         _mm_cmpeq_epi8(g2, _mm_loadu_si128((__m128i *)server + 2)) &
+         _mm_cmpeq_epi8(g3, _mm_loadu_si128((__m128i *)server + 3));
+    if (_mm_movemask_epi8(eq) == 0xFFFF) {
+        return false;
+    }
+    _mm_storeu_si128((__m128i *)server, g0);
+    _mm_storeu_si128((__m128i *)server + 1, g1);
+    _mm_storeu_si128((__m128i *)server + 2, g2);
+    _mm_storeu_si128((__m128i *)server + 3, g3);
+    return true;
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static bool vnc_update_tile_avx2(uint8_t *server, const uint8_t *guest,
+                                 int len)
+{
+    __m256i g0 = _mm256_loadu_si256((__m256i *)guest);
+    __m256i g1 = _mm256_loadu_si256((__m256i *)guest + 1);
+    __m256i t;
+
+    t = (g0 ^ _mm256_loadu_si256((__m256i *)server)) |
+        (g1 ^ _mm256_loadu_si256((__m256i *)server + 1));
+    if (_mm256_testz_si256(t, t)) {
+        return false;
+    }
+    _mm256_storeu_si256((__m256i *)server, g0);
+    _mm256_storeu_si256((__m256i *)server + 1, g1);
+    return true;
+}
+#pragma GCC pop_options
+
+static bool (*vnc_update_tile_accel)(uint8_t *, const uint8_t *, int) =
+    vnc_update_tile_int;
+
+static void __attribute__((constructor)) vnc_init_update_tile(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            vnc_update_tile_accel = vnc_update_tile_sse2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                vnc_update_tile_accel = vnc_update_tile_avx2;
+            }
+        }
+    }
+}
+#else
+#define vnc_update_tile_accel vnc_update_tile_sse2
+#endif /* CONFIG_AVX2_OPT */
+
+static bool vnc_update_tile(uint8_t *server, const uint8_t *guest, int len)
+{
+    QEMU_BUILD_BUG_ON(VNC_TILE_BYTES != 64);
+
+    if (likely(len == VNC_TILE_BYTES)) {
+        return vnc_update_tile_accel(server, guest, len);
+    }
+    return vnc_update_tile_int(server, guest, len);
+}
+#else
+#define vnc_update_tile vnc_update_tile_int
+#endif
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -2915,10 +3032,9 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
                 _cmp_bytes = line_bytes - x * cmp_bytes;
             }
             assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (!vnc_update_tile(server_ptr, guest_ptr, _cmp_bytes)) {
                 continue;
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
             if (!vd->non_adaptive) {
                 vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
                                  y, &tv);
@@ -157,6 +157,7 @@ struct VncDisplay
     int lock_key_sync;
     int key_delay_ms;
     QemuMutex mutex;
+    int n_encoders; /* Worker threads reading the server surface */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -245,6 +246,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool in_progress;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
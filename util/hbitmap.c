@@ -12,6 +12,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -208,6 +209,288 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
     return count;
 }
 
+/* Bulk operations on runs of whole words.  These are the inner loops of
+ * setting and resetting large ranges, and of rebuilding the upper levels
+ * after deserialization; for a bitmap of a few billion bits they walk
+ * megabytes of memory, so they have vectorized variants that are selected
+ * at startup depending on the host CPU, similar to buffer_is_zero.
+ *
+ * hb_fill_ones sets n words to all-ones and returns true if any of them
+ * was zero (so that the upper level needs an update); hb_fill_zeroes clears
+ * n words and returns true if any of them was nonzero.  hb_find_nonzero
+ * returns the index of the first nonzero word in [start, end), or end.
+ */
+static bool hb_fill_ones_int(unsigned long *p, size_t n)
+{
+    bool changed = false;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        changed |= (p[i] == 0);
+        p[i] = ~0UL;
+    }
+    return changed;
+}
+
+static bool hb_fill_zeroes_int(unsigned long *p, size_t n)
+{
+    unsigned long t = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        t |= p[i];
+        p[i] = 0;
+    }
+    return t != 0;
+}
+
+static size_t hb_find_nonzero_int(const unsigned long *p,
+                                  size_t start, size_t end)
+{
+    while (start < end && !p[start]) {
+        start++;
+    }
+    return start;
+}
+
+/* The vectorized variants assume 64-bit words.  */
+#if (defined(CONFIG_AVX2_OPT) || defined(__SSE2__)) && HOST_LONG_BITS == 64
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* These accept any length; the words after the last full vector are left
+ * to the scalar helpers.  */
+
+static bool hb_fill_ones_sse2(unsigned long *p, size_t n)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i ones = _mm_cmpeq_epi32(zero, zero);
+    __m128i t = zero;
+    __m128i x, c;
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        /* SSE2 has no 64-bit compare; a word is zero iff both halves are. */
+        x = _mm_loadu_si128((__m128i *)&p[i]);
+        c = _mm_cmpeq_epi32(x, zero);
+        t |= c & _mm_shuffle_epi32(c, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i *)&p[i], ones);
+    }
+    /* Fill the tail first, || must not skip it.  */
+    return hb_fill_ones_int(&p[i], n - i) || _mm_movemask_epi8(t) != 0;
+}
+
+static bool hb_fill_zeroes_sse2(unsigned long *p, size_t n)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i t = zero;
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        t |= _mm_loadu_si128((__m128i *)&p[i]);
+        _mm_storeu_si128((__m128i *)&p[i], zero);
+    }
+    return hb_fill_zeroes_int(&p[i], n - i) ||
+           _mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xFFFF;
+}
+
+static size_t hb_find_nonzero_sse2(const unsigned long *p,
+                                   size_t start, size_t end)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i t;
+
+    /* Loop over blocks of 4 words, then finish with the scalar loop.  */
+    for (; start + 4 <= end; start += 4) {
+        __builtin_prefetch(&p[start + 32]);
+        t = _mm_loadu_si128((__m128i *)&p[start]) |
+            _mm_loadu_si128((__m128i *)&p[start + 2]);
+        if (unlikely(_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xFFFF)) {
+            break;
+        }
+    }
+    return hb_find_nonzero_int(p, start, end);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static bool hb_fill_ones_avx2(unsigned long *p, size_t n)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ones = _mm256_cmpeq_epi64(zero, zero);
+    __m256i t = zero;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        t |= _mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i *)&p[i]), zero);
+        _mm256_storeu_si256((__m256i *)&p[i], ones);
+    }
+    return hb_fill_ones_int(&p[i], n - i) || !_mm256_testz_si256(t, t);
+}
+
+static bool hb_fill_zeroes_avx2(unsigned long *p, size_t n)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i t = zero;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        t |= _mm256_loadu_si256((__m256i *)&p[i]);
+        _mm256_storeu_si256((__m256i *)&p[i], zero);
+    }
+    return hb_fill_zeroes_int(&p[i], n - i) || !_mm256_testz_si256(t, t);
+}
+
+static size_t hb_find_nonzero_avx2(const unsigned long *p,
+                                   size_t start, size_t end)
+{
+    __m256i t;
+
+    /* Loop over blocks of 8 words, then finish with the scalar loop.  */
+    for (; start + 8 <= end; start += 8) {
+        __builtin_prefetch(&p[start + 64]);
+        t = _mm256_loadu_si256((__m256i *)&p[start]) |
+            _mm256_loadu_si256((__m256i *)&p[start + 4]);
+        if (unlikely(!_mm256_testz_si256(t, t))) {
+            break;
+        }
+    }
+    return hb_find_nonzero_int(p, start, end);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for test_hbitmap_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL(op) hb_##op##_int
+#else
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL(op) hb_##op##_sse2
+#endif
+
+static unsigned hb_cpuid_cache = INIT_CACHE;
+static bool (*hb_fill_ones_accel)(unsigned long *, size_t) =
+    INIT_ACCEL(fill_ones);
+static bool (*hb_fill_zeroes_accel)(unsigned long *, size_t) =
+    INIT_ACCEL(fill_zeroes);
+static size_t (*hb_find_nonzero_accel)(const unsigned long *, size_t, size_t) =
+    INIT_ACCEL(find_nonzero);
+
+static void hb_init_accel(unsigned cache)
+{
+    hb_fill_ones_accel = hb_fill_ones_int;
+    hb_fill_zeroes_accel = hb_fill_zeroes_int;
+    hb_find_nonzero_accel = hb_find_nonzero_int;
+    if (cache & CACHE_SSE2) {
+        hb_fill_ones_accel = hb_fill_ones_sse2;
+        hb_fill_zeroes_accel = hb_fill_zeroes_sse2;
+        hb_find_nonzero_accel = hb_find_nonzero_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        hb_fill_ones_accel = hb_fill_ones_avx2;
+        hb_fill_zeroes_accel = hb_fill_zeroes_avx2;
+        hb_find_nonzero_accel = hb_find_nonzero_avx2;
+    }
+#endif
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+static void __attribute__((constructor)) hb_init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    hb_cpuid_cache = cache;
+    hb_init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_hbitmap_next_accel(void)
+{
+    /* If no bits set, we just tested the scalar loops, and there
+     * are no more acceleration options to test.
+     */
+    if (hb_cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    hb_cpuid_cache &= hb_cpuid_cache - 1;
+    hb_init_accel(hb_cpuid_cache);
+    return true;
+}
+
+/* Short runs are not worth an indirect call.  */
+#define HB_ACCEL_MIN_WORDS 16
+
+static inline bool hb_fill_ones(unsigned long *p, size_t n)
+{
+    if (n >= HB_ACCEL_MIN_WORDS) {
+        return hb_fill_ones_accel(p, n);
+    }
+    return hb_fill_ones_int(p, n);
+}
+
+static inline bool hb_fill_zeroes(unsigned long *p, size_t n)
+{
+    if (n >= HB_ACCEL_MIN_WORDS) {
+        return hb_fill_zeroes_accel(p, n);
+    }
+    return hb_fill_zeroes_int(p, n);
+}
+
+static inline size_t hb_find_nonzero(const unsigned long *p,
+                                     size_t start, size_t end)
+{
+    if (end - start >= HB_ACCEL_MIN_WORDS) {
+        return hb_find_nonzero_accel(p, start, end);
+    }
+    return hb_find_nonzero_int(p, start, end);
+}
+
+#else
+#define hb_fill_ones    hb_fill_ones_int
+#define hb_fill_zeroes  hb_fill_zeroes_int
+#define hb_find_nonzero hb_find_nonzero_int
+bool test_hbitmap_next_accel(void)
+{
+    return false;
+}
+#endif
+
 /* Setting starts at the last layer and propagates up if an element
  * changes from zero to non-zero.
  */
@@ -238,15 +521,9 @@ static void hb_set_between(HBitmap *hb, int level, uint64_t start, uint64_t last
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
         changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
-        }
+        changed |= hb_fill_ones(&hb->levels[level][i + 1], lastpos - i - 1);
+        i = lastpos;
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
     changed |= hb_set_elem(&hb->levels[level][i], start, last);
 
@@ -316,15 +593,9 @@ static void hb_reset_between(HBitmap *hb, int level, uint64_t start, uint64_t la
             pos++;
         }
 
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
-        }
+        changed |= hb_fill_zeroes(&hb->levels[level][i + 1], lastpos - i - 1);
+        i = lastpos;
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
 
     /* Same as above, this time for lastpos.  */
@@ -378,6 +649,175 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    /* Require at least 64 bit granularity to be safe on both 64 bit and 32 bit
+     * hosts. */
+    return UINT64_C(64) << hb->granularity;
+}
+
+/* Start should be aligned to serialization granularity, chunk size should be
+ * aligned to serialization granularity too, except for last chunk.
+ */
+static void serialization_chunk(const HBitmap *hb,
+                                uint64_t start, uint64_t count,
+                                unsigned long **first_el, uint64_t *el_count)
+{
+    uint64_t last = start + count - 1;
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+
+    assert((start & (gran - 1)) == 0);
+    assert((last >> hb->granularity) < hb->size);
+    if ((last >> hb->granularity) != hb->size - 1) {
+        assert((count & (gran - 1)) == 0);
+    }
+
+    start = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    last = (last >> hb->granularity) >> BITS_PER_LEVEL;
+
+    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *el_count = last - start + 1;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur;
+
+    if (!count) {
+        return 0;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+
+    return el_count * sizeof(unsigned long);
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+#ifndef HOST_WORDS_BIGENDIAN
+    /* The serialized format matches the in-memory one.  */
+    memcpy(buf, cur, el_count * sizeof(unsigned long));
+    cur = end;
+#endif
+    while (cur != end) {
+        unsigned long el =
+            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+
+        memcpy(buf, &el, sizeof(el));
+        buf += sizeof(el);
+        cur++;
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+#ifndef HOST_WORDS_BIGENDIAN
+    memcpy(cur, buf, el_count * sizeof(unsigned long));
+    cur = end;
+#endif
+    while (cur != end) {
+        memcpy(cur, buf, sizeof(*cur));
+
+        if (BITS_PER_LONG == 32) {
+            le32_to_cpus((uint32_t *)cur);
+        } else {
+            le64_to_cpus((uint64_t *)cur);
+        }
+
+        buf += sizeof(unsigned long);
+        cur++;
+    }
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+static void hbitmap_deserialize_fill(HBitmap *hb, uint64_t start,
+                                     uint64_t count, int c, bool finish)
+{
+    uint64_t el_count;
+    unsigned long *first;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first, &el_count);
+
+    memset(first, c, el_count * sizeof(unsigned long));
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish)
+{
+    hbitmap_deserialize_fill(hb, start, count, 0, finish);
+}
+
+void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
+                              bool finish)
+{
+    hbitmap_deserialize_fill(hb, start, count, 0xff, finish);
+}
+
+void hbitmap_deserialize_finish(HBitmap *bitmap)
+{
+    int64_t i, size, prev_size;
+    int lev;
+    unsigned tail = bitmap->size & (BITS_PER_LONG - 1);
+
+    /* Serialized data may have set bits past the end of the bitmap, drop
+     * them so that they are neither counted nor visited by iterators. */
+    if (tail) {
+        bitmap->levels[HBITMAP_LEVELS - 1][bitmap->size >> BITS_PER_LEVEL] &=
+            (1UL << tail) - 1;
+    }
+
+    /* restore levels starting from penultimate to zero level, assuming
+     * that the last level is ok */
+    size = MAX((bitmap->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+    for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
+        prev_size = size;
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
+
+        /* Skip runs of zero words quickly, this is a linear scan.  */
+        i = hb_find_nonzero(bitmap->levels[lev + 1], 0, prev_size);
+        while (i < prev_size) {
+            bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
+                1UL << (i & (BITS_PER_LONG - 1));
+            i = hb_find_nonzero(bitmap->levels[lev + 1], i + 1, prev_size);
+        }
+    }
+
+    bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    bitmap->count = bitmap->size ? hb_count_between(bitmap, 0,
+                                                    bitmap->size - 1) : 0;
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
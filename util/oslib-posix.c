@@ -39,6 +39,9 @@
 #include <libgen.h>
 #include <sys/signal.h>
 #include "qemu/cutils.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
@@ -132,6 +135,47 @@ void qemu_anon_ram_free(void *ptr, size_t size)
     qemu_ram_munmap(ptr, size);
 }
 
+void *qemu_alloc_stack(size_t *sz)
+{
+    void *ptr, *guardpage;
+    size_t pagesz = getpagesize();
+#ifdef _SC_THREAD_STACK_MIN
+    /* avoid stacks smaller than _SC_THREAD_STACK_MIN */
+    long min_stack_sz = sysconf(_SC_THREAD_STACK_MIN);
+    *sz = MAX(MAX(min_stack_sz, 0), *sz);
+#endif
+    /* adjust stack size to a multiple of the page size */
+    *sz = ROUND_UP(*sz, pagesz);
+    /* allocate one extra page for the guard page */
+    *sz += pagesz;
+
+    ptr = mmap(NULL, *sz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        abort();
+    }
+
+#if defined(HOST_IA64)
+    /* separate register stack */
+    guardpage = ptr + (((*sz - pagesz) / 2) & ~pagesz);
+#else
+    /* stack grows down */
+    guardpage = ptr;
+#endif
+    if (mprotect(guardpage, pagesz, PROT_NONE) != 0) {
+        abort();
+    }
+
+    trace_qemu_alloc_stack(*sz, ptr);
+    return ptr;
+}
+
+void qemu_free_stack(void *stack, size_t sz)
+{
+    trace_qemu_free_stack(stack, sz);
+    munmap(stack, sz);
+}
+
 void qemu_set_block(int fd)
 {
     int f;
@@ -311,56 +355,178 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+/* Preallocation is split into slices, each touched by its own thread.
+ * Page faults are serialized per VMA only for a small part of their cost
+ * (zeroing the page dominates, especially for huge pages), so this scales
+ * well with the number of host CPUs.  The pages are still faulted in
+ * within the memory policy of the VMA, so an mbind() done beforehand by
+ * the memory backend is honoured by every thread.
+ */
+typedef struct MemsetThread {
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    QemuThread pgthread;
+    sigjmp_buf env;
+} MemsetThread;
+
+/* Touched pages are accounted in batches of this many bytes, but at least
+ * one page, so that huge pages are reported one by one */
+#define MEMSET_PROGRESS_BYTES (1 * 1024 * 1024)
+
+/* Interval between progress reports, in milliseconds */
+#define MEMSET_PROGRESS_MS 1000
+
+static __thread MemsetThread *memset_thread_self;
+static bool memset_thread_failed;
+static size_t memset_pages_done;
+static QemuSemaphore memset_thread_done;
+static struct sigaction sigbus_oldact;
+
+static void sigbus_handler(int signal, siginfo_t *siginfo, void *ctx)
+{
+    /* SIGBUS is synchronous, so it is delivered to the faulting thread */
+    if (memset_thread_self) {
+        siglongjmp(memset_thread_self->env, 1);
+    }
+
+    /* Another thread faulted, e.g. on an mmap'ed image; returning would
+     * only restart the access */
+    if (sigbus_oldact.sa_flags & SA_SIGINFO) {
+        sigbus_oldact.sa_sigaction(signal, siginfo, ctx);
+    } else if (sigbus_oldact.sa_handler != SIG_DFL &&
+               sigbus_oldact.sa_handler != SIG_IGN) {
+        sigbus_oldact.sa_handler(signal);
+    } else {
+        /* The faulting access is restarted and kills the process */
+        sigaction(SIGBUS, &sigbus_oldact, NULL);
+    }
+}
+
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *memset_args = arg;
+    char *addr = memset_args->addr;
+    size_t batch = MAX(MEMSET_PROGRESS_BYTES / memset_args->hpagesize, 1);
+    size_t i;
+    sigset_t set, oldset;
+
+    /* Threads start with all signals blocked */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+
+    memset_thread_self = memset_args;
+    if (sigsetjmp(memset_args->env, 1)) {
+        atomic_set(&memset_thread_failed, true);
+    } else {
+        /* MAP_POPULATE silently ignores failures */
+        for (i = 0; i < memset_args->numpages; i++) {
+            memset(addr, 0, 1);
+            addr += memset_args->hpagesize;
+            if ((i + 1) % batch == 0) {
+                atomic_add(&memset_pages_done, batch);
+            }
+        }
+        atomic_add(&memset_pages_done, i % batch);
+    }
+    memset_thread_self = NULL;
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    qemu_sem_post(&memset_thread_done);
+    return NULL;
+}
+
+static int get_memset_num_threads(size_t numpages, int max_threads)
+{
+    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    int ret = MAX(max_threads, 1);
+
+    if (host_procs > 0) {
+        ret = MIN(ret, host_procs);
+    }
+    return MIN(ret, MAX(numpages, 1));
+}
 
-static void sigbus_handler(int signal)
+static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
+                            int max_threads)
 {
-    siglongjmp(sigjump, 1);
+    int num_threads = get_memset_num_threads(numpages, max_threads);
+    size_t numpages_per_thread = numpages / num_threads;
+    size_t leftover = numpages % num_threads;
+    MemsetThread *memset_thread;
+    char *addr = area;
+    int64_t start = get_clock();
+    int i, done;
+
+    trace_os_mem_prealloc(area, numpages, hpagesize, num_threads);
+
+    memset_thread_failed = false;
+    memset_pages_done = 0;
+    qemu_sem_init(&memset_thread_done, 0);
+    memset_thread = g_new0(MemsetThread, num_threads);
+    for (i = 0; i < num_threads; i++) {
+        memset_thread[i].addr = addr;
+        memset_thread[i].numpages = numpages_per_thread + (i < leftover);
+        memset_thread[i].hpagesize = hpagesize;
+        qemu_thread_create(&memset_thread[i].pgthread, "touch_pages",
+                           do_touch_pages, &memset_thread[i],
+                           QEMU_THREAD_JOINABLE);
+        addr += memset_thread[i].numpages * hpagesize;
+    }
+
+    /* Report progress while waiting for the threads */
+    for (done = 0; done < num_threads; ) {
+        if (qemu_sem_timedwait(&memset_thread_done, MEMSET_PROGRESS_MS) == 0) {
+            done++;
+        } else {
+            trace_os_mem_prealloc_progress(area,
+                                           atomic_read(&memset_pages_done),
+                                           numpages);
+        }
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        qemu_thread_join(&memset_thread[i].pgthread);
+    }
+    g_free(memset_thread);
+    qemu_sem_destroy(&memset_thread_done);
+
+    trace_os_mem_prealloc_done(area, (get_clock() - start) / SCALE_MS,
+                               memset_thread_failed);
+    return memset_thread_failed;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     Error **errp)
 {
     int ret;
-    struct sigaction act, oldact;
-    sigset_t set, oldset;
+    struct sigaction act;
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
 
     memset(&act, 0, sizeof(act));
-    act.sa_handler = &sigbus_handler;
-    act.sa_flags = 0;
+    act.sa_sigaction = &sigbus_handler;
+    act.sa_flags = SA_SIGINFO;
 
-    ret = sigaction(SIGBUS, &act, &oldact);
+    ret = sigaction(SIGBUS, &act, &sigbus_oldact);
     if (ret) {
         error_setg_errno(errp, errno,
             "os_mem_prealloc: failed to install signal handler");
         return;
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
-
-    if (sigsetjmp(sigjump, 1)) {
+    if (touch_all_pages(area, hpagesize, numpages, max_threads)) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
             "pages available to allocate guest RAM\n");
-    } else {
-        int i;
-        size_t hpagesize = qemu_fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
     }
 
-    ret = sigaction(SIGBUS, &oldact, NULL);
+    ret = sigaction(SIGBUS, &sigbus_oldact, NULL);
     if (ret) {
         /* Terminate QEMU since it can't recover from error */
         perror("os_mem_prealloc: failed to reinstall signal handler");
         exit(1);
     }
-    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
 }
 
 
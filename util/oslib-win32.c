@@ -95,6 +95,17 @@ void qemu_anon_ram_free(void *ptr, size_t size)
     }
 }
 
+void *qemu_alloc_stack(size_t *sz)
+{
+    /* Coroutines use fibers here, this is only for completeness */
+    return g_malloc(*sz);
+}
+
+void qemu_free_stack(void *stack, size_t sz)
+{
+    g_free(stack);
+}
+
 #ifndef CONFIG_LOCALTIME_R
 /* FIXME: add proper locking */
 struct tm *gmtime_r(const time_t *timep, struct tm *result)
@@ -539,7 +550,8 @@ int getpagesize(void)
     return system_info.dwPageSize;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     Error **errp)
 {
     int i;
     size_t pagesize = getpagesize();
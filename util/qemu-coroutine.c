@@ -24,11 +24,17 @@ enum {
     POOL_BATCH_SIZE = 64,
 };
 
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int release_pool_size;
+/* High watermark of each thread's pool */
+static unsigned int pool_batch_size = POOL_BATCH_SIZE;
+
+/** Free list to speed up creation.  Coroutines are returned to the pool of
+ * the thread where they terminate, and each thread only ever touches its
+ * own pool, so no atomic operations are needed to create or delete them.
+ */
 static __thread QSLIST_HEAD(, Coroutine) alloc_pool = QSLIST_HEAD_INITIALIZER(pool);
 static __thread unsigned int alloc_pool_size;
+static __thread uint64_t alloc_pool_hits;
+static __thread uint64_t alloc_pool_misses;
 static __thread Notifier coroutine_pool_cleanup_notifier;
 
 static void coroutine_pool_cleanup(Notifier *n, void *value)
@@ -36,10 +42,26 @@ static void coroutine_pool_cleanup(Notifier *n, void *value)
     Coroutine *co;
     Coroutine *tmp;
 
+    trace_qemu_coroutine_pool_cleanup(alloc_pool_size, alloc_pool_hits,
+                                      alloc_pool_misses);
+
     QSLIST_FOREACH_SAFE(co, &alloc_pool, pool_next, tmp) {
         QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
         qemu_coroutine_delete(co);
     }
+    alloc_pool_size = 0;
+}
+
+/* Frees the pool when the thread exits.  Coroutines can be created by one
+ * thread and terminate in another, so this is needed by every thread that
+ * puts something in its pool, not only by those that create coroutines.
+ */
+static void coroutine_pool_register_cleanup(void)
+{
+    if (!coroutine_pool_cleanup_notifier.notify) {
+        coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
+        qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
+    }
 }
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
@@ -48,26 +70,12 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 
     if (CONFIG_COROUTINE_POOL) {
         co = QSLIST_FIRST(&alloc_pool);
-        if (!co) {
-            if (release_pool_size > POOL_BATCH_SIZE) {
-                /* Slow path; a good place to register the destructor, too.  */
-                if (!coroutine_pool_cleanup_notifier.notify) {
-                    coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
-                    qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
-                }
-
-                /* This is not exact; there could be a little skew between
-                 * release_pool_size and the actual size of release_pool.  But
-                 * it is just a heuristic, it does not need to be perfect.
-                 */
-                alloc_pool_size = atomic_xchg(&release_pool_size, 0);
-                QSLIST_MOVE_ATOMIC(&alloc_pool, &release_pool);
-                co = QSLIST_FIRST(&alloc_pool);
-            }
-        }
         if (co) {
             QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
             alloc_pool_size--;
+            alloc_pool_hits++;
+        } else {
+            alloc_pool_misses++;
         }
     }
 
@@ -86,12 +94,8 @@ static void coroutine_delete(Coroutine *co)
     co->caller = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        if (release_pool_size < POOL_BATCH_SIZE * 2) {
-            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
-            atomic_inc(&release_pool_size);
-            return;
-        }
-        if (alloc_pool_size < POOL_BATCH_SIZE) {
+        if (alloc_pool_size < atomic_read(&pool_batch_size)) {
+            coroutine_pool_register_cleanup();
             QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
             alloc_pool_size++;
             return;
@@ -101,6 +105,23 @@ static void coroutine_delete(Coroutine *co)
     qemu_coroutine_delete(co);
 }
 
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats)
+{
+    stats->hits = alloc_pool_hits;
+    stats->misses = alloc_pool_misses;
+    stats->size = alloc_pool_size;
+}
+
+void qemu_coroutine_increase_pool_batch_size(unsigned int additional_pool_size)
+{
+    atomic_add(&pool_batch_size, additional_pool_size);
+}
+
+void qemu_coroutine_decrease_pool_batch_size(unsigned int removing_pool_size)
+{
+    atomic_sub(&pool_batch_size, removing_pool_size);
+}
+
 void qemu_coroutine_enter(Coroutine *co)
 {
     Coroutine *self = qemu_coroutine_self();
@@ -22,8 +22,9 @@
  * - Writes (i.e. insertions/removals) can be concurrent with writes to
  *   different buckets; writes to the same bucket are serialized through a lock.
  * - Optional auto-resizing: the hash table resizes up if the load surpasses
- *   a certain threshold. Resizing is done concurrently with readers; writes
- *   are serialized with the resize operation.
+ *   a certain threshold, and down (but not below the size it was created
+ *   with) once most head buckets are empty. Resizing is done concurrently
+ *   with readers; writes are serialized with the resize operation.
  *
  * The key structure is the bucket, which is cacheline-sized. Buckets
  * contain a few hash values and pointers; the u32 hash values are stored in
@@ -119,6 +120,10 @@ QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @n_used_head_buckets: number of non-empty head buckets
+ * @n_used_head_buckets_threshold: threshold to trigger a downward resize once
+ *                                 the number of non-empty head buckets falls
+ *                                 below it.
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
  */
@@ -128,13 +133,19 @@ struct qht_map {
     size_t n_buckets;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    size_t n_used_head_buckets;
+    size_t n_used_head_buckets_threshold;
 };
 
 /* trigger a resize when n_added_buckets > n_buckets / div */
 #define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
 
+/* trigger a downward resize when n_used_head_buckets < n_buckets / div */
+#define QHT_NR_USED_HEAD_BUCKETS_THRESHOLD_DIV 8
+
 static void qht_do_resize(struct qht *ht, struct qht_map *new);
 static void qht_grow_maybe(struct qht *ht);
+static void qht_shrink_maybe(struct qht *ht);
 
 #ifdef QHT_DEBUG
 
@@ -301,6 +312,12 @@ static inline bool qht_map_needs_resize(struct qht_map *map)
     return atomic_read(&map->n_added_buckets) > map->n_added_buckets_threshold;
 }
 
+static inline bool qht_map_needs_shrink(struct qht_map *map)
+{
+    return atomic_read(&map->n_used_head_buckets) <
+           map->n_used_head_buckets_threshold;
+}
+
 static inline void qht_chain_destroy(struct qht_bucket *head)
 {
     struct qht_bucket *curr = head->next;
@@ -325,7 +342,7 @@ static void qht_map_destroy(struct qht_map *map)
     g_free(map);
 }
 
-static struct qht_map *qht_map_create(size_t n_buckets)
+static struct qht_map *qht_map_create(struct qht *ht, size_t n_buckets)
 {
     struct qht_map *map;
     size_t i;
@@ -342,6 +359,15 @@ static struct qht_map *qht_map_create(size_t n_buckets)
         map->n_added_buckets_threshold = 1;
     }
 
+    /* never shrink below the size requested by the user */
+    map->n_used_head_buckets = 0;
+    if (n_buckets > ht->n_buckets_min) {
+        map->n_used_head_buckets_threshold = n_buckets /
+            QHT_NR_USED_HEAD_BUCKETS_THRESHOLD_DIV;
+    } else {
+        map->n_used_head_buckets_threshold = 0;
+    }
+
     map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
                                  sizeof(*map->buckets) * n_buckets);
     for (i = 0; i < n_buckets; i++) {
@@ -356,8 +382,9 @@ void qht_init(struct qht *ht, size_t n_elems, unsigned int mode)
     size_t n_buckets = qht_elems_to_buckets(n_elems);
 
     ht->mode = mode;
+    ht->n_buckets_min = n_buckets;
     qemu_mutex_init(&ht->lock);
-    map = qht_map_create(n_buckets);
+    map = qht_map_create(ht, n_buckets);
     atomic_rcu_set(&ht->map, map);
 }
 
@@ -396,6 +423,7 @@ static void qht_map_reset__all_locked(struct qht_map *map)
     for (i = 0; i < map->n_buckets; i++) {
         qht_bucket_reset__locked(&map->buckets[i]);
     }
+    atomic_set(&map->n_used_head_buckets, 0);
     qht_map_debug__all_locked(map);
 }
 
@@ -418,9 +446,10 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
     n_buckets = qht_elems_to_buckets(n_elems);
 
     qemu_mutex_lock(&ht->lock);
+    ht->n_buckets_min = n_buckets;
     map = ht->map;
     if (n_buckets != map->n_buckets) {
-        new = qht_map_create(n_buckets);
+        new = qht_map_create(ht, n_buckets);
         resize = true;
     }
 
@@ -533,6 +562,10 @@ static bool qht_insert__locked(struct qht *ht, struct qht_map *map,
     }
 
  found:
+    if (b == head && i == 0) {
+        atomic_inc(&map->n_used_head_buckets);
+    }
+
     /* found an empty key: acquire the seqlock and write */
     seqlock_write_begin(&head->sequence);
     if (new) {
@@ -559,7 +592,38 @@ static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
     map = ht->map;
     /* another thread might have just performed the resize we were after */
     if (qht_map_needs_resize(map)) {
-        struct qht_map *new = qht_map_create(map->n_buckets * 2);
+        struct qht_map *new = qht_map_create(ht, map->n_buckets * 2);
+
+        qht_map_lock_buckets(map);
+        qht_do_resize(ht, new);
+        qht_map_unlock_buckets(map);
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+static __attribute__((noinline)) void qht_shrink_maybe(struct qht *ht)
+{
+    struct qht_map *map;
+    size_t used;
+
+    /* as in qht_grow_maybe, bail out if a resize might be ongoing */
+    if (qemu_mutex_trylock(&ht->lock)) {
+        return;
+    }
+    map = ht->map;
+    /* writers to other buckets may still change it, read it only once */
+    used = atomic_read(&map->n_used_head_buckets);
+    if (used < map->n_used_head_buckets_threshold) {
+        size_t n_buckets;
+        struct qht_map *new;
+
+        /*
+         * Aim for a quarter to a half of the head buckets in use.  This is
+         * always smaller than the current map, since the threshold is a
+         * small fraction of it.
+         */
+        n_buckets = MAX(pow2ceil(MAX(used, 1)) * 2, ht->n_buckets_min);
+        new = qht_map_create(ht, n_buckets);
 
         qht_map_lock_buckets(map);
         qht_do_resize(ht, new);
@@ -650,7 +714,7 @@ static inline void qht_bucket_remove_entry(struct qht_bucket *orig, int pos)
 /* call with b->lock held */
 static inline
 bool qht_remove__locked(struct qht_map *map, struct qht_bucket *head,
-                        const void *p, uint32_t hash)
+                        const void *p, uint32_t hash, bool *needs_shrink)
 {
     struct qht_bucket *b = head;
     int i;
@@ -667,6 +731,12 @@ bool qht_remove__locked(struct qht_map *map, struct qht_bucket *head,
                 seqlock_write_begin(&head->sequence);
                 qht_bucket_remove_entry(b, i);
                 seqlock_write_end(&head->sequence);
+                if (head->pointers[0] == NULL) {
+                    atomic_dec(&map->n_used_head_buckets);
+                    if (unlikely(qht_map_needs_shrink(map)) && needs_shrink) {
+                        *needs_shrink = true;
+                    }
+                }
                 return true;
             }
         }
@@ -679,15 +749,20 @@ bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
 {
     struct qht_bucket *b;
     struct qht_map *map;
+    bool needs_shrink = false;
     bool ret;
 
     /* NULL pointers are not supported */
     qht_debug_assert(p);
 
     b = qht_bucket_lock__no_stale(ht, hash, &map);
-    ret = qht_remove__locked(map, b, p, hash);
+    ret = qht_remove__locked(map, b, p, hash, &needs_shrink);
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
+
+    if (unlikely(needs_shrink) && ht->mode & QHT_MODE_AUTO_RESIZE) {
+        qht_shrink_maybe(ht);
+    }
     return ret;
 }
 
@@ -770,7 +845,7 @@ bool qht_resize(struct qht *ht, size_t n_elems)
         struct qht_map *new;
         struct qht_map *old = ht->map;
 
-        new = qht_map_create(n_buckets);
+        new = qht_map_create(ht, n_buckets);
         qht_map_lock_buckets(old);
         qht_do_resize(ht, new);
         qht_map_unlock_buckets(old);